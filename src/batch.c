@@ -0,0 +1,384 @@
+#include <string.h>
+
+#include "inc.h"
+
+#define COOLHASH_BATCH_CHUNK 64 /**< Keys grouped by shard at a time */
+#define COOLHASH_BATCH_INFLIGHT 8 /**< Lookups interleaved per shard */
+#define COOLHASH_BATCH_AHEAD 4 /**< Cuckoo lookups prefetched ahead */
+
+#define COOLHASH_BATCH_IDLE 0 /**< State machine has no lookup */
+#define COOLHASH_BATCH_BUCKET 1 /**< Bucket slot is being fetched */
+#define COOLHASH_BATCH_NODE 2 /**< Chain node is being fetched */
+#define COOLHASH_BATCH_COPY 3 /**< Node data is being fetched */
+
+struct coolhash_batch_lookup {
+        int stage; /**< COOLHASH_BATCH_* */
+        unsigned int idx; /**< Index into the caller's key array */
+        struct coolhash_node **bucket; /**< Bucket the key hashes to */
+        struct coolhash_node *node; /**< Node being looked at */
+        unsigned int len; /**< Nodes stepped over so far */
+};
+
+static unsigned int _coolhash_batch_chain(struct coolhash *ch,
+                const coolhash_key_t *keys, unsigned int n, char *dst,
+                size_t dst_len, int *res);
+static unsigned int _coolhash_batch_shard(struct coolhash_table *table,
+                const coolhash_key_t *keys, const unsigned int *idxs,
+                unsigned int cnt, char *dst, size_t dst_len, int *res,
+                unsigned int *busy, unsigned int *nbusy);
+static void _coolhash_batch_start(struct coolhash_table *table,
+                struct coolhash_batch_lookup *l, const coolhash_key_t *keys,
+                unsigned int idx);
+static int _coolhash_batch_step(struct coolhash_batch_lookup *l,
+                const coolhash_key_t *keys, char *dst, size_t dst_len);
+static unsigned int _coolhash_batch_cuckoo(struct coolhash *ch,
+                const coolhash_key_t *keys, unsigned int n, char *dst,
+                size_t dst_len, int *res);
+static unsigned int _coolhash_batch_small(struct coolhash *ch,
+                const coolhash_key_t *keys, unsigned int n, char *dst,
+                size_t dst_len, int *res);
+
+/**
+ * @brief Look up many keys at once, copying each item's data into an output
+ * array. Lookups are run as small state machines that issue a prefetch and
+ * move on to the next lookup while the cache line loads, so the dependent
+ * misses of one lookup (bucket, node, next node, data) overlap with those of
+ * the others. This pays off on tables much bigger than the CPU cache.
+ *
+ * Keys are taken COOLHASH_BATCH_CHUNK at a time and each shard involved is
+ * locked once per chunk, so keep the batches of a latency-sensitive writer
+ * short. The shard lock is never held while waiting for an item another
+ * thread holds: such keys are looked up again one by one, through
+ * coolhash_get_copy, once the shard is let go. That wait is the one
+ * coolhash_get_copy does, with the key's shard locked, so a thread holding
+ * one of the keys must not need that shard (coolhash_set, coolhash_del) until
+ * it unlocks the item.
+ *
+ * @param ch coolhash instance
+ * @param keys Hashed keys
+ * @param n Number of keys
+ * @param dst Destination array of n buffers; key i is copied to
+ * dst + i * dst_len
+ * @param dst_len Length of each buffer
+ * @param res Filled in with each key's coolhash_get_copy result (optional)
+ *
+ * @return Number of keys found or -1 on error
+ */
+int coolhash_get_copy_batch(struct coolhash *ch, const coolhash_key_t *keys,
+                unsigned int n, void *dst, size_t dst_len, int *res)
+{
+        if (ch == NULL || (n > 0 && (keys == NULL || dst == NULL)) ||
+                        dst_len <= 0)
+                return -1;
+
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return (int) _coolhash_batch_cuckoo(ch, keys, n, dst, dst_len,
+                                res);
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return (int) _coolhash_batch_small(ch, keys, n, dst, dst_len,
+                                res);
+
+        return (int) _coolhash_batch_chain(ch, keys, n, dst, dst_len, res);
+}
+
+/**
+ * @brief Batch lookup on chained tables: group a chunk of keys by shard and
+ * run each group under one shard lock
+ *
+ * @param ch coolhash instance
+ * @param keys Hashed keys
+ * @param n Number of keys
+ * @param dst Destination array
+ * @param dst_len Length of each destination buffer
+ * @param res Per-key results (optional)
+ *
+ * @return Number of keys found
+ */
+static unsigned int _coolhash_batch_chain(struct coolhash *ch,
+                const coolhash_key_t *keys, unsigned int n, char *dst,
+                size_t dst_len, int *res)
+{
+        struct coolhash_table *table;
+        unsigned int idxs[COOLHASH_BATCH_CHUNK];
+        unsigned int shards[COOLHASH_BATCH_CHUNK];
+        unsigned int busy[COOLHASH_BATCH_CHUNK];
+        unsigned int base, len, i, j, cnt, nbusy, shard, found;
+        unsigned char done[COOLHASH_BATCH_CHUNK];
+        int r;
+
+        found = 0;
+        for (base = 0; base < n; base += len) {
+                len = n - base;
+                if (len > COOLHASH_BATCH_CHUNK)
+                        len = COOLHASH_BATCH_CHUNK;
+
+                for (i = 0; i < len; i++) {
+                        shards[i] = keys[base + i] % ch->profile.shards;
+                        done[i] = 0;
+                        if (res)
+                                res[base + i] = -1;
+
+                        /* Known-absent keys never touch the table */
+                        if (ch->profile.bloom_bits &&
+                                        !_coolhash_bloom_maybe(
+                                                &ch->tables[shards[i]],
+                                                keys[base + i]))
+                                done[i] = 1;
+                }
+
+                for (i = 0; i < len; i++) {
+                        if (done[i])
+                                continue;
+
+                        shard = shards[i];
+                        cnt = 0;
+                        for (j = i; j < len; j++) {
+                                if (done[j] || shards[j] != shard)
+                                        continue;
+                                done[j] = 1;
+                                idxs[cnt++] = base + j;
+                        }
+
+                        table = &ch->tables[shard];
+                        nbusy = 0;
+                        _coolhash_table_lock(table);
+                        found += _coolhash_batch_shard(table, keys, idxs, cnt,
+                                        dst, dst_len, res, busy, &nbusy);
+                        _coolhash_table_unlock(table);
+
+                        /* Items somebody holds are waited for on their own */
+                        for (j = 0; j < nbusy; j++) {
+                                r = coolhash_get_copy(ch, keys[busy[j]],
+                                                dst + (size_t) busy[j] *
+                                                dst_len, dst_len);
+                                if (r == 0)
+                                        found++;
+                                if (res)
+                                        res[busy[j]] = r;
+                        }
+                }
+        }
+
+        return found;
+}
+
+/**
+ * @brief Run interleaved lookups of keys that all belong to one shard - the
+ * table must be locked
+ *
+ * @param table Table
+ * @param keys Hashed keys
+ * @param idxs Indexes of the keys to look up
+ * @param cnt Number of indexes
+ * @param dst Destination array
+ * @param dst_len Length of each destination buffer
+ * @param res Per-key results (optional)
+ * @param busy Filled in with the indexes of keys whose item was locked
+ * @param nbusy Incremented for every index added to busy
+ *
+ * @return Number of keys found
+ */
+static unsigned int _coolhash_batch_shard(struct coolhash_table *table,
+                const coolhash_key_t *keys, const unsigned int *idxs,
+                unsigned int cnt, char *dst, size_t dst_len, int *res,
+                unsigned int *busy, unsigned int *nbusy)
+{
+        struct coolhash_batch_lookup l[COOLHASH_BATCH_INFLIGHT];
+        unsigned int next, active, found, k;
+        int r;
+
+        next = 0;
+        active = 0;
+        for (k = 0; k < COOLHASH_BATCH_INFLIGHT; k++) {
+                l[k].stage = COOLHASH_BATCH_IDLE;
+                if (next < cnt) {
+                        _coolhash_batch_start(table, &l[k], keys,
+                                        idxs[next++]);
+                        active++;
+                }
+        }
+
+        found = 0;
+        while (active > 0) {
+                for (k = 0; k < COOLHASH_BATCH_INFLIGHT; k++) {
+                        if (l[k].stage == COOLHASH_BATCH_IDLE)
+                                continue;
+
+                        r = _coolhash_batch_step(&l[k], keys, dst, dst_len);
+                        if (r == 1)
+                                continue; /* Still waiting on memory */
+
+                        COOLHASH_PROBE3(chain_walk, table, keys[l[k].idx],
+                                        l[k].len);
+
+                        if (r == 2)
+                                busy[(*nbusy)++] = l[k].idx;
+                        else if (r == 0)
+                                found++;
+                        if (res && r != 2)
+                                res[l[k].idx] = r;
+
+                        /* Refill the slot so the pipeline stays full */
+                        if (next < cnt) {
+                                _coolhash_batch_start(table, &l[k], keys,
+                                                idxs[next++]);
+                        } else {
+                                l[k].stage = COOLHASH_BATCH_IDLE;
+                                active--;
+                        }
+                }
+        }
+
+        return found;
+}
+
+/**
+ * @brief Start a lookup by prefetching the bucket its key hashes to
+ *
+ * @param table Table
+ * @param l Lookup state
+ * @param keys Hashed keys
+ * @param idx Index of the key to look up
+ */
+static void _coolhash_batch_start(struct coolhash_table *table,
+                struct coolhash_batch_lookup *l, const coolhash_key_t *keys,
+                unsigned int idx)
+{
+        l->idx = idx;
+        l->len = 0;
+        l->bucket = &table->nodes[keys[idx] % table->size];
+        l->stage = COOLHASH_BATCH_BUCKET;
+        __builtin_prefetch(l->bucket, 0, 1);
+}
+
+/**
+ * @brief Advance a lookup by one dependent load; the memory it touches was
+ * prefetched by the previous step
+ *
+ * @param l Lookup state
+ * @param keys Hashed keys
+ * @param dst Destination array
+ * @param dst_len Length of each destination buffer
+ *
+ * @return 1 if the lookup needs another step, 0 if it found the item (the
+ * data was copied), 2 if another thread holds the item, -1 if the key is not
+ * in the table
+ */
+static int _coolhash_batch_step(struct coolhash_batch_lookup *l,
+                const coolhash_key_t *keys, char *dst, size_t dst_len)
+{
+        struct coolhash_node *node;
+
+        switch (l->stage) {
+        case COOLHASH_BATCH_BUCKET:
+                l->node = *l->bucket;
+                break;
+        case COOLHASH_BATCH_NODE:
+                node = l->node;
+                if (node->key != keys[l->idx]) {
+                        l->node = node->next;
+                        l->len++;
+                        break;
+                }
+                if (node->del)
+                        return -1;
+
+                l->stage = COOLHASH_BATCH_COPY;
+                __builtin_prefetch(node->data, 0, 1);
+                return 1;
+        case COOLHASH_BATCH_COPY:
+                node = l->node;
+                /* Waiting here, with the shard locked, could deadlock with
+                 * a holder that needs the shard to delete the item */
+                if (pthread_rwlock_tryrdlock(&node->node_mx) != 0)
+                        return 2;
+                COOLHASH_PROBE3(node_lock_acquire, node, 1, 0);
+                memcpy(dst + (size_t) l->idx * dst_len, node->data, dst_len);
+                _coolhash_node_unlock(node);
+                return 0;
+        }
+
+        if (l->node == NULL)
+                return -1;
+
+        l->stage = COOLHASH_BATCH_NODE;
+        __builtin_prefetch(l->node, 0, 1);
+        return 1;
+}
+
+/**
+ * @brief Batch lookup on cuckoo tables. Every lookup is a single step (two
+ * buckets, no lock), so the buckets of the next few keys are simply
+ * prefetched while the current one is looked up.
+ *
+ * @param ch coolhash instance
+ * @param keys Hashed keys
+ * @param n Number of keys
+ * @param dst Destination array
+ * @param dst_len Length of each destination buffer
+ * @param res Per-key results (optional)
+ *
+ * @return Number of keys found
+ */
+static unsigned int _coolhash_batch_cuckoo(struct coolhash *ch,
+                const coolhash_key_t *keys, unsigned int n, char *dst,
+                size_t dst_len, int *res)
+{
+        unsigned int i, found;
+        int r;
+
+        for (i = 0; i < n && i < COOLHASH_BATCH_AHEAD; i++)
+                _coolhash_cuckoo_prefetch(ch, keys[i]);
+
+        found = 0;
+        for (i = 0; i < n; i++) {
+                if (i + COOLHASH_BATCH_AHEAD < n)
+                        _coolhash_cuckoo_prefetch(ch,
+                                        keys[i + COOLHASH_BATCH_AHEAD]);
+
+                r = _coolhash_cuckoo_get_copy(ch, keys[i],
+                                dst + (size_t) i * dst_len, dst_len);
+                if (r == 0)
+                        found++;
+                if (res)
+                        res[i] = r;
+        }
+
+        return found;
+}
+
+/**
+ * @brief Batch lookup on small engine tables: one key after the other. The
+ * buckets are only stable under the shard lock, which each lookup takes and
+ * drops, so there is nothing to prefetch ahead of it.
+ *
+ * @param ch coolhash instance
+ * @param keys Hashed keys
+ * @param n Number of keys
+ * @param dst Destination array
+ * @param dst_len Length of each destination buffer
+ * @param res Per-key results (optional)
+ *
+ * @return Number of keys found
+ */
+static unsigned int _coolhash_batch_small(struct coolhash *ch,
+                const coolhash_key_t *keys, unsigned int n, char *dst,
+                size_t dst_len, int *res)
+{
+        unsigned int i, found;
+        int r;
+
+        found = 0;
+        for (i = 0; i < n; i++) {
+                r = _coolhash_small_get_copy(ch, keys[i],
+                                dst + (size_t) i * dst_len, dst_len);
+                if (r == 0)
+                        found++;
+                if (res)
+                        res[i] = r;
+        }
+
+        return found;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+
+#include "inc.h"
+
+static uint64_t _coolhash_bloom_mask(uint64_t hash);
+static void _coolhash_bloom_fill(struct coolhash_table *table,
+                uint64_t *words, unsigned int nwords);
+
+/**
+ * @brief Check the Bloom filter without taking any lock
+ *
+ * @param table Table the key belongs to
+ * @param key Hashed key
+ *
+ * @return Zero if the key is definitely not in the table
+ */
+int _coolhash_bloom_maybe(struct coolhash_table *table, coolhash_key_t key)
+{
+        struct coolhash_bloom *bloom;
+        uint64_t hash, mask, word;
+
+        bloom = __atomic_load_n(&table->bloom, __ATOMIC_ACQUIRE);
+        hash = _coolhash_mix(key);
+        mask = _coolhash_bloom_mask(hash);
+        word = __atomic_load_n(&bloom->words[(hash >> 32) % bloom->nwords],
+                        __ATOMIC_ACQUIRE);
+
+        return (word & mask) == mask;
+}
+
+/**
+ * @brief Add a key to a Bloom filter - the table must be locked
+ *
+ * @param bloom Filter
+ * @param key Hashed key
+ */
+void _coolhash_bloom_add(struct coolhash_bloom *bloom, coolhash_key_t key)
+{
+        uint64_t hash, *word;
+
+        hash = _coolhash_mix(key);
+        word = &bloom->words[(hash >> 32) % bloom->nwords];
+
+        __atomic_store_n(word, *word | _coolhash_bloom_mask(hash),
+                        __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Rebuild a table's Bloom filter from its live nodes, dropping the
+ * bits of deleted keys - the table must be locked. When the table has grown
+ * past the filter, a bigger filter is published and the old one is retired
+ * (lock-free readers may still be looking at it; it is freed with the
+ * table). Otherwise the filter is rewritten in place one block at a time;
+ * every block only ever goes from a superset of the live keys' bits to
+ * exactly those bits, so readers never see a false negative.
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ *
+ * @return Non-zero error (no memory and no filter to fall back on)
+ */
+int _coolhash_bloom_rebuild(struct coolhash *ch, struct coolhash_table *table)
+{
+        struct coolhash_bloom *bloom, *old;
+        uint64_t *words;
+        unsigned int i, nwords;
+
+        nwords = (unsigned int) (((uint64_t) table->size *
+                                ch->profile.bloom_bits + 63) / 64);
+        if (nwords < 1)
+                nwords = 1;
+
+        old = table->bloom;
+        if (old == NULL || nwords > old->nwords) {
+                bloom = calloc(1, sizeof(*bloom) +
+                                (size_t) nwords * sizeof(*bloom->words));
+                if (bloom == NULL)
+                        return old ? 0 : -1;
+
+                bloom->nwords = nwords;
+                _coolhash_bloom_fill(table, bloom->words, nwords);
+
+                bloom->next = old;
+                __atomic_store_n(&table->bloom, bloom, __ATOMIC_RELEASE);
+                return 0;
+        }
+
+        words = calloc(old->nwords, sizeof(*words));
+        if (words == NULL)
+                return 0; /* Stale bits only cost us false positives */
+
+        _coolhash_bloom_fill(table, words, old->nwords);
+        for (i = 0; i < old->nwords; i++)
+                __atomic_store_n(&old->words[i], words[i], __ATOMIC_RELEASE);
+
+        free(words);
+        return 0;
+}
+
+/**
+ * @brief Free a table's Bloom filter and every filter it retired
+ *
+ * @param table Table
+ */
+void _coolhash_bloom_free(struct coolhash_table *table)
+{
+        struct coolhash_bloom *bloom, *bloomn;
+
+        for (bloom = table->bloom; bloom; bloom = bloomn) {
+                bloomn = bloom->next;
+                free(bloom);
+        }
+        table->bloom = NULL;
+}
+
+/**
+ * @brief Set the bits of every live node in a block array
+ *
+ * @param table Table
+ * @param words Zeroed blocks
+ * @param nwords Number of blocks
+ */
+static void _coolhash_bloom_fill(struct coolhash_table *table,
+                uint64_t *words, unsigned int nwords)
+{
+        struct coolhash_node *node;
+        uint64_t hash;
+        unsigned int i;
+
+        for (i = 0; i < table->size; i++) {
+                for (node = table->nodes[i]; node; node = node->next) {
+                        if (node->del)
+                                continue;
+
+                        hash = _coolhash_mix(node->key);
+                        words[(hash >> 32) % nwords] |=
+                                _coolhash_bloom_mask(hash);
+                }
+        }
+}
+
+/**
+ * @brief Four bit positions within a block, taken from the low hash bits
+ *
+ * @param hash Mixed hash
+ *
+ * @return Block mask
+ */
+static uint64_t _coolhash_bloom_mask(uint64_t hash)
+{
+        return (1ULL << (hash & 63)) |
+                (1ULL << ((hash >> 6) & 63)) |
+                (1ULL << ((hash >> 12) & 63)) |
+                (1ULL << ((hash >> 18) & 63));
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
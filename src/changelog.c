@@ -0,0 +1,155 @@
+#include <errno.h>
+
+#include "inc.h"
+
+/**
+ * @brief Record a change in a shard's log - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table the change was made to
+ * @param op COOLHASH_CHANGE_SET or COOLHASH_CHANGE_DEL
+ * @param key Hashed key
+ * @param data Node data
+ */
+void _coolhash_changelog_append(struct coolhash *ch,
+                struct coolhash_table *table, int op, coolhash_key_t key,
+                void *data)
+{
+        struct coolhash_change *change;
+
+        table->log_seq++;
+
+        change = &table->log[(table->log_seq - 1) % ch->profile.changelog];
+        change->seq = table->log_seq;
+        change->op = op;
+        change->key = key;
+        change->data = data;
+}
+
+/**
+ * @brief Get the sequence number of the last change made to a shard
+ *
+ * @param ch coolhash instance
+ * @param shard Shard number
+ *
+ * @return Sequence number (0 if nothing has changed yet)
+ */
+uint64_t coolhash_changelog_seq(struct coolhash *ch, unsigned int shard)
+{
+        struct coolhash_table *table;
+        uint64_t seq;
+
+        if (ch == NULL || shard >= ch->profile.shards)
+                return 0;
+
+        table = &ch->tables[shard];
+
+        _coolhash_table_lock(table);
+        seq = table->log_seq;
+        _coolhash_table_unlock(table);
+
+        return seq;
+}
+
+/**
+ * @brief Copy the changes made to a shard after a given sequence number, in
+ * order. The data pointers are whatever was stored at the time of the change;
+ * it is up to you to keep them valid for as long as a consumer may read them.
+ *
+ * @param ch coolhash instance
+ * @param shard Shard number
+ * @param since Last sequence number already consumed (0 for everything)
+ * @param changes Destination array
+ * @param max Size of the destination array
+ *
+ * @return Number of changes copied, -1 on error or -ERANGE if changes after
+ * 'since' were already overwritten; start over with
+ * coolhash_changelog_snapshot in that case
+ */
+int coolhash_changelog_read(struct coolhash *ch, unsigned int shard,
+                uint64_t since, struct coolhash_change *changes,
+                unsigned int max)
+{
+        struct coolhash_table *table;
+        uint64_t seq, oldest;
+        unsigned int n;
+
+        if (ch == NULL || shard >= ch->profile.shards || changes == NULL ||
+                        ch->profile.changelog == 0)
+                return -1;
+
+        table = &ch->tables[shard];
+
+        _coolhash_table_lock(table);
+
+        if (since > table->log_seq) {
+                _coolhash_table_unlock(table);
+                return -1;
+        }
+
+        oldest = 1;
+        if (table->log_seq > ch->profile.changelog)
+                oldest = table->log_seq - ch->profile.changelog + 1;
+        if (since + 1 < oldest) {
+                _coolhash_table_unlock(table);
+                return -ERANGE;
+        }
+
+        n = 0;
+        for (seq = since + 1; seq <= table->log_seq && n < max; seq++)
+                changes[n++] = table->log[(seq - 1) % ch->profile.changelog];
+
+        _coolhash_table_unlock(table);
+
+        return (int) n;
+}
+
+/**
+ * @brief Stream every item of a shard to a callback, along with the sequence
+ * number the stream is consistent with. Following up with
+ * coolhash_changelog_read from that sequence number picks up exactly the
+ * changes made after the snapshot. The shard is locked while this runs, so
+ * keep the callback short and do not call back into coolhash from it.
+ *
+ * @param ch coolhash instance
+ * @param shard Shard number
+ * @param cb Callback function (required)
+ * @param cb_arg Callback function argument (optional)
+ * @param seq Filled in with the sequence number of the snapshot (optional)
+ *
+ * @return Non-zero error (also with engines other than COOLHASH_ENGINE_CHAIN,
+ * which keep no change log)
+ */
+int coolhash_changelog_snapshot(struct coolhash *ch, unsigned int shard,
+                coolhash_changelog_func cb, void *cb_arg, uint64_t *seq)
+{
+        struct coolhash_table *table;
+        struct coolhash_node *n;
+        unsigned int i;
+
+        if (ch == NULL || shard >= ch->profile.shards || cb == NULL ||
+                        ch->profile.engine != COOLHASH_ENGINE_CHAIN)
+                return -1;
+
+        table = &ch->tables[shard];
+
+        _coolhash_table_lock(table);
+
+        for (i = 0; i < table->size; i++) {
+                for (n = table->nodes[i]; n; n = n->next) {
+                        if (n->del)
+                                continue;
+
+                        cb(n->key, n->data, cb_arg);
+                }
+        }
+
+        if (seq)
+                *seq = table->log_seq;
+
+        _coolhash_table_unlock(table);
+
+        return 0;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,166 @@
+#include <sched.h>
+#include <stdint.h>
+
+#include "inc.h"
+
+#define COOLHASH_FC_FREE 0 /**< Slot is unused */
+#define COOLHASH_FC_CLAIMED 1 /**< Slot is being filled in by its owner */
+#define COOLHASH_FC_PENDING 2 /**< Request is waiting for a combiner */
+#define COOLHASH_FC_DONE 3 /**< Request was executed, result is valid */
+
+#define COOLHASH_FC_SPINS 64 /**< Spins before yielding the CPU */
+
+static struct coolhash_fc_slot *_coolhash_combine_claim(
+                struct coolhash_table *table);
+static int _coolhash_combine_exec(struct coolhash *ch,
+                struct coolhash_table *table, int op, coolhash_key_t key,
+                void *ptr, size_t len);
+static void _coolhash_combine_pass(struct coolhash *ch,
+                struct coolhash_table *table);
+
+/**
+ * @brief Execute a request on a table shard using flat combining. The
+ * request is published in one of the shard's slots; then the thread either
+ * gets the shard lock and executes everything pending, or waits for the
+ * current lock holder to do it.
+ *
+ * @param ch coolhash instance
+ * @param table Table the key belongs to
+ * @param op COOLHASH_FC_SET or COOLHASH_FC_GET_COPY
+ * @param key Hashed key
+ * @param ptr Data to set or destination buffer
+ * @param len Destination buffer length
+ *
+ * @return Result of the operation
+ */
+int _coolhash_combine(struct coolhash *ch, struct coolhash_table *table,
+                int op, coolhash_key_t key, void *ptr, size_t len)
+{
+        struct coolhash_fc_slot *slot;
+        unsigned int spins;
+        int res;
+
+        slot = _coolhash_combine_claim(table);
+        if (slot == NULL) {
+                /* More threads than slots, just take the lock */
+                _coolhash_table_lock(table);
+                res = _coolhash_combine_exec(ch, table, op, key, ptr, len);
+                _coolhash_combine_pass(ch, table);
+                _coolhash_table_unlock(table);
+                return res;
+        }
+
+        slot->op = op;
+        slot->key = key;
+        slot->ptr = ptr;
+        slot->len = len;
+        __atomic_store_n(&slot->state, COOLHASH_FC_PENDING, __ATOMIC_RELEASE);
+
+        for (spins = 0;; spins++) {
+                if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) ==
+                                COOLHASH_FC_DONE)
+                        break;
+
+                if (pthread_mutex_trylock(&table->table_mx) == 0) {
+                        /* We are the combiner now; our own request is
+                         * picked up along with everybody else's. */
+                        _coolhash_combine_pass(ch, table);
+                        _coolhash_table_unlock(table);
+                        break;
+                }
+
+                if (spins % COOLHASH_FC_SPINS == COOLHASH_FC_SPINS - 1)
+                        sched_yield();
+        }
+
+        res = slot->res;
+        __atomic_store_n(&slot->state, COOLHASH_FC_FREE, __ATOMIC_RELEASE);
+
+        return res;
+}
+
+/**
+ * @brief Claim a free slot, starting at a per-thread position so threads
+ * tend to keep the same slot
+ *
+ * @param table Table
+ *
+ * @return Claimed slot or NULL if all slots are busy
+ */
+static struct coolhash_fc_slot *_coolhash_combine_claim(
+                struct coolhash_table *table)
+{
+        unsigned int i, start;
+        int expected;
+
+        start = (unsigned int) (((uintptr_t) pthread_self() >> 6) %
+                        table->fc_nslots);
+
+        for (i = 0; i < table->fc_nslots; i++) {
+                struct coolhash_fc_slot *slot;
+
+                slot = &table->fc_slots[(start + i) % table->fc_nslots];
+                expected = COOLHASH_FC_FREE;
+                if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) ==
+                                COOLHASH_FC_FREE &&
+                                __atomic_compare_exchange_n(&slot->state,
+                                        &expected, COOLHASH_FC_CLAIMED, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        return slot;
+        }
+
+        return NULL;
+}
+
+/**
+ * @brief Execute one request - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table the key belongs to
+ * @param op COOLHASH_FC_SET or COOLHASH_FC_GET_COPY
+ * @param key Hashed key
+ * @param ptr Data to set or destination buffer
+ * @param len Destination buffer length
+ *
+ * @return Result of the operation
+ */
+static int _coolhash_combine_exec(struct coolhash *ch,
+                struct coolhash_table *table, int op, coolhash_key_t key,
+                void *ptr, size_t len)
+{
+        switch (op) {
+        case COOLHASH_FC_SET:
+                return _coolhash_table_set(ch, table, key, ptr);
+        case COOLHASH_FC_GET_COPY:
+                return _coolhash_table_get_copy(table, key, ptr, len);
+        }
+
+        return -1;
+}
+
+/**
+ * @brief Execute every pending request - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ */
+static void _coolhash_combine_pass(struct coolhash *ch,
+                struct coolhash_table *table)
+{
+        struct coolhash_fc_slot *slot;
+        unsigned int i;
+
+        for (i = 0; i < table->fc_nslots; i++) {
+                slot = &table->fc_slots[i];
+                if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) !=
+                                COOLHASH_FC_PENDING)
+                        continue;
+
+                slot->res = _coolhash_combine_exec(ch, table, slot->op,
+                                slot->key, slot->ptr, slot->len);
+                __atomic_store_n(&slot->state, COOLHASH_FC_DONE,
+                                __ATOMIC_RELEASE);
+        }
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
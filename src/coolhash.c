@@ -7,22 +7,30 @@
                                            be exactly divisible by SHARDS */
 #define COOLHASH_DEFAULT_PROFILE_SHARDS 2 /**< Number of shards */
 #define COOLHASH_DEFAULT_PROFILE_LOAD_FACTOR 80 /**< Load factor (percent) */
-
-static void _coolhash_table_add(struct coolhash_table *table,
-                struct coolhash_node *node);
-static struct coolhash_table *_coolhash_table_find(struct coolhash *ch,
-                coolhash_key_t key);
-static void _coolhash_table_lock(struct coolhash_table *table);
-static void _coolhash_table_unlock(struct coolhash_table *table);
-static void _coolhash_table_auto_rehash(struct coolhash *ch,
+#define COOLHASH_DEFAULT_PROFILE_COMBINING 0 /**< Flat-combining slots */
+#define COOLHASH_DEFAULT_PROFILE_MAINT 0 /**< Background maintenance */
+#define COOLHASH_DEFAULT_PROFILE_CHANGELOG 0 /**< Change log entries */
+#define COOLHASH_DEFAULT_PROFILE_HUGEPAGES 0 /**< Hugepage-backed memory */
+#define COOLHASH_DEFAULT_PROFILE_BLOOM_BITS 0 /**< Bloom filter bits per
+                                                 bucket */
+#define COOLHASH_DEFAULT_PROFILE_ENGINE COOLHASH_ENGINE_CHAIN /**< Engine */
+#define COOLHASH_DEFAULT_PROFILE_INDEX 0 /**< Ordered key index */
+#define COOLHASH_SLAB_MIN 64 /**< Nodes in the smallest node slab */
+
+static int _coolhash_table_init(struct coolhash *ch,
+                struct coolhash_table *table);
+static void _coolhash_table_destroy(struct coolhash *ch,
                 struct coolhash_table *table);
-static void _coolhash_table_grow_shrink_calc(struct coolhash *ch,
+static void _coolhash_table_auto_rehash(struct coolhash *ch,
                 struct coolhash_table *table);
+static unsigned int _coolhash_table_rehash_size(struct coolhash_table *table);
+static int _coolhash_table_rehash(struct coolhash *ch,
+                struct coolhash_table *table, unsigned int nsize);
 static struct coolhash_node *_coolhash_node_find(struct coolhash *ch,
                 coolhash_key_t key, struct coolhash_table **table_ptr,
                 int table_unlock, int ro);
-static void _coolhash_node_lock(struct coolhash_node *node, int ro);
-static void _coolhash_node_unlock(struct coolhash_node *node);
+static void _coolhash_node_release_mem(struct coolhash_table *table,
+                struct coolhash_node *node);
 static void _coolhash_profile_make_sane(struct coolhash_profile *profile);
 
 /**
@@ -57,26 +65,23 @@ struct coolhash *coolhash_new(struct coolhash_profile *profile)
         }
 
         for (i = 0; i < ch->profile.shards; i++) {
-                ch->tables[i].n = 0;
-                ch->tables[i].size = ch->profile.size / ch->profile.shards;
-                _coolhash_table_grow_shrink_calc(ch, &ch->tables[i]);
-
-                ch->tables[i].nodes = calloc(ch->tables[i].size,
-                                sizeof(*ch->tables[i].nodes));
-                if (ch->tables[i].nodes == NULL)
-                        break;
-                if (pthread_mutex_init(&ch->tables[i].table_mx, NULL) != 0) {
-                        free(ch->tables[i].nodes);
+                if (_coolhash_table_init(ch, &ch->tables[i]) != 0)
                         break;
-                }
         }
 
         /* There was a failure, free up memory */
         if (i < ch->profile.shards) {
-                for (j = 0; j < i - 1; j++) {
-                        free(ch->tables[j].nodes);
-                        pthread_mutex_destroy(&ch->tables[j].table_mx);
-                }
+                for (j = 0; j < i; j++)
+                        _coolhash_table_destroy(ch, &ch->tables[j]);
+
+                free(ch->tables);
+                free(ch);
+                return NULL;
+        }
+
+        if (ch->profile.maint && _coolhash_maint_start(ch) != 0) {
+                for (j = 0; j < ch->profile.shards; j++)
+                        _coolhash_table_destroy(ch, &ch->tables[j]);
 
                 free(ch->tables);
                 free(ch);
@@ -106,6 +111,13 @@ void coolhash_profile_init(struct coolhash_profile *profile)
         profile->size = COOLHASH_DEFAULT_PROFILE_SIZE;
         profile->shards = COOLHASH_DEFAULT_PROFILE_SHARDS;
         profile->load_factor = COOLHASH_DEFAULT_PROFILE_LOAD_FACTOR;
+        profile->combining = COOLHASH_DEFAULT_PROFILE_COMBINING;
+        profile->maint = COOLHASH_DEFAULT_PROFILE_MAINT;
+        profile->changelog = COOLHASH_DEFAULT_PROFILE_CHANGELOG;
+        profile->hugepages = COOLHASH_DEFAULT_PROFILE_HUGEPAGES;
+        profile->bloom_bits = COOLHASH_DEFAULT_PROFILE_BLOOM_BITS;
+        profile->engine = COOLHASH_DEFAULT_PROFILE_ENGINE;
+        profile->index = COOLHASH_DEFAULT_PROFILE_INDEX;
 }
 
 /**
@@ -180,6 +192,213 @@ int coolhash_profile_get_load_factor(struct coolhash_profile *profile)
         return profile->load_factor;
 }
 
+/**
+ * @brief Set number of flat-combining slots per shard. With combining
+ * enabled, coolhash_set and coolhash_get_copy publish their request to the
+ * shard and whichever thread holds the shard lock executes every pending
+ * request in one pass. This helps with hot shards under skewed keys.
+ *
+ * @param profile coolhash profile
+ * @param slots Slots per shard; roughly the number of threads (0 disables)
+ */
+void coolhash_profile_set_combining(struct coolhash_profile *profile,
+                unsigned int slots)
+{
+        profile->combining = slots;
+}
+
+/**
+ * @brief Get number of flat-combining slots per shard
+ *
+ * @param profile coolhash profile
+ *
+ * @return Slots per shard
+ */
+unsigned int coolhash_profile_get_combining(struct coolhash_profile *profile)
+{
+        return profile->combining;
+}
+
+/**
+ * @brief Enable/disable the background maintenance thread. When enabled,
+ * grows, shrinks and tombstone cleanup are done by a thread owned by the
+ * coolhash instance instead of by whichever coolhash_set or coolhash_del
+ * call crossed a threshold.
+ *
+ * @param profile coolhash profile
+ * @param maint Boolean, run maintenance in the background?
+ */
+void coolhash_profile_set_maint(struct coolhash_profile *profile, int maint)
+{
+        profile->maint = maint;
+}
+
+/**
+ * @brief Get whether the background maintenance thread is enabled
+ *
+ * @param profile coolhash profile
+ *
+ * @return Boolean
+ */
+int coolhash_profile_get_maint(struct coolhash_profile *profile)
+{
+        return profile->maint;
+}
+
+/**
+ * @brief Set size of the per-shard change log. Every set and delete is
+ * recorded with a sequence number so a consumer (e.g. a replica) can follow
+ * a shard's changes with coolhash_changelog_read.
+ *
+ * @param profile coolhash profile
+ * @param entries Entries kept per shard (0 disables the change log)
+ */
+void coolhash_profile_set_changelog(struct coolhash_profile *profile,
+                unsigned int entries)
+{
+        profile->changelog = entries;
+}
+
+/**
+ * @brief Get size of the per-shard change log
+ *
+ * @param profile coolhash profile
+ *
+ * @return Entries kept per shard
+ */
+unsigned int coolhash_profile_get_changelog(struct coolhash_profile *profile)
+{
+        return profile->changelog;
+}
+
+/**
+ * @brief Enable/disable hugepage-backed memory. Bucket arrays of 1MB and up,
+ * and node storage, are then mapped with MAP_HUGETLB, or with
+ * MADV_HUGEPAGE when no hugetlb pages are reserved. This cuts down on TLB
+ * misses for random lookups in large tables.
+ *
+ * Nodes come from per-shard slabs that start out sized for the shard and
+ * double as it fills; a shard only takes whole 2MB hugepages once it holds
+ * about 1MB of nodes, so tables with many small shards stay off the
+ * hugepage pool.
+ *
+ * @param profile coolhash profile
+ * @param hugepages Boolean, use hugepages?
+ */
+void coolhash_profile_set_hugepages(struct coolhash_profile *profile,
+                int hugepages)
+{
+        profile->hugepages = hugepages;
+}
+
+/**
+ * @brief Get whether hugepage-backed memory is enabled
+ *
+ * @param profile coolhash profile
+ *
+ * @return Boolean
+ */
+int coolhash_profile_get_hugepages(struct coolhash_profile *profile)
+{
+        return profile->hugepages;
+}
+
+/**
+ * @brief Set size of the per-shard Bloom filter. Lookups check the filter
+ * before taking any lock, so most lookups of absent keys return without
+ * touching the shard. Deleted keys drop out of the filter when the shard is
+ * rehashed or compacted.
+ *
+ * @param profile coolhash profile
+ * @param bits Filter bits per bucket; 8 to 16 is reasonable (0 disables)
+ */
+void coolhash_profile_set_bloom_bits(struct coolhash_profile *profile,
+                unsigned int bits)
+{
+        profile->bloom_bits = bits;
+}
+
+/**
+ * @brief Get size of the per-shard Bloom filter
+ *
+ * @param profile coolhash profile
+ *
+ * @return Filter bits per bucket
+ */
+unsigned int coolhash_profile_get_bloom_bits(struct coolhash_profile *profile)
+{
+        return profile->bloom_bits;
+}
+
+/**
+ * @brief Set the table engine. COOLHASH_ENGINE_CUCKOO keeps items in
+ * cache-line sized buckets of COOLHASH_CUCKOO_SLOTS slots, each key having
+ * exactly two candidate buckets, so a lookup touches at most two buckets.
+ * Lookups skip the shard lock: a coolhash_get_copy miss writes nothing, and
+ * a hit only read-locks the key's slot while it copies. Every slot has its
+ * own lock, so holding an item holds up nothing else in its bucket, and
+ * waiting for a held item sleeps. It suits read-heavy tables at high load.
+ * The bucket arrays a shard outgrows are kept until coolhash_free, since
+ * lookups and lock pointers may still point into them; they add up to less
+ * than the current array, so a shard that grew can take up to twice its
+ * bucket memory (coolhash_mem reports them as extra).
+ * COOLHASH_ENGINE_SMALL is for keys that fit in 32 bits (bigger keys are
+ * refused): entries hold a 32-bit key, a 32-bit lock and a 32-bit link
+ * to the next entry besides the data pointer, and buckets are 32-bit entry
+ * indexes, so an item costs about a third of a chained node. Up to
+ * UINT32_MAX - 1 items fit in a shard. Combining, background maintenance,
+ * the change log, Bloom filters and the ordered index only apply to
+ * COOLHASH_ENGINE_CHAIN and are switched off for the other engines.
+ *
+ * @param profile coolhash profile
+ * @param engine COOLHASH_ENGINE_CHAIN (default), COOLHASH_ENGINE_CUCKOO or
+ * COOLHASH_ENGINE_SMALL
+ */
+void coolhash_profile_set_engine(struct coolhash_profile *profile,
+                int engine)
+{
+        profile->engine = engine;
+}
+
+/**
+ * @brief Get the table engine
+ *
+ * @param profile coolhash profile
+ *
+ * @return COOLHASH_ENGINE_CHAIN, COOLHASH_ENGINE_CUCKOO or
+ * COOLHASH_ENGINE_SMALL
+ */
+int coolhash_profile_get_engine(struct coolhash_profile *profile)
+{
+        return profile->engine;
+}
+
+/**
+ * @brief Enable/disable the ordered key index. Each shard then also keeps its
+ * live keys in a skip list, updated under the shard lock by every set and
+ * delete, so coolhash_range_foreach can visit a key range (e.g. every key
+ * sharing the same high bits) without walking the whole table.
+ *
+ * @param profile coolhash profile
+ * @param index Boolean, keep an ordered index?
+ */
+void coolhash_profile_set_index(struct coolhash_profile *profile, int index)
+{
+        profile->index = index;
+}
+
+/**
+ * @brief Get whether the ordered key index is enabled
+ *
+ * @param profile coolhash profile
+ *
+ * @return Boolean
+ */
+int coolhash_profile_get_index(struct coolhash_profile *profile)
+{
+        return profile->index;
+}
+
 /**
  * @brief Free coolhash instance, but execute a callback for each item so
  * that extra cleanup can be performed
@@ -197,7 +416,23 @@ void coolhash_free_foreach(struct coolhash *ch, coolhash_free_foreach_func cb,
         if (ch == NULL)
                 return;
 
+        if (ch->profile.maint)
+                _coolhash_maint_stop(ch);
+
         for (i = 0; i < ch->profile.shards; i++) {
+                if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                        _coolhash_cuckoo_destroy(ch, &ch->tables[i], cb,
+                                        cb_arg);
+                        _coolhash_table_destroy(ch, &ch->tables[i]);
+                        continue;
+                }
+                if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                        _coolhash_small_destroy(ch, &ch->tables[i], cb,
+                                        cb_arg);
+                        _coolhash_table_destroy(ch, &ch->tables[i]);
+                        continue;
+                }
+
                 for (j = 0; j < ch->tables[i].size; j++) {
                         if (ch->tables[i].nodes[j] == NULL)
                                 continue;
@@ -208,11 +443,12 @@ void coolhash_free_foreach(struct coolhash *ch, coolhash_free_foreach_func cb,
                                         cb(n->data, cb_arg);
 
                                 nn = n->next;
-                                free(n);
+                                if (!n->slab)
+                                        free(n);
                         }
                 }
 
-                free(ch->tables[i].nodes);
+                _coolhash_table_destroy(ch, &ch->tables[i]);
         }
 
         free(ch->tables);
@@ -230,45 +466,28 @@ void coolhash_free_foreach(struct coolhash *ch, coolhash_free_foreach_func cb,
  */
 int coolhash_set(struct coolhash *ch, coolhash_key_t key, void *data)
 {
-        struct coolhash_node *node;
         struct coolhash_table *table;
+        int res;
 
         if (ch == NULL || data == NULL)
                 return -1;
 
-        node = _coolhash_node_find(ch, key, &table, 0, 0);
-        if (node) {
-                /* A node already exists. We just need to overwrite the data
-                 * and make sure to unschedule deletion if that's the case. */
-
-                node->del = 0; /* Could have been scheduled for deletion */
-                node->data = data;
-                _coolhash_node_unlock(node);
-
-                goto leave;
-        }
-
-        /* This is a totally new node */
-        node = malloc(sizeof(*node));
-        if (node == NULL)
-                return -1;
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return _coolhash_cuckoo_set(ch, key, data);
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return _coolhash_small_set_until(ch, key, data, NULL);
 
-        node->key = key;
-        if (pthread_rwlock_init(&node->node_mx, NULL) != 0) {
-                free(node);
-                return -1;
-        }
-        node->del = 0;
-        node->data = data;
+        table = _coolhash_table_find(ch, key);
 
-        /* Add new node */
-        _coolhash_table_add(table, node);
-        table->n++;
-        _coolhash_table_auto_rehash(ch, table);
+        if (ch->profile.combining)
+                return _coolhash_combine(ch, table, COOLHASH_FC_SET, key,
+                                data, 0);
 
-leave:
+        _coolhash_table_lock(table);
+        res = _coolhash_table_set(ch, table, key, data);
         _coolhash_table_unlock(table);
-        return 0;
+
+        return res;
 }
 
 /**
@@ -284,10 +503,18 @@ leave:
 void *coolhash_get(struct coolhash *ch, coolhash_key_t key, void **lock)
 {
         struct coolhash_node *node;
+        void *data;
 
         if (ch == NULL || lock == NULL)
                 return NULL;
 
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return _coolhash_cuckoo_get_until(ch, key, &data, lock, 0,
+                                NULL) == 0 ? data : NULL;
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return _coolhash_small_get_until(ch, key, &data, lock, 0,
+                                NULL) == 0 ? data : NULL;
+
         node =_coolhash_node_find(ch, key, NULL, 1, 0);
         if (node == NULL)
                 return NULL;
@@ -316,10 +543,18 @@ void *coolhash_get_ro(struct coolhash *ch, coolhash_key_t key,
                 void **lock)
 {
         struct coolhash_node *node;
+        void *data;
 
         if (ch == NULL || lock == NULL)
                 return NULL;
 
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return _coolhash_cuckoo_get_until(ch, key, &data, lock, 1,
+                                NULL) == 0 ? data : NULL;
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return _coolhash_small_get_until(ch, key, &data, lock, 1,
+                                NULL) == 0 ? data : NULL;
+
         node =_coolhash_node_find(ch, key, NULL, 1, 0);
         if (node == NULL)
                 return NULL;
@@ -346,11 +581,27 @@ void *coolhash_get_ro(struct coolhash *ch, coolhash_key_t key,
 int coolhash_get_copy(struct coolhash *ch, coolhash_key_t key, void *dst,
                 size_t dst_len)
 {
+        struct coolhash_table *table;
         struct coolhash_node *node;
 
         if (ch == NULL || dst == NULL || dst_len <= 0)
                 return -1;
 
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return _coolhash_cuckoo_get_copy(ch, key, dst, dst_len);
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return _coolhash_small_get_copy(ch, key, dst, dst_len);
+
+        if (ch->profile.combining) {
+                table = _coolhash_table_find(ch, key);
+                if (ch->profile.bloom_bits &&
+                                !_coolhash_bloom_maybe(table, key))
+                        return -1;
+
+                return _coolhash_combine(ch, table, COOLHASH_FC_GET_COPY, key,
+                                dst, dst_len);
+        }
+
         node = _coolhash_node_find(ch, key, NULL, 1, 1);
         if (node == NULL)
                 return -1;
@@ -382,17 +633,21 @@ void coolhash_del(struct coolhash *ch, void *lock)
         if (lock == NULL)
                 return;
 
-        node = lock;
-        node->del = 1;
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                _coolhash_cuckoo_del_until(ch, lock, NULL);
+                return;
+        }
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                _coolhash_small_del_until(ch, lock, NULL);
+                return;
+        }
 
+        node = lock;
         table = _coolhash_table_find(ch, node->key);
 
         _coolhash_table_lock(table);
-        table->n--;
-        _coolhash_table_auto_rehash(ch, table);
+        _coolhash_table_del_node(ch, table, node);
         _coolhash_table_unlock(table);
-
-        _coolhash_node_unlock(node);
 }
 
 /**
@@ -408,6 +663,15 @@ void coolhash_unlock(struct coolhash *ch, void *lock)
         if (lock == NULL)
                 return;
 
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                _coolhash_cuckoo_unlock(ch, lock);
+                return;
+        }
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                _coolhash_small_unlock(lock);
+                return;
+        }
+
         node = lock;
         _coolhash_node_unlock(node);
 }
@@ -429,6 +693,15 @@ void coolhash_foreach(struct coolhash *ch, coolhash_foreach_func cb,
         if (ch == NULL || cb == NULL)
                 return;
 
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                _coolhash_cuckoo_foreach(ch, cb, cb_arg, 0);
+                return;
+        }
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                _coolhash_small_foreach(ch, cb, cb_arg, 0);
+                return;
+        }
+
         for (i = 0; i < ch->profile.shards; i++) {
                 _coolhash_table_lock(&ch->tables[i]);
                 for (j = 0; j < ch->tables[i].size; j++) {
@@ -466,6 +739,15 @@ void coolhash_foreach_ro(struct coolhash *ch, coolhash_foreach_func cb,
         if (ch == NULL || cb == NULL)
                 return;
 
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                _coolhash_cuckoo_foreach(ch, cb, cb_arg, 1);
+                return;
+        }
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                _coolhash_small_foreach(ch, cb, cb_arg, 1);
+                return;
+        }
+
         for (i = 0; i < ch->profile.shards; i++) {
                 _coolhash_table_lock(&ch->tables[i]);
                 for (j = 0; j < ch->tables[i].size; j++) {
@@ -491,12 +773,31 @@ void coolhash_foreach_ro(struct coolhash *ch, coolhash_foreach_func cb,
  * @param node Node
  * @param ro Read-only?
  */
-static void _coolhash_node_lock(struct coolhash_node *node, int ro)
+void _coolhash_node_lock(struct coolhash_node *node, int ro)
 {
+        int waited;
+
+        waited = 0;
+
+#ifdef COOLHASH_PROBES
+        /* Only find out about waits when somebody may be tracing them */
+        if ((ro ? pthread_rwlock_tryrdlock(&node->node_mx) :
+                                pthread_rwlock_trywrlock(&node->node_mx)) ==
+                        0) {
+                COOLHASH_PROBE3(node_lock_acquire, node, ro, waited);
+                return;
+        }
+
+        waited = 1;
+        COOLHASH_PROBE2(node_lock_wait, node, ro);
+#endif
+
         if (ro)
                 pthread_rwlock_rdlock(&node->node_mx);
         else
                 pthread_rwlock_wrlock(&node->node_mx);
+
+        COOLHASH_PROBE3(node_lock_acquire, node, ro, waited);
 }
 
 /**
@@ -504,11 +805,103 @@ static void _coolhash_node_lock(struct coolhash_node *node, int ro)
  *
  * @param node Node
  */
-static void _coolhash_node_unlock(struct coolhash_node *node)
+void _coolhash_node_unlock(struct coolhash_node *node)
 {
         pthread_rwlock_unlock(&node->node_mx);
 }
 
+/**
+ * @brief Allocate a node for a table, from its slabs if there is room. With
+ * hugepages enabled, a new slab is started when the current one is full. The
+ * first slab is sized for the shard's bucket count and each next one doubles,
+ * so only shards that outgrow half a hugepage get hugepage-backed slabs.
+ *
+ * @param ch coolhash instance
+ * @param table Table the node will be added to
+ *
+ * @return Node with an initialized lock or NULL on failure
+ */
+struct coolhash_node *_coolhash_node_alloc(struct coolhash *ch,
+                struct coolhash_table *table)
+{
+        struct coolhash_node *node;
+        struct coolhash_slab *slab;
+        size_t count, max;
+
+        if (table->free_nodes == NULL && ch->profile.hugepages &&
+                        (table->slabs == NULL ||
+                         table->slabs->used == table->slabs->count)) {
+                max = (COOLHASH_HUGEPAGE_SIZE - sizeof(*slab)) /
+                        sizeof(*node);
+                count = table->slabs ? (size_t) table->slabs->count * 2 :
+                        table->size;
+                if (count < COOLHASH_SLAB_MIN)
+                        count = COOLHASH_SLAB_MIN;
+
+                /* Anything past half a hugepage is rounded up to a whole
+                 * one anyway, so fill it */
+                if (sizeof(*slab) + count * sizeof(*node) >=
+                                COOLHASH_HUGEPAGE_SIZE / 2)
+                        count = max;
+
+                slab = _coolhash_slab_alloc(ch, (unsigned int) count);
+                if (slab) {
+                        slab->next = table->slabs;
+                        table->slabs = slab;
+                }
+        }
+
+        if (table->free_nodes) {
+                node = table->free_nodes;
+                table->free_nodes = node->next;
+        } else if (table->slabs && table->slabs->used < table->slabs->count) {
+                node = &table->slabs->nodes[table->slabs->used++];
+                node->slab = 1;
+        } else {
+                node = malloc(sizeof(*node));
+                if (node == NULL)
+                        return NULL;
+                node->slab = 0;
+        }
+
+        if (pthread_rwlock_init(&node->node_mx, NULL) != 0) {
+                _coolhash_node_release_mem(table, node);
+                return NULL;
+        }
+
+        return node;
+}
+
+/**
+ * @brief Free a node that is no longer linked into its table
+ *
+ * @param table Table the node was in
+ * @param node Node
+ */
+void _coolhash_node_release(struct coolhash_table *table,
+                struct coolhash_node *node)
+{
+        pthread_rwlock_destroy(&node->node_mx);
+        _coolhash_node_release_mem(table, node);
+}
+
+/**
+ * @brief Give a node's memory back to its slab's free list or to malloc
+ *
+ * @param table Table the node was in
+ * @param node Node
+ */
+static void _coolhash_node_release_mem(struct coolhash_table *table,
+                struct coolhash_node *node)
+{
+        if (node->slab) {
+                node->next = table->free_nodes;
+                table->free_nodes = node;
+        } else {
+                free(node);
+        }
+}
+
 /**
  * @brief Find node - make sure to unlock the node_mx when done (if a node is
  * found)
@@ -532,11 +925,14 @@ static struct coolhash_node *_coolhash_node_find(struct coolhash *ch,
         if (table_ptr)
                 *table_ptr = table;
 
+        /* Known-absent keys never touch the table lock */
+        if (table_unlock && ch->profile.bloom_bits &&
+                        !_coolhash_bloom_maybe(table, key))
+                return NULL;
+
         _coolhash_table_lock(table);
 
-        node = table->nodes[key % table->size];
-        for (; node && node->key != key; node = node->next)
-                ;
+        node = _coolhash_table_node_find(table, key);
         if (node)
                 _coolhash_node_lock(node, ro);
 
@@ -546,13 +942,343 @@ static struct coolhash_node *_coolhash_node_find(struct coolhash *ch,
         return node;
 }
 
+/**
+ * @brief Initialize a table shard
+ *
+ * @param ch coolhash instance
+ * @param table Table to initialize
+ *
+ * @return Non-zero error (likely no memory)
+ */
+static int _coolhash_table_init(struct coolhash *ch,
+                struct coolhash_table *table)
+{
+        table->n = 0;
+
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                /* No chains; the bucket array lives in table->cuckoo */
+                if (_coolhash_cuckoo_init(ch, table) != 0)
+                        return -1;
+
+                if (pthread_mutex_init(&table->table_mx, NULL) != 0) {
+                        _coolhash_cuckoo_destroy(ch, table, NULL, NULL);
+                        return -1;
+                }
+
+                return 0;
+        }
+
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                /* Buckets and entries live in table->small */
+                if (_coolhash_small_init(ch, table) != 0)
+                        return -1;
+
+                if (pthread_mutex_init(&table->table_mx, NULL) != 0) {
+                        _coolhash_small_destroy(ch, table, NULL, NULL);
+                        return -1;
+                }
+
+                return 0;
+        }
+
+        table->size = ch->profile.size / ch->profile.shards;
+        _coolhash_table_grow_shrink_calc(ch, table);
+
+        table->nodes = _coolhash_buckets_alloc(ch, table->size);
+        if (table->nodes == NULL)
+                return -1;
+
+        if (ch->profile.combining) {
+                table->fc_nslots = ch->profile.combining;
+                table->fc_slots = calloc(table->fc_nslots,
+                                sizeof(*table->fc_slots));
+                if (table->fc_slots == NULL) {
+                        _coolhash_buckets_free(ch, table->nodes, table->size);
+                        return -1;
+                }
+        }
+
+        if (ch->profile.changelog) {
+                table->log = calloc(ch->profile.changelog,
+                                sizeof(*table->log));
+                if (table->log == NULL) {
+                        free(table->fc_slots);
+                        _coolhash_buckets_free(ch, table->nodes, table->size);
+                        return -1;
+                }
+        }
+
+        if (ch->profile.bloom_bits && _coolhash_bloom_rebuild(ch, table) != 0) {
+                free(table->log);
+                free(table->fc_slots);
+                _coolhash_buckets_free(ch, table->nodes, table->size);
+                return -1;
+        }
+
+        if (ch->profile.index && _coolhash_index_init(table) != 0) {
+                _coolhash_bloom_free(table);
+                free(table->log);
+                free(table->fc_slots);
+                _coolhash_buckets_free(ch, table->nodes, table->size);
+                return -1;
+        }
+
+        if (pthread_mutex_init(&table->table_mx, NULL) != 0) {
+                _coolhash_index_free(table);
+                _coolhash_bloom_free(table);
+                free(table->log);
+                free(table->fc_slots);
+                _coolhash_buckets_free(ch, table->nodes, table->size);
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Release what _coolhash_table_init allocated, and the table's slabs
+ * (other nodes are left alone)
+ *
+ * @param table Table
+ */
+static void _coolhash_table_destroy(struct coolhash *ch,
+                struct coolhash_table *table)
+{
+        struct coolhash_slab *slab, *slabn;
+
+        pthread_mutex_destroy(&table->table_mx);
+        _coolhash_cuckoo_destroy(ch, table, NULL, NULL);
+        _coolhash_small_destroy(ch, table, NULL, NULL);
+        for (slab = table->slabs; slab; slab = slabn) {
+                slabn = slab->next;
+                _coolhash_mem_free(ch, slab, slab->len);
+        }
+        _coolhash_index_free(table);
+        _coolhash_bloom_free(table);
+        free(table->log);
+        free(table->fc_slots);
+        _coolhash_buckets_free(ch, table->nodes, table->size);
+}
+
+/**
+ * @brief Add/replace item in a table shard - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table the key belongs to
+ * @param key Hashed key
+ * @param data Pointer to your data
+ *
+ * @return Non-zero error (likely no memory)
+ */
+int _coolhash_table_set(struct coolhash *ch, struct coolhash_table *table,
+                coolhash_key_t key, void *data)
+{
+        return _coolhash_table_set_at(ch, table, key,
+                        _coolhash_table_node_find(table, key), data);
+}
+
+/**
+ * @brief Add/replace item in a table shard, given the node the key already
+ * has (if any) - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table the key belongs to
+ * @param key Hashed key
+ * @param node The key's node, tombstones included, or NULL if it has none
+ * @param data Pointer to your data
+ *
+ * @return Non-zero error (likely no memory)
+ */
+int _coolhash_table_set_at(struct coolhash *ch, struct coolhash_table *table,
+                coolhash_key_t key, struct coolhash_node *node, void *data)
+{
+        if (table->snap_pending)
+                _coolhash_snapshot_copy(table);
+
+        if (node) {
+                /* A node already exists. We just need to overwrite the data
+                 * and make sure to unschedule deletion if that's the case. */
+
+                /* Tombstones are not indexed */
+                if (node->del && table->index &&
+                                _coolhash_index_add(table, key) != 0)
+                        return -1;
+
+                _coolhash_node_lock(node, 0);
+                if (node->del) { /* Scheduled for deletion, bring it back */
+                        node->del = 0;
+                        table->n++;
+                        table->tombs--;
+                }
+                node->data = data;
+                _coolhash_node_unlock(node);
+
+                if (ch->profile.changelog)
+                        _coolhash_changelog_append(ch, table,
+                                        COOLHASH_CHANGE_SET, key, data);
+                return 0;
+        }
+
+        /* This is a totally new node */
+        if (table->index && _coolhash_index_add(table, key) != 0)
+                return -1;
+
+        node = _coolhash_node_alloc(ch, table);
+        if (node == NULL) {
+                if (table->index)
+                        _coolhash_index_remove(table, key);
+                return -1;
+        }
+
+        node->key = key;
+        node->del = 0;
+        node->data = data;
+
+        /* Add new node */
+        _coolhash_table_add(table, node);
+        table->n++;
+        if (table->bloom)
+                _coolhash_bloom_add(table->bloom, key);
+        if (ch->profile.changelog)
+                _coolhash_changelog_append(ch, table, COOLHASH_CHANGE_SET, key,
+                                data);
+        _coolhash_table_auto_rehash(ch, table);
+
+        return 0;
+}
+
+/**
+ * @brief Retrieve item and copy data into destination buffer - the table
+ * must be locked
+ *
+ * @param table Table the key belongs to
+ * @param key Hashed key
+ * @param dst Destination buffer
+ * @param dst_len Buffer length
+ *
+ * @return Non-zero failure (item not found)
+ */
+int _coolhash_table_get_copy(struct coolhash_table *table, coolhash_key_t key,
+                void *dst, size_t dst_len)
+{
+        struct coolhash_node *node;
+
+        node = _coolhash_table_node_find(table, key);
+        if (node == NULL)
+                return -1;
+
+        _coolhash_node_lock(node, 1);
+        if (node->del) {
+                _coolhash_node_unlock(node);
+                return -1;
+        }
+
+        memcpy(dst, node->data, dst_len);
+        _coolhash_node_unlock(node);
+
+        return 0;
+}
+
+/**
+ * @brief Schedule item for deletion by key - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table the key belongs to
+ * @param key Hashed key
+ *
+ * @return Non-zero failure (item not found)
+ */
+int _coolhash_table_del(struct coolhash *ch, struct coolhash_table *table,
+                coolhash_key_t key)
+{
+        struct coolhash_node *node;
+
+        node = _coolhash_table_node_find(table, key);
+        if (node == NULL)
+                return -1;
+
+        _coolhash_node_lock(node, 0);
+        if (node->del) {
+                _coolhash_node_unlock(node);
+                return -1;
+        }
+        if (table->snap_pending)
+                _coolhash_snapshot_copy(table);
+        if (table->index)
+                _coolhash_index_remove(table, key);
+        node->del = 1;
+        _coolhash_node_unlock(node);
+
+        table->n--;
+        table->tombs++;
+        if (ch->profile.changelog)
+                _coolhash_changelog_append(ch, table, COOLHASH_CHANGE_DEL,
+                                key, node->data);
+        _coolhash_table_auto_rehash(ch, table);
+
+        return 0;
+}
+
+/**
+ * @brief Schedule a node we hold the lock of for deletion, and unlock it -
+ * the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table the node is in
+ * @param node Node, locked by a 'get'
+ */
+void _coolhash_table_del_node(struct coolhash *ch, struct coolhash_table *table,
+                struct coolhash_node *node)
+{
+        if (table->snap_pending)
+                _coolhash_snapshot_copy(table);
+        if (table->index)
+                _coolhash_index_remove(table, node->key);
+
+        node->del = 1;
+        table->n--;
+        table->tombs++;
+        if (ch->profile.changelog)
+                _coolhash_changelog_append(ch, table, COOLHASH_CHANGE_DEL,
+                                node->key, node->data);
+
+        /* Let go of the node before a rehash wants to wait on it */
+        _coolhash_node_unlock(node);
+
+        _coolhash_table_auto_rehash(ch, table);
+}
+
+/**
+ * @brief Walk the chain 'key' would be in - the table must be locked
+ *
+ * @param table Table
+ * @param key Hashed key
+ *
+ * @return Found node (not locked) or NULL if not found
+ */
+struct coolhash_node *_coolhash_table_node_find(struct coolhash_table *table,
+                coolhash_key_t key)
+{
+        struct coolhash_node *node;
+        unsigned int len;
+
+        len = 0;
+        node = table->nodes[key % table->size];
+        for (; node && node->key != key; node = node->next)
+                len++;
+
+        COOLHASH_PROBE3(chain_walk, table, key, len);
+
+        return node;
+}
+
 /**
  * @brief Add item to a table shard
  *
  * @param table Table
  * @param node Node to add
  */
-static void _coolhash_table_add(struct coolhash_table *table,
+void _coolhash_table_add(struct coolhash_table *table,
                 struct coolhash_node *node)
 {
         unsigned int idx;
@@ -570,7 +1296,7 @@ static void _coolhash_table_add(struct coolhash_table *table,
  *
  * @return The table key would be in
  */
-static struct coolhash_table *_coolhash_table_find(struct coolhash *ch,
+struct coolhash_table *_coolhash_table_find(struct coolhash *ch,
                 coolhash_key_t key)
 {
         return &ch->tables[key % ch->profile.shards];
@@ -582,7 +1308,7 @@ static struct coolhash_table *_coolhash_table_find(struct coolhash *ch,
  * @param ch coolhash instance
  * @param table Table to calculate for
  */
-static void _coolhash_table_grow_shrink_calc(struct coolhash *ch,
+void _coolhash_table_grow_shrink_calc(struct coolhash *ch,
                 struct coolhash_table *table)
 {
         table->grow_at = (unsigned int)
@@ -599,9 +1325,25 @@ static void _coolhash_table_grow_shrink_calc(struct coolhash *ch,
  *
  * @param table Table
  */
-static void _coolhash_table_lock(struct coolhash_table *table)
+void _coolhash_table_lock(struct coolhash_table *table)
 {
+        int waited;
+
+        waited = 0;
+
+#ifdef COOLHASH_PROBES
+        if (pthread_mutex_trylock(&table->table_mx) == 0) {
+                COOLHASH_PROBE2(table_lock_acquire, table, waited);
+                return;
+        }
+
+        waited = 1;
+        COOLHASH_PROBE1(table_lock_wait, table);
+#endif
+
         pthread_mutex_lock(&table->table_mx);
+
+        COOLHASH_PROBE2(table_lock_acquire, table, waited);
 }
 
 /**
@@ -609,13 +1351,15 @@ static void _coolhash_table_lock(struct coolhash_table *table)
  *
  * @param table Table
  */
-static void _coolhash_table_unlock(struct coolhash_table *table)
+void _coolhash_table_unlock(struct coolhash_table *table)
 {
         pthread_mutex_unlock(&table->table_mx);
 }
 
 /**
- * @brief Rehash a table if it needs to be
+ * @brief Rehash a table if it needs to be. With a maintenance thread the work
+ * is handed off to it, unless the table has grown well past its threshold
+ * and the thread is clearly not keeping up.
  *
  * @param ch coolhash instance
  * @param table Table to rehash
@@ -623,26 +1367,101 @@ static void _coolhash_table_unlock(struct coolhash_table *table)
 static void _coolhash_table_auto_rehash(struct coolhash *ch,
                 struct coolhash_table *table)
 {
-        unsigned int i, nsize, oldsize;
-        struct coolhash_node *node, *noden, **oldnodes;
+        unsigned int nsize;
 
-        if (table->n > table->grow_at)
-                nsize = table->size * 2;
-        else if (table->n < table->shrink_at)
-                nsize = table->size / 2;
-        else
+        nsize = _coolhash_table_rehash_size(table);
+
+        if (ch->profile.maint) {
+                if (nsize > table->size && table->n / 2 > table->grow_at) {
+                        _coolhash_table_rehash(ch, table, nsize);
+                        return;
+                }
+
+                if (nsize || table->tombs > table->grow_at / 2)
+                        _coolhash_maint_signal(ch, table);
                 return;
+        }
+
+        if (nsize)
+                _coolhash_table_rehash(ch, table, nsize);
+}
+
+/**
+ * @brief Bring a table back within its grow/shrink thresholds and get rid of
+ * tombstones - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ *
+ * @return Non-zero if memory was released
+ */
+int _coolhash_table_maintain(struct coolhash *ch, struct coolhash_table *table)
+{
+        unsigned int nsize;
+        int released;
+
+        released = table->tombs > 0;
+        for (;;) {
+                nsize = _coolhash_table_rehash_size(table);
+                if (nsize == 0)
+                        break;
+                if (nsize < table->size)
+                        released = 1;
+                if (_coolhash_table_rehash(ch, table, nsize) != 0)
+                        return released;
+        }
+
+        if (table->tombs > 0)
+                _coolhash_table_rehash(ch, table, table->size);
+
+        return released;
+}
+
+/**
+ * @brief Size a table should be rehashed to
+ *
+ * @param table Table
+ *
+ * @return New size or 0 if the table is fine as it is
+ */
+static unsigned int _coolhash_table_rehash_size(struct coolhash_table *table)
+{
+        if (table->n > table->grow_at)
+                return table->size * 2;
+        if (table->n < table->shrink_at)
+                return table->size / 2;
+
+        return 0;
+}
+
+/**
+ * @brief Rehash a table to a new size, freeing nodes marked for deletion
+ *
+ * @param ch coolhash instance
+ * @param table Table to rehash
+ * @param nsize New size
+ *
+ * @return Non-zero error (no memory)
+ */
+static int _coolhash_table_rehash(struct coolhash *ch,
+                struct coolhash_table *table, unsigned int nsize)
+{
+        unsigned int i, oldsize;
+        struct coolhash_node *node, *noden, **oldnodes;
+
+        oldsize = table->size;
+        COOLHASH_PROBE4(rehash_start, table, oldsize, nsize, table->n);
 
         oldnodes = table->nodes;
-        table->nodes = calloc(nsize, sizeof(*table->nodes));
+        table->nodes = _coolhash_buckets_alloc(ch, nsize);
         if (table->nodes == NULL) {
                 /* Apparently there was not enough memory available to
                  * perform this allocation. Abort! */
                 table->nodes = oldnodes;
-                return;
+                COOLHASH_PROBE4(rehash_end, table, oldsize, nsize, -1);
+                return -1;
         }
 
-        oldsize = table->size;
         table->size = nsize;
         _coolhash_table_grow_shrink_calc(ch, table);
 
@@ -661,8 +1480,7 @@ static void _coolhash_table_auto_rehash(struct coolhash *ch,
                         _coolhash_node_unlock(node);
 
                         if (node->del) { /* Free this node */
-                                pthread_rwlock_destroy(&node->node_mx);
-                                free(node);
+                                _coolhash_node_release(table, node);
                                 continue;
                         }
 
@@ -671,7 +1489,16 @@ static void _coolhash_table_auto_rehash(struct coolhash *ch,
                 }
         }
 
-        free(oldnodes);
+        table->tombs = 0;
+        table->gen++;
+        _coolhash_buckets_free(ch, oldnodes, oldsize);
+
+        if (table->bloom)
+                _coolhash_bloom_rebuild(ch, table);
+
+        COOLHASH_PROBE4(rehash_end, table, oldsize, nsize, 0);
+
+        return 0;
 }
 
 /**
@@ -691,6 +1518,22 @@ static void _coolhash_profile_make_sane(struct coolhash_profile *profile)
                 profile->size += profile->size % profile->shards;
         if (profile->load_factor <= 0)
                 profile->load_factor = COOLHASH_DEFAULT_PROFILE_LOAD_FACTOR;
+        if (profile->maint)
+                profile->maint = 1;
+        if (profile->hugepages)
+                profile->hugepages = 1;
+        if (profile->engine != COOLHASH_ENGINE_CUCKOO &&
+                        profile->engine != COOLHASH_ENGINE_SMALL)
+                profile->engine = COOLHASH_ENGINE_CHAIN;
+        if (profile->index)
+                profile->index = 1;
+        if (profile->engine != COOLHASH_ENGINE_CHAIN) {
+                profile->index = 0;
+                profile->combining = 0;
+                profile->maint = 0;
+                profile->changelog = 0;
+                profile->bloom_bits = 0;
+        }
 }
 
 /* vim: set et ts=8 sw=8 sts=8: */
@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
 
 struct coolhash;
 
@@ -10,11 +11,40 @@ typedef uint64_t coolhash_key_t;
 typedef void (*coolhash_free_foreach_func)(void *data, void *cb_arg);
 typedef void (*coolhash_foreach_func)(struct coolhash *ch, coolhash_key_t key,
                 void *data, void *lock, void *cb_arg);
+typedef void (*coolhash_changelog_func)(coolhash_key_t key, void *data,
+                void *cb_arg);
+typedef void (*coolhash_snapshot_func)(coolhash_key_t key, void *data,
+                void *cb_arg);
 
 struct coolhash_profile {
         unsigned int size; /**< Initial and minimum hash table size */
         unsigned int shards; /**< Number of shards */
         int load_factor; /**< Load factor before resize, in percent */
+        unsigned int combining; /**< Flat-combining slots per shard (0 to
+                                  disable) */
+        int maint; /**< Rehash on a background thread */
+        unsigned int changelog; /**< Change log entries per shard (0 to
+                                  disable) */
+        int hugepages; /**< Back large allocations with hugepages */
+        unsigned int bloom_bits; /**< Bloom filter bits per bucket (0 to
+                                   disable) */
+        int engine; /**< COOLHASH_ENGINE_CHAIN, COOLHASH_ENGINE_CUCKOO or
+                      COOLHASH_ENGINE_SMALL */
+        int index; /**< Keep an ordered index of keys for range scans */
+};
+
+#define COOLHASH_ENGINE_CHAIN 0 /**< Chained nodes with per-node locks */
+#define COOLHASH_ENGINE_CUCKOO 1 /**< Bucketized cuckoo hashing */
+#define COOLHASH_ENGINE_SMALL 2 /**< 32-bit keys and entry indexes */
+
+#define COOLHASH_CHANGE_SET 1 /**< Item was added/replaced */
+#define COOLHASH_CHANGE_DEL 2 /**< Item was deleted */
+
+struct coolhash_change {
+        uint64_t seq; /**< Shard sequence number, starting at 1 */
+        int op; /**< COOLHASH_CHANGE_SET or COOLHASH_CHANGE_DEL */
+        coolhash_key_t key; /**< Node key */
+        void *data; /**< Node data at the time of the change */
 };
 
 struct coolhash_node {
@@ -23,23 +53,206 @@ struct coolhash_node {
         pthread_rwlock_t node_mx;
 
         int del; /**< Set to 1 when scheduled for deletion */
+        int slab; /**< Set to 1 when the node lives in a table slab */
         void *data; /**< Node data */
 };
 
+struct coolhash_slab {
+        struct coolhash_slab *next; /**< Next slab of the same table */
+        size_t len; /**< Size of the slab allocation in bytes */
+        unsigned int count; /**< Number of nodes in this slab */
+        unsigned int used; /**< Nodes handed out so far */
+        struct coolhash_node nodes[]; /**< Node storage */
+};
+
+struct coolhash_bloom {
+        struct coolhash_bloom *next; /**< Older, retired filters */
+        unsigned int nwords; /**< Number of 64-bit blocks */
+        uint64_t words[]; /**< Filter blocks, one block per key */
+};
+
+#define COOLHASH_CUCKOO_SLOTS 3 /**< Items per cuckoo bucket; 3 is what
+                                  fits in a 64-byte cache line */
+
+#define COOLHASH_CUCKOO_WRITER 0x80000000U /**< Slot lock held by a writer */
+#define COOLHASH_CUCKOO_WAITERS 0x40000000U /**< Threads are asleep waiting
+                                              for the slot lock */
+#define COOLHASH_CUCKOO_RETIRED 0x20000000U /**< The bucket array was replaced;
+                                              look the key up again */
+#define COOLHASH_CUCKOO_MOVED 0x10000000U /**< The slot's holders were handed
+                                            over to the replacement array */
+
+struct coolhash_cuckoo_bucket {
+        uint32_t version; /**< Odd while a writer changes the bucket */
+        uint32_t locks[COOLHASH_CUCKOO_SLOTS]; /**< Slot locks: reader count,
+                                                 or COOLHASH_CUCKOO_WRITER,
+                                                 plus the flags above */
+        coolhash_key_t keys[COOLHASH_CUCKOO_SLOTS]; /**< Slot keys */
+        void *data[COOLHASH_CUCKOO_SLOTS]; /**< Slot data, NULL if empty */
+} __attribute__((aligned(64)));
+
+struct coolhash_cuckoo {
+        struct coolhash_cuckoo *next; /**< Older, retired bucket arrays */
+        size_t len; /**< Size of the allocation in bytes */
+        unsigned int mask; /**< Number of buckets - 1 */
+        struct coolhash_cuckoo_bucket buckets[]; /**< Buckets */
+};
+
+#define COOLHASH_SMALL_CHUNK 1024 /**< Entries per small engine chunk */
+#define COOLHASH_SMALL_WRITER 0x80000000U /**< Entry lock held by a writer */
+#define COOLHASH_SMALL_WAITERS 0x40000000U /**< Threads are asleep waiting
+                                             for the entry lock */
+
+struct coolhash_small_entry {
+        uint32_t key; /**< Node key */
+        uint32_t next; /**< Index of the next entry in the bucket, 0 for
+                         none */
+        uint32_t lock; /**< Reader count, or COOLHASH_SMALL_WRITER, plus
+                         COOLHASH_SMALL_WAITERS */
+        void *data; /**< Node data, NULL while the entry is free */
+};
+
+struct coolhash_small {
+        uint32_t *buckets; /**< Index of each bucket's first entry */
+        struct coolhash_small_entry **chunks; /**< Entry storage, never
+                                                moved once allocated */
+        unsigned int nchunks; /**< Chunks allocated */
+        unsigned int chunks_size; /**< Room in the chunk pointer array */
+        uint32_t used; /**< Entries handed out so far; entry 0 is never
+                         used, so 0 means none */
+        uint32_t free; /**< First free entry, 0 for none */
+};
+
+#define COOLHASH_INDEX_LEVELS 16 /**< Skip list levels */
+
+struct coolhash_index_node {
+        coolhash_key_t key; /**< Node key */
+        unsigned int level; /**< Number of levels this entry is linked in */
+        struct coolhash_index_node *next[]; /**< Next entry, per level */
+};
+
+struct coolhash_index {
+        unsigned int level; /**< Levels in use */
+        unsigned int n; /**< Number of keys */
+        size_t bytes; /**< Memory used by the entries */
+        uint64_t rand; /**< Level generator state */
+        struct coolhash_index_node *head[COOLHASH_INDEX_LEVELS]; /**< First
+                                                                  entry, per
+                                                                  level */
+};
+
+struct coolhash_snapshot_item {
+        coolhash_key_t key; /**< Node key */
+        void *data; /**< Node data when the snapshot was taken */
+};
+
+struct coolhash_snapshot_shard {
+        struct coolhash_snapshot_shard *next; /**< Next snapshot waiting
+                                                for the same table */
+        int copied; /**< 1 once copied, -1 if the copy failed */
+        unsigned int n; /**< Number of items */
+        struct coolhash_snapshot_item *items; /**< Items */
+};
+
+struct coolhash_snapshot {
+        struct coolhash *ch; /**< coolhash instance the snapshot is of */
+        struct coolhash_snapshot_shard *shards; /**< One per table shard */
+};
+
+struct coolhash_mem {
+        size_t buckets; /**< Bucket array */
+        size_t nodes; /**< Live nodes, not counting their locks */
+        size_t locks; /**< Table lock and live node locks */
+        size_t tombstones; /**< Nodes scheduled for deletion */
+        size_t slack; /**< Unused node slab space */
+        size_t extra; /**< Flat-combining slots, change log, Bloom filters
+                            and ordered index */
+        size_t total; /**< Sum of the above */
+};
+
+struct coolhash_fc_slot {
+        int state; /**< Free, claimed, pending or done */
+        int op; /**< Requested operation */
+        coolhash_key_t key; /**< Node key */
+        void *ptr; /**< Data to set or destination buffer to copy into */
+        size_t len; /**< Destination buffer length */
+        int res; /**< Result, valid once done */
+} __attribute__((aligned(64)));
+
 struct coolhash_table {
         unsigned int n; /**< Number of items currently in table */
         unsigned int size; /**< Size of table */
         unsigned int grow_at; /**< When to grow */
         unsigned int shrink_at; /**< When to shrink */
+        unsigned int tombs; /**< Nodes scheduled for deletion */
+        uint64_t gen; /**< Bumped whenever nodes are moved or freed */
+        int maint; /**< Set when the maintenance thread should look at us */
         pthread_mutex_t table_mx;
 
         struct coolhash_node **nodes; /**< Table nodes */
+        struct coolhash_slab *slabs; /**< Node slabs, newest first */
+        struct coolhash_node *free_nodes; /**< Free slab nodes */
+
+        unsigned int fc_nslots; /**< Number of flat-combining slots */
+        struct coolhash_fc_slot *fc_slots; /**< Published requests */
+
+        struct coolhash_bloom *bloom; /**< Bloom filter, read without locks */
+
+        struct coolhash_change *log; /**< Change log ring buffer */
+        uint64_t log_seq; /**< Sequence number of the last change */
+
+        struct coolhash_index *index; /**< Ordered index of live keys */
+
+        struct coolhash_snapshot_shard *snap_pending; /**< Snapshots to copy
+                                                        the table into before
+                                                        it changes */
+
+        pthread_rwlock_t cuckoo_mx; /**< Held shared to change items,
+                                      exclusively to move them */
+        struct coolhash_cuckoo *cuckoo; /**< Cuckoo buckets, read without
+                                          locks */
+
+        struct coolhash_small *small; /**< Small engine buckets and entries */
 };
 
 struct coolhash {
         struct coolhash_profile profile; /**< Configuration profile */
 
         struct coolhash_table *tables;
+
+        pthread_t maint_thread; /**< Background maintenance thread */
+        pthread_mutex_t maint_mx;
+        pthread_cond_t maint_cond; /**< Signaled when there is work */
+        int maint_pending; /**< At least one table needs maintenance */
+        int maint_stop; /**< Tells the maintenance thread to exit */
+};
+
+struct coolhash_keyh {
+        coolhash_key_t key; /**< Node key */
+        struct coolhash_table *table; /**< Table the key belongs to */
+        uint64_t gen; /**< Table generation the fields below are good for */
+        unsigned int bucket; /**< Bucket the key hashes to */
+        struct coolhash_node *node; /**< The key's node, if it had one */
+};
+
+struct coolhash_wbuf_op {
+        coolhash_key_t key; /**< Node key */
+        void *data; /**< Node data, NULL for a pending delete */
+        unsigned int next; /**< Next op on the same shard */
+};
+
+struct coolhash_wbuf {
+        struct coolhash *ch; /**< coolhash instance writes are applied to */
+        unsigned int max_ops; /**< Flush when this many ops are pending */
+        unsigned int max_usec; /**< Flush when the oldest op is this old */
+        unsigned int n; /**< Number of pending ops */
+        struct timespec first; /**< When the oldest pending op was queued */
+
+        struct coolhash_wbuf_op *ops; /**< Pending ops */
+        unsigned int *heads; /**< First pending op, per shard */
+        unsigned int *tails; /**< Last pending op, per shard */
+        unsigned int *dirty; /**< Shards with pending ops */
+        unsigned int ndirty; /**< Number of dirty shards */
 };
 
 struct coolhash *coolhash_new(struct coolhash_profile *profile);
@@ -56,18 +269,91 @@ unsigned int coolhash_profile_get_shards(struct coolhash_profile *profile);
 void coolhash_profile_set_load_factor(struct coolhash_profile *profile,
                 int load_factor);
 int coolhash_profile_get_load_factor(struct coolhash_profile *profile);
+void coolhash_profile_set_combining(struct coolhash_profile *profile,
+                unsigned int slots);
+unsigned int coolhash_profile_get_combining(struct coolhash_profile *profile);
+void coolhash_profile_set_maint(struct coolhash_profile *profile, int maint);
+int coolhash_profile_get_maint(struct coolhash_profile *profile);
+void coolhash_profile_set_changelog(struct coolhash_profile *profile,
+                unsigned int entries);
+unsigned int coolhash_profile_get_changelog(struct coolhash_profile *profile);
+void coolhash_profile_set_hugepages(struct coolhash_profile *profile,
+                int hugepages);
+int coolhash_profile_get_hugepages(struct coolhash_profile *profile);
+void coolhash_profile_set_bloom_bits(struct coolhash_profile *profile,
+                unsigned int bits);
+unsigned int coolhash_profile_get_bloom_bits(struct coolhash_profile *profile);
+void coolhash_profile_set_engine(struct coolhash_profile *profile,
+                int engine);
+int coolhash_profile_get_engine(struct coolhash_profile *profile);
+void coolhash_profile_set_index(struct coolhash_profile *profile, int index);
+int coolhash_profile_get_index(struct coolhash_profile *profile);
 int coolhash_set(struct coolhash *ch, coolhash_key_t key, void *data);
 void *coolhash_get(struct coolhash *ch, coolhash_key_t key, void **lock);
 void *coolhash_get_ro(struct coolhash *ch, coolhash_key_t key,
                 void **lock);
 int coolhash_get_copy(struct coolhash *ch, coolhash_key_t key, void *dst,
                 size_t dst_len);
+void coolhash_keyh_init(struct coolhash *ch, struct coolhash_keyh *kh,
+                coolhash_key_t key);
+int coolhash_keyh_set(struct coolhash *ch, struct coolhash_keyh *kh,
+                void *data);
+void *coolhash_keyh_get(struct coolhash *ch, struct coolhash_keyh *kh,
+                void **lock);
+void *coolhash_keyh_get_ro(struct coolhash *ch, struct coolhash_keyh *kh,
+                void **lock);
+int coolhash_keyh_get_copy(struct coolhash *ch, struct coolhash_keyh *kh,
+                void *dst, size_t dst_len);
+void coolhash_keyh_del(struct coolhash *ch, struct coolhash_keyh *kh,
+                void *lock);
+int coolhash_get_copy_batch(struct coolhash *ch, const coolhash_key_t *keys,
+                unsigned int n, void *dst, size_t dst_len, int *res);
 void coolhash_del(struct coolhash *ch, void *lock);
 void coolhash_unlock(struct coolhash *ch, void *lock);
 void coolhash_foreach(struct coolhash *ch, coolhash_foreach_func cb,
                 void *cb_arg);
 void coolhash_foreach_ro(struct coolhash *ch, coolhash_foreach_func cb,
                 void *cb_arg);
+int coolhash_range_foreach(struct coolhash *ch, coolhash_key_t lo,
+                coolhash_key_t hi, coolhash_foreach_func cb, void *cb_arg);
+int coolhash_range_foreach_ro(struct coolhash *ch, coolhash_key_t lo,
+                coolhash_key_t hi, coolhash_foreach_func cb, void *cb_arg);
+int coolhash_try_set(struct coolhash *ch, coolhash_key_t key, void *data);
+int coolhash_timed_set(struct coolhash *ch, coolhash_key_t key, void *data,
+                const struct timespec *abstime);
+int coolhash_try_get(struct coolhash *ch, coolhash_key_t key, void **data,
+                void **lock);
+int coolhash_timed_get(struct coolhash *ch, coolhash_key_t key, void **data,
+                void **lock, const struct timespec *abstime);
+int coolhash_try_get_ro(struct coolhash *ch, coolhash_key_t key, void **data,
+                void **lock);
+int coolhash_timed_get_ro(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, const struct timespec *abstime);
+int coolhash_try_del(struct coolhash *ch, void *lock);
+int coolhash_timed_del(struct coolhash *ch, void *lock,
+                const struct timespec *abstime);
+struct coolhash_wbuf *coolhash_wbuf_new(struct coolhash *ch,
+                unsigned int max_ops, unsigned int max_usec);
+void coolhash_wbuf_free(struct coolhash_wbuf *wb);
+int coolhash_wbuf_set(struct coolhash_wbuf *wb, coolhash_key_t key,
+                void *data);
+int coolhash_wbuf_del(struct coolhash_wbuf *wb, coolhash_key_t key);
+int coolhash_wbuf_get_copy(struct coolhash_wbuf *wb, coolhash_key_t key,
+                void *dst, size_t dst_len);
+int coolhash_wbuf_flush(struct coolhash_wbuf *wb);
+int coolhash_mem(struct coolhash *ch, unsigned int shard,
+                struct coolhash_mem *mem);
+int coolhash_compact(struct coolhash *ch, unsigned int shard);
+uint64_t coolhash_changelog_seq(struct coolhash *ch, unsigned int shard);
+int coolhash_changelog_read(struct coolhash *ch, unsigned int shard,
+                uint64_t since, struct coolhash_change *changes,
+                unsigned int max);
+int coolhash_changelog_snapshot(struct coolhash *ch, unsigned int shard,
+                coolhash_changelog_func cb, void *cb_arg, uint64_t *seq);
+struct coolhash_snapshot *coolhash_snapshot_new(struct coolhash *ch);
+int coolhash_snapshot_foreach(struct coolhash_snapshot *snap,
+                coolhash_snapshot_func cb, void *cb_arg);
+void coolhash_snapshot_free(struct coolhash_snapshot *snap);
 
 #endif /* __LIBCOOLHASH_COOLHASH_H__ */
 
@@ -0,0 +1,399 @@
+/*
+ * Header-only, compile-time specialized coolhash.
+ *
+ * This is a simplified reimplementation of the libcoolhash chain engine
+ * (sharded tables of chained nodes, a lock per shard, doubling at the load
+ * factor) with the shard count, key type, value type and lock policy fixed
+ * at compile time. Values are stored inside the nodes and copied in and out
+ * by assignment, so the compiler can inline the whole hot path, turn the
+ * shard division into a multiply and the bucket modulo into a mask.
+ *
+ * It is not a drop-in replacement: there are no per-item locks, so no
+ * get/unlock, no foreach and none of the optional features, and keys are
+ * bucketed differently (power-of-two bucket counts instead of key % size).
+ * Link against libcoolhash.so when you need any of that.
+ *
+ * Define the parameters and include this file; it can be included more than
+ * once with different names:
+ *
+ *      #define COOLHASH_T_NAME sessions
+ *      #define COOLHASH_T_KEY uint32_t
+ *      #define COOLHASH_T_VALUE struct session
+ *      #define COOLHASH_T_SHARDS 16
+ *      #define COOLHASH_T_LOCK COOLHASH_T_LOCK_SPIN
+ *      #include <coolhash_tmpl.h>
+ *
+ * That gives you struct sessions and:
+ *
+ *      struct sessions *sessions_new(unsigned int size);
+ *      void sessions_free(struct sessions *t);
+ *      int sessions_set(struct sessions *t, uint32_t key,
+ *                      const struct session *value);
+ *      int sessions_get_copy(struct sessions *t, uint32_t key,
+ *                      struct session *dst);
+ *      int sessions_del(struct sessions *t, uint32_t key);
+ *      unsigned int sessions_count(struct sessions *t);
+ *
+ * Return values follow libcoolhash: non-zero means failure (no memory or
+ * not found). Signed key types are fine; keys are converted to uintmax_t
+ * before they are divided into shards and buckets.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __LIBCOOLHASH_COOLHASH_TMPL_H__
+#define __LIBCOOLHASH_COOLHASH_TMPL_H__
+
+#define COOLHASH_T_LOCK_MUTEX 1 /**< pthread mutex per shard */
+#define COOLHASH_T_LOCK_SPIN 2 /**< pthread spinlock per shard */
+#define COOLHASH_T_LOCK_NONE 3 /**< No locking, single-threaded use */
+
+#define COOLHASH_T_CAT_(a, b) a ## _ ## b
+#define COOLHASH_T_CAT(a, b) COOLHASH_T_CAT_(a, b)
+
+#endif /* __LIBCOOLHASH_COOLHASH_TMPL_H__ */
+
+#ifndef COOLHASH_T_NAME
+#error "COOLHASH_T_NAME must be defined before including coolhash_tmpl.h"
+#endif
+#ifndef COOLHASH_T_VALUE
+#error "COOLHASH_T_VALUE must be defined before including coolhash_tmpl.h"
+#endif
+#ifndef COOLHASH_T_KEY
+#define COOLHASH_T_KEY uint64_t
+#endif
+#ifndef COOLHASH_T_SHARDS
+#define COOLHASH_T_SHARDS 2
+#endif
+#ifndef COOLHASH_T_LOAD_FACTOR
+#define COOLHASH_T_LOAD_FACTOR 80
+#endif
+#ifndef COOLHASH_T_LOCK
+#define COOLHASH_T_LOCK COOLHASH_T_LOCK_MUTEX
+#endif
+
+#if COOLHASH_T_SHARDS < 1
+#error "COOLHASH_T_SHARDS must be at least 1"
+#endif
+
+#define COOLHASH_T_FN(fn) COOLHASH_T_CAT(COOLHASH_T_NAME, fn)
+#define COOLHASH_T_NODE COOLHASH_T_FN(node)
+#define COOLHASH_T_TABLE COOLHASH_T_FN(table)
+
+#if COOLHASH_T_LOCK == COOLHASH_T_LOCK_MUTEX
+#define COOLHASH_T_LOCK_T pthread_mutex_t
+#define COOLHASH_T_LOCK_INIT(l) pthread_mutex_init((l), NULL)
+#define COOLHASH_T_LOCK_DESTROY(l) pthread_mutex_destroy(l)
+#define COOLHASH_T_LOCK_ACQUIRE(l) pthread_mutex_lock(l)
+#define COOLHASH_T_LOCK_RELEASE(l) pthread_mutex_unlock(l)
+#elif COOLHASH_T_LOCK == COOLHASH_T_LOCK_SPIN
+#define COOLHASH_T_LOCK_T pthread_spinlock_t
+#define COOLHASH_T_LOCK_INIT(l) pthread_spin_init((l), PTHREAD_PROCESS_PRIVATE)
+#define COOLHASH_T_LOCK_DESTROY(l) pthread_spin_destroy(l)
+#define COOLHASH_T_LOCK_ACQUIRE(l) pthread_spin_lock(l)
+#define COOLHASH_T_LOCK_RELEASE(l) pthread_spin_unlock(l)
+#elif COOLHASH_T_LOCK == COOLHASH_T_LOCK_NONE
+#define COOLHASH_T_LOCK_T char
+#define COOLHASH_T_LOCK_INIT(l) (*(l) = 0)
+#define COOLHASH_T_LOCK_DESTROY(l) ((void) (l))
+#define COOLHASH_T_LOCK_ACQUIRE(l) ((void) (l))
+#define COOLHASH_T_LOCK_RELEASE(l) ((void) (l))
+#else
+#error "Unknown COOLHASH_T_LOCK"
+#endif
+
+struct COOLHASH_T_NODE {
+        COOLHASH_T_KEY key; /**< Node key */
+        struct COOLHASH_T_NODE *next; /**< Next node */
+        COOLHASH_T_VALUE value; /**< Node value, stored inline */
+};
+
+struct COOLHASH_T_TABLE {
+        unsigned int n; /**< Number of items currently in table */
+        unsigned int mask; /**< Size of table minus one (power of two) */
+        unsigned int grow_at; /**< When to grow */
+        COOLHASH_T_LOCK_T table_mx;
+
+        struct COOLHASH_T_NODE **nodes; /**< Table nodes */
+} __attribute__((aligned(64)));
+
+struct COOLHASH_T_NAME {
+        struct COOLHASH_T_TABLE tables[COOLHASH_T_SHARDS];
+};
+
+/**
+ * @brief Table 'key' would be in
+ */
+static inline struct COOLHASH_T_TABLE *COOLHASH_T_FN(_table_find)(
+                struct COOLHASH_T_NAME *t, COOLHASH_T_KEY key)
+{
+        return &t->tables[(uintmax_t) key % COOLHASH_T_SHARDS];
+}
+
+/**
+ * @brief Bucket 'key' would be in; the shard bits are divided out first so
+ * keys of the same shard spread over every bucket
+ */
+static inline struct COOLHASH_T_NODE **COOLHASH_T_FN(_bucket)(
+                struct COOLHASH_T_TABLE *table, COOLHASH_T_KEY key)
+{
+        return &table->nodes[((uintmax_t) key / COOLHASH_T_SHARDS) &
+                table->mask];
+}
+
+/**
+ * @brief Double a table - the table must be locked
+ */
+static inline void COOLHASH_T_FN(_rehash)(struct COOLHASH_T_TABLE *table)
+{
+        struct COOLHASH_T_NODE **oldnodes, *node, *noden, **bucket;
+        unsigned int i, oldsize;
+
+        oldnodes = table->nodes;
+        oldsize = table->mask + 1;
+
+        table->nodes = (struct COOLHASH_T_NODE **)
+                calloc((size_t) oldsize * 2, sizeof(*table->nodes));
+        if (table->nodes == NULL) {
+                table->nodes = oldnodes;
+                return;
+        }
+
+        table->mask = oldsize * 2 - 1;
+        table->grow_at = (unsigned int)
+                ((uint64_t) oldsize * 2 * COOLHASH_T_LOAD_FACTOR / 100);
+
+        for (i = 0; i < oldsize; i++) {
+                for (node = oldnodes[i]; node; node = noden) {
+                        noden = node->next;
+                        bucket = COOLHASH_T_FN(_bucket)(table, node->key);
+                        node->next = *bucket;
+                        *bucket = node;
+                }
+        }
+
+        free(oldnodes);
+}
+
+/**
+ * @brief Free instance
+ *
+ * @param t Instance
+ */
+static inline void COOLHASH_T_FN(free)(struct COOLHASH_T_NAME *t)
+{
+        struct COOLHASH_T_NODE *node, *noden;
+        unsigned int i, j;
+
+        if (t == NULL)
+                return;
+
+        for (i = 0; i < COOLHASH_T_SHARDS; i++) {
+                if (t->tables[i].nodes == NULL)
+                        continue;
+
+                for (j = 0; j <= t->tables[i].mask; j++) {
+                        for (node = t->tables[i].nodes[j]; node;
+                                        node = noden) {
+                                noden = node->next;
+                                free(node);
+                        }
+                }
+
+                free(t->tables[i].nodes);
+                COOLHASH_T_LOCK_DESTROY(&t->tables[i].table_mx);
+        }
+
+        free(t);
+}
+
+/**
+ * @brief Initialize new instance
+ *
+ * @param size Initial hash table size, rounded up to a power of two per shard
+ *
+ * @return New instance or NULL on failure
+ */
+static inline struct COOLHASH_T_NAME *COOLHASH_T_FN(new)(unsigned int size)
+{
+        struct COOLHASH_T_NAME *t;
+        unsigned int i, shard_size;
+        void *ptr;
+
+        /* Shards are cache-line aligned so their locks are not shared;
+         * malloc only guarantees 16 bytes */
+        if (posix_memalign(&ptr, 64, sizeof(*t)) != 0)
+                return NULL;
+        t = (struct COOLHASH_T_NAME *) ptr;
+        memset(t, 0, sizeof(*t));
+
+        for (shard_size = 1; shard_size * COOLHASH_T_SHARDS < size;
+                        shard_size *= 2)
+                ;
+
+        for (i = 0; i < COOLHASH_T_SHARDS; i++) {
+                t->tables[i].mask = shard_size - 1;
+                t->tables[i].grow_at = (unsigned int)
+                        ((uint64_t) shard_size * COOLHASH_T_LOAD_FACTOR / 100);
+                t->tables[i].nodes = (struct COOLHASH_T_NODE **)
+                        calloc(shard_size, sizeof(*t->tables[i].nodes));
+                if (t->tables[i].nodes == NULL ||
+                                COOLHASH_T_LOCK_INIT(&t->tables[i].table_mx)
+                                != 0) {
+                        free(t->tables[i].nodes);
+                        t->tables[i].nodes = NULL;
+                        COOLHASH_T_FN(free)(t);
+                        return NULL;
+                }
+        }
+
+        return t;
+}
+
+/**
+ * @brief Add/replace item
+ *
+ * @param t Instance
+ * @param key Key
+ * @param value Value to copy in
+ *
+ * @return Non-zero error (no memory)
+ */
+static inline int COOLHASH_T_FN(set)(struct COOLHASH_T_NAME *t,
+                COOLHASH_T_KEY key, const COOLHASH_T_VALUE *value)
+{
+        struct COOLHASH_T_TABLE *table;
+        struct COOLHASH_T_NODE *node, **bucket;
+
+        table = COOLHASH_T_FN(_table_find)(t, key);
+
+        COOLHASH_T_LOCK_ACQUIRE(&table->table_mx);
+
+        bucket = COOLHASH_T_FN(_bucket)(table, key);
+        for (node = *bucket; node && node->key != key; node = node->next)
+                ;
+        if (node) {
+                node->value = *value;
+                COOLHASH_T_LOCK_RELEASE(&table->table_mx);
+                return 0;
+        }
+
+        node = (struct COOLHASH_T_NODE *) malloc(sizeof(*node));
+        if (node == NULL) {
+                COOLHASH_T_LOCK_RELEASE(&table->table_mx);
+                return -1;
+        }
+        node->key = key;
+        node->value = *value;
+        node->next = *bucket;
+        *bucket = node;
+
+        if (++table->n > table->grow_at)
+                COOLHASH_T_FN(_rehash)(table);
+
+        COOLHASH_T_LOCK_RELEASE(&table->table_mx);
+        return 0;
+}
+
+/**
+ * @brief Retrieve item and copy its value out
+ *
+ * @param t Instance
+ * @param key Key
+ * @param dst Destination
+ *
+ * @return Non-zero failure (item not found)
+ */
+static inline int COOLHASH_T_FN(get_copy)(struct COOLHASH_T_NAME *t,
+                COOLHASH_T_KEY key, COOLHASH_T_VALUE *dst)
+{
+        struct COOLHASH_T_TABLE *table;
+        struct COOLHASH_T_NODE *node;
+
+        table = COOLHASH_T_FN(_table_find)(t, key);
+
+        COOLHASH_T_LOCK_ACQUIRE(&table->table_mx);
+
+        node = *COOLHASH_T_FN(_bucket)(table, key);
+        for (; node && node->key != key; node = node->next)
+                ;
+        if (node)
+                *dst = node->value;
+
+        COOLHASH_T_LOCK_RELEASE(&table->table_mx);
+
+        return node ? 0 : -1;
+}
+
+/**
+ * @brief Delete item
+ *
+ * @param t Instance
+ * @param key Key
+ *
+ * @return Non-zero failure (item not found)
+ */
+static inline int COOLHASH_T_FN(del)(struct COOLHASH_T_NAME *t,
+                COOLHASH_T_KEY key)
+{
+        struct COOLHASH_T_TABLE *table;
+        struct COOLHASH_T_NODE *node, **prev;
+
+        table = COOLHASH_T_FN(_table_find)(t, key);
+
+        COOLHASH_T_LOCK_ACQUIRE(&table->table_mx);
+
+        prev = COOLHASH_T_FN(_bucket)(table, key);
+        for (node = *prev; node && node->key != key; node = node->next)
+                prev = &node->next;
+        if (node) {
+                *prev = node->next;
+                table->n--;
+        }
+
+        COOLHASH_T_LOCK_RELEASE(&table->table_mx);
+
+        free(node);
+        return node ? 0 : -1;
+}
+
+/**
+ * @brief Number of items across all shards (not a consistent snapshot)
+ *
+ * @param t Instance
+ *
+ * @return Item count
+ */
+static inline unsigned int COOLHASH_T_FN(count)(struct COOLHASH_T_NAME *t)
+{
+        unsigned int i, n;
+
+        n = 0;
+        for (i = 0; i < COOLHASH_T_SHARDS; i++) {
+                COOLHASH_T_LOCK_ACQUIRE(&t->tables[i].table_mx);
+                n += t->tables[i].n;
+                COOLHASH_T_LOCK_RELEASE(&t->tables[i].table_mx);
+        }
+
+        return n;
+}
+
+#undef COOLHASH_T_LOCK_T
+#undef COOLHASH_T_LOCK_INIT
+#undef COOLHASH_T_LOCK_DESTROY
+#undef COOLHASH_T_LOCK_ACQUIRE
+#undef COOLHASH_T_LOCK_RELEASE
+#undef COOLHASH_T_TABLE
+#undef COOLHASH_T_NODE
+#undef COOLHASH_T_FN
+#undef COOLHASH_T_NAME
+#undef COOLHASH_T_KEY
+#undef COOLHASH_T_VALUE
+#undef COOLHASH_T_SHARDS
+#undef COOLHASH_T_LOAD_FACTOR
+#undef COOLHASH_T_LOCK
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,1387 @@
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "inc.h"
+
+#define COOLHASH_CUCKOO_BFS_MAX 512 /**< Buckets searched for a free slot */
+#define COOLHASH_CUCKOO_BFS_TRIES 4 /**< Searches for a path around held
+                                      slots before the shard grows */
+#define COOLHASH_CUCKOO_SPINS 64 /**< Spins before yielding the CPU, or going
+                                   to sleep on a slot lock */
+
+_Static_assert(sizeof(struct coolhash_cuckoo_bucket) == 64,
+                "cuckoo buckets must fill exactly one cache line");
+
+struct coolhash_cuckoo_bfs {
+        unsigned int bucket; /**< Bucket index */
+        int parent; /**< Entry we came from, -1 for a candidate bucket */
+        int slot; /**< Slot in the parent bucket that would move here */
+};
+
+static struct coolhash_cuckoo *_coolhash_cuckoo_alloc(struct coolhash *ch,
+                unsigned int nbuckets);
+static void _coolhash_cuckoo_candidates(struct coolhash_cuckoo *ck,
+                coolhash_key_t key, unsigned int *b1, unsigned int *b2);
+static int _coolhash_cuckoo_passed(const struct timespec *abstime);
+static void _coolhash_cuckoo_bucket_lock(struct coolhash_cuckoo_bucket *b);
+static int _coolhash_cuckoo_bucket_lock_until(struct coolhash_cuckoo_bucket *b,
+                const struct timespec *abstime);
+static void _coolhash_cuckoo_bucket_unlock(struct coolhash_cuckoo_bucket *b);
+static int _coolhash_cuckoo_shard_lock_until(struct coolhash_table *table,
+                int excl, const struct timespec *abstime);
+static int _coolhash_cuckoo_lock_pair_until(struct coolhash_cuckoo *ck,
+                unsigned int b1, unsigned int b2,
+                const struct timespec *abstime);
+static void _coolhash_cuckoo_unlock_pair(struct coolhash_cuckoo *ck,
+                unsigned int b1, unsigned int b2);
+static int _coolhash_cuckoo_slot_find(struct coolhash_cuckoo_bucket *b,
+                coolhash_key_t key);
+static int _coolhash_cuckoo_slot_peek(struct coolhash_cuckoo_bucket *b,
+                coolhash_key_t key);
+static int _coolhash_cuckoo_slot_free(struct coolhash_cuckoo_bucket *b);
+static void _coolhash_cuckoo_slot_put(struct coolhash_cuckoo_bucket *b,
+                int slot, coolhash_key_t key, void *data);
+static int _coolhash_cuckoo_find_lock(struct coolhash_table *table,
+                coolhash_key_t key, int ro, const struct timespec *abstime,
+                struct coolhash_cuckoo_bucket **bucket, int *slot);
+static int _coolhash_cuckoo_slot_trylock(struct coolhash_cuckoo_bucket *b,
+                int slot, int ro);
+static int _coolhash_cuckoo_slot_wait(struct coolhash_cuckoo_bucket *b,
+                int slot, int ro, const struct timespec *abstime);
+static void _coolhash_cuckoo_slot_park(uint32_t *lock, uint32_t v,
+                const struct timespec *abstime);
+static void _coolhash_cuckoo_slot_wake(uint32_t *lock);
+static void _coolhash_cuckoo_slot_release(struct coolhash_cuckoo_bucket *b,
+                int slot);
+static void _coolhash_cuckoo_slot_unlock(struct coolhash_table *table,
+                struct coolhash_cuckoo_bucket *b, int slot);
+static void _coolhash_cuckoo_slot_follow(struct coolhash_table *table,
+                struct coolhash_cuckoo_bucket **bucket, int *slot);
+static int _coolhash_cuckoo_insert_excl(struct coolhash_cuckoo *ck,
+                coolhash_key_t key, void *data,
+                struct coolhash_cuckoo_bucket **bucket, int *slot);
+static int _coolhash_cuckoo_grow(struct coolhash *ch,
+                struct coolhash_table *table);
+static struct coolhash_cuckoo_bucket *_coolhash_cuckoo_lock_bucket(
+                void *lock);
+
+/**
+ * @brief Set up a table shard for the cuckoo engine
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ *
+ * @return Non-zero error (likely no memory)
+ */
+int _coolhash_cuckoo_init(struct coolhash *ch, struct coolhash_table *table)
+{
+        unsigned int nbuckets, want;
+
+        want = (ch->profile.size / ch->profile.shards +
+                        COOLHASH_CUCKOO_SLOTS - 1) / COOLHASH_CUCKOO_SLOTS;
+        for (nbuckets = 2; nbuckets < want; nbuckets *= 2)
+                ;
+
+        table->cuckoo = _coolhash_cuckoo_alloc(ch, nbuckets);
+        if (table->cuckoo == NULL)
+                return -1;
+
+        if (pthread_rwlock_init(&table->cuckoo_mx, NULL) != 0) {
+                _coolhash_mem_free(ch, table->cuckoo, table->cuckoo->len);
+                table->cuckoo = NULL;
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Free a cuckoo table shard, calling a callback for each item
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ * @param cb Callback (optional)
+ * @param cb_arg Callback argument (optional)
+ */
+void _coolhash_cuckoo_destroy(struct coolhash *ch,
+                struct coolhash_table *table, coolhash_free_foreach_func cb,
+                void *cb_arg)
+{
+        struct coolhash_cuckoo *ck, *ckn;
+        unsigned int i;
+        int s;
+
+        if (table->cuckoo == NULL)
+                return;
+
+        if (cb) {
+                ck = table->cuckoo;
+                for (i = 0; i <= ck->mask; i++) {
+                        for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                                if (ck->buckets[i].data[s])
+                                        cb(ck->buckets[i].data[s], cb_arg);
+                        }
+                }
+        }
+
+        for (ck = table->cuckoo; ck; ck = ckn) {
+                ckn = ck->next;
+                _coolhash_mem_free(ch, ck, ck->len);
+        }
+        table->cuckoo = NULL;
+
+        pthread_rwlock_destroy(&table->cuckoo_mx);
+}
+
+/**
+ * @brief Add/replace item. Only the key's two candidate buckets are locked,
+ * unless both are full and items have to be moved around to make room.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Pointer to your data
+ *
+ * @return Non-zero error (likely no memory)
+ */
+int _coolhash_cuckoo_set(struct coolhash *ch, coolhash_key_t key, void *data)
+{
+        return _coolhash_cuckoo_set_until(ch, key, data, NULL);
+}
+
+/**
+ * @brief Add/replace item, giving up on any lock not acquired by a deadline.
+ * Replacing waits for the item's holders, like the chain engine does. Holders
+ * take the shard lock to delete, so that wait happens without it and the key
+ * is looked up again afterwards.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Pointer to your data
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero, -1 on error (likely no memory) or -ETIMEDOUT
+ */
+int _coolhash_cuckoo_set_until(struct coolhash *ch, coolhash_key_t key,
+                void *data, const struct timespec *abstime)
+{
+        struct coolhash_table *table;
+        struct coolhash_cuckoo *ck;
+        struct coolhash_cuckoo_bucket *b;
+        unsigned int b1, b2;
+        int s, res, waited;
+
+        table = _coolhash_table_find(ch, key);
+        waited = 0;
+
+retry:
+        if ((res = _coolhash_cuckoo_shard_lock_until(table, 0, abstime)) != 0)
+                return res;
+        ck = table->cuckoo;
+        _coolhash_cuckoo_candidates(ck, key, &b1, &b2);
+        if ((res = _coolhash_cuckoo_lock_pair_until(ck, b1, b2,
+                                        abstime)) != 0) {
+                pthread_rwlock_unlock(&table->cuckoo_mx);
+                return res;
+        }
+
+        b = &ck->buckets[b1];
+        if ((s = _coolhash_cuckoo_slot_find(b, key)) < 0) {
+                b = &ck->buckets[b2];
+                s = _coolhash_cuckoo_slot_find(b, key);
+        }
+
+        if (s >= 0) {
+                if (_coolhash_cuckoo_slot_trylock(b, s, 0) == 0) {
+                        COOLHASH_PROBE3(node_lock_acquire, &b->data[s], 0,
+                                        waited);
+                        __atomic_store_n(&b->data[s], data, __ATOMIC_RELEASE);
+                        _coolhash_cuckoo_slot_release(b, s);
+                        res = 0;
+                } else {
+                        res = 2; /* Held */
+                }
+        } else if ((s = _coolhash_cuckoo_slot_free(&ck->buckets[b1])) >= 0) {
+                _coolhash_cuckoo_slot_put(&ck->buckets[b1], s, key, data);
+                __atomic_add_fetch(&table->n, 1, __ATOMIC_RELAXED);
+                res = 0;
+        } else if ((s = _coolhash_cuckoo_slot_free(&ck->buckets[b2])) >= 0) {
+                _coolhash_cuckoo_slot_put(&ck->buckets[b2], s, key, data);
+                __atomic_add_fetch(&table->n, 1, __ATOMIC_RELAXED);
+                res = 0;
+        } else {
+                res = 1; /* Both buckets are full */
+        }
+
+        _coolhash_cuckoo_unlock_pair(ck, b1, b2);
+        pthread_rwlock_unlock(&table->cuckoo_mx);
+
+        if (res == 1) {
+                /* Make room; this needs the whole shard */
+                if ((res = _coolhash_cuckoo_shard_lock_until(table, 1,
+                                                abstime)) != 0)
+                        return res;
+                for (;;) {
+                        ck = table->cuckoo;
+                        res = _coolhash_cuckoo_insert_excl(ck, key, data, &b,
+                                        &s);
+                        if (res != -1)
+                                break;
+                        if (_coolhash_cuckoo_grow(ch, table) != 0)
+                                break;
+                }
+                if (res == 1)
+                        __atomic_add_fetch(&table->n, 1, __ATOMIC_RELAXED);
+                pthread_rwlock_unlock(&table->cuckoo_mx);
+        }
+
+        if (res == 2) {
+                waited = 1;
+                COOLHASH_PROBE2(node_lock_wait, &b->data[s], 0);
+                if ((res = _coolhash_cuckoo_slot_wait(b, s, 0, abstime)) != 0)
+                        return res;
+                goto retry;
+        }
+
+        return res >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Retrieve item, giving up on any lock not acquired by a deadline.
+ * Only the item's slot is locked, so the rest of its bucket stays available;
+ * it stays locked until coolhash_unlock or coolhash_del is called with the
+ * returned lock.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Filled in with the data pointer
+ * @param lock Filled in with the lock pointer
+ * @param ro Boolean, readonly?
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero, -1 if not found or -ETIMEDOUT
+ */
+int _coolhash_cuckoo_get_until(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, int ro,
+                const struct timespec *abstime)
+{
+        struct coolhash_cuckoo_bucket *b;
+        int s, res;
+
+        if ((res = _coolhash_cuckoo_find_lock(_coolhash_table_find(ch, key),
+                                        key, ro, abstime, &b, &s)) != 0)
+                return res;
+
+        *data = __atomic_load_n(&b->data[s], __ATOMIC_RELAXED);
+        *lock = &b->data[s];
+        return 0;
+}
+
+/**
+ * @brief Retrieve item and copy data into destination buffer without the
+ * shard lock. A miss only reads the candidate buckets, checking their version
+ * counters, and writes nothing. A hit holds a read lock on the key's slot
+ * while it copies, so it never reads data that a writer may have deleted and
+ * freed meanwhile; the bucket's version is left alone and other readers of
+ * the slot are not held up.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param dst Destination buffer
+ * @param dst_len Buffer length
+ *
+ * @return Non-zero failure (item not found)
+ */
+int _coolhash_cuckoo_get_copy(struct coolhash *ch, coolhash_key_t key,
+                void *dst, size_t dst_len)
+{
+        struct coolhash_table *table;
+        struct coolhash_cuckoo_bucket *b;
+        int s;
+
+        table = _coolhash_table_find(ch, key);
+
+        if (_coolhash_cuckoo_find_lock(table, key, 1, NULL, &b, &s) != 0)
+                return -1;
+
+        memcpy(dst, __atomic_load_n(&b->data[s], __ATOMIC_RELAXED), dst_len);
+        _coolhash_cuckoo_slot_unlock(table, b, s);
+
+        return 0;
+}
+
+/**
+ * @brief Prefetch both buckets a key may live in
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ */
+void _coolhash_cuckoo_prefetch(struct coolhash *ch, coolhash_key_t key)
+{
+        struct coolhash_cuckoo *ck;
+        unsigned int b1, b2;
+
+        ck = __atomic_load_n(&_coolhash_table_find(ch, key)->cuckoo,
+                        __ATOMIC_ACQUIRE);
+        _coolhash_cuckoo_candidates(ck, key, &b1, &b2);
+        __builtin_prefetch(&ck->buckets[b1], 0, 1);
+        __builtin_prefetch(&ck->buckets[b2], 0, 1);
+}
+
+/**
+ * @brief Delete item by key, waiting for its holders first
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ *
+ * @return Non-zero failure (item not found)
+ */
+int _coolhash_cuckoo_del_key(struct coolhash *ch, coolhash_key_t key)
+{
+        struct coolhash_table *table;
+        struct coolhash_cuckoo *ck;
+        struct coolhash_cuckoo_bucket *b;
+        unsigned int b1, b2;
+        int s, res, waited;
+
+        table = _coolhash_table_find(ch, key);
+        waited = 0;
+
+        for (;;) {
+                pthread_rwlock_rdlock(&table->cuckoo_mx);
+                ck = table->cuckoo;
+                _coolhash_cuckoo_candidates(ck, key, &b1, &b2);
+                _coolhash_cuckoo_lock_pair_until(ck, b1, b2, NULL);
+
+                b = &ck->buckets[b1];
+                if ((s = _coolhash_cuckoo_slot_find(b, key)) < 0) {
+                        b = &ck->buckets[b2];
+                        s = _coolhash_cuckoo_slot_find(b, key);
+                }
+
+                res = -1;
+                if (s >= 0) {
+                        if (_coolhash_cuckoo_slot_trylock(b, s, 0) == 0) {
+                                COOLHASH_PROBE3(node_lock_acquire,
+                                                &b->data[s], 0, waited);
+                                __atomic_store_n(&b->data[s], NULL,
+                                                __ATOMIC_RELAXED);
+                                __atomic_sub_fetch(&table->n, 1,
+                                                __ATOMIC_RELAXED);
+                                _coolhash_cuckoo_slot_release(b, s);
+                                res = 0;
+                        } else {
+                                res = 1; /* Held */
+                        }
+                }
+
+                _coolhash_cuckoo_unlock_pair(ck, b1, b2);
+                pthread_rwlock_unlock(&table->cuckoo_mx);
+
+                if (res != 1)
+                        return res;
+
+                waited = 1;
+                COOLHASH_PROBE2(node_lock_wait, &b->data[s], 0);
+                _coolhash_cuckoo_slot_wait(b, s, 0, NULL);
+        }
+}
+
+/**
+ * @brief Delete the item a lock from a 'get' points to, and unlock it. The
+ * shard lock is taken shared, which keeps the shard from growing meanwhile;
+ * on -ETIMEDOUT the item is still held.
+ *
+ * @param ch coolhash instance
+ * @param lock Lock pointer
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+int _coolhash_cuckoo_del_until(struct coolhash *ch, void *lock,
+                const struct timespec *abstime)
+{
+        struct coolhash_cuckoo_bucket *b;
+        struct coolhash_table *table;
+        int s, res;
+
+        b = _coolhash_cuckoo_lock_bucket(lock);
+        s = (int) ((void **) lock - b->data);
+        table = _coolhash_table_find(ch, b->keys[s]);
+
+        if ((res = _coolhash_cuckoo_shard_lock_until(table, 0, abstime)) != 0)
+                return res;
+        _coolhash_cuckoo_slot_follow(table, &b, &s);
+
+        _coolhash_cuckoo_bucket_lock(b);
+        __atomic_store_n(&b->data[s], NULL, __ATOMIC_RELAXED);
+        _coolhash_cuckoo_bucket_unlock(b);
+        __atomic_sub_fetch(&table->n, 1, __ATOMIC_RELAXED);
+        _coolhash_cuckoo_slot_release(b, s);
+
+        pthread_rwlock_unlock(&table->cuckoo_mx);
+
+        return 0;
+}
+
+/**
+ * @brief Unlock the item a lock from a 'get' points to
+ *
+ * @param ch coolhash instance
+ * @param lock Lock pointer
+ */
+void _coolhash_cuckoo_unlock(struct coolhash *ch, void *lock)
+{
+        struct coolhash_cuckoo_bucket *b;
+        int s;
+
+        b = _coolhash_cuckoo_lock_bucket(lock);
+        s = (int) ((void **) lock - b->data);
+
+        _coolhash_cuckoo_slot_unlock(_coolhash_table_find(ch, b->keys[s]), b,
+                        s);
+}
+
+/**
+ * @brief Loop through every item, locking each item's slot before calling
+ * the callback (which must unlock or delete it). Each shard's lock is held
+ * shared throughout, so its bucket array is not replaced under us.
+ *
+ * @param ch coolhash instance
+ * @param cb Callback function
+ * @param cb_arg Callback function argument
+ * @param ro Boolean, readonly?
+ */
+void _coolhash_cuckoo_foreach(struct coolhash *ch, coolhash_foreach_func cb,
+                void *cb_arg, int ro)
+{
+        struct coolhash_table *table;
+        struct coolhash_cuckoo *ck;
+        struct coolhash_cuckoo_bucket *b;
+        unsigned int i, j;
+        int s, waited;
+
+        waited = 0;
+
+        for (i = 0; i < ch->profile.shards; i++) {
+                table = &ch->tables[i];
+
+                pthread_rwlock_rdlock(&table->cuckoo_mx);
+                ck = table->cuckoo;
+                for (j = 0; j <= ck->mask; j++) {
+                        b = &ck->buckets[j];
+                        for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                                if (__atomic_load_n(&b->data[s],
+                                                        __ATOMIC_RELAXED) ==
+                                                NULL)
+                                        continue;
+
+                                if (_coolhash_cuckoo_slot_trylock(b, s,
+                                                        ro) != 0) {
+                                        waited = 1;
+                                        COOLHASH_PROBE2(node_lock_wait,
+                                                        &b->data[s], ro);
+                                        _coolhash_cuckoo_slot_wait(b, s, ro,
+                                                        NULL);
+                                        s--; /* Look at it again */
+                                        continue;
+                                }
+                                COOLHASH_PROBE3(node_lock_acquire,
+                                                &b->data[s], ro, waited);
+                                waited = 0;
+
+                                /* Deleted while we waited for it */
+                                if (__atomic_load_n(&b->data[s],
+                                                        __ATOMIC_ACQUIRE) ==
+                                                NULL) {
+                                        _coolhash_cuckoo_slot_unlock(table, b,
+                                                        s);
+                                        continue;
+                                }
+
+                                /* The callback needs to unlock or delete the
+                                 * slot. */
+                                cb(ch, b->keys[s], b->data[s], &b->data[s],
+                                                cb_arg);
+                        }
+                }
+                pthread_rwlock_unlock(&table->cuckoo_mx);
+        }
+}
+
+/**
+ * @brief Memory used by a cuckoo shard - the same breakdown as coolhash_mem
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ * @param mem Filled in with byte counts
+ */
+void _coolhash_cuckoo_mem(struct coolhash *ch, struct coolhash_table *table,
+                struct coolhash_mem *mem)
+{
+        struct coolhash_cuckoo *ck;
+
+        memset(mem, 0, sizeof(*mem));
+
+        pthread_rwlock_rdlock(&table->cuckoo_mx);
+
+        mem->buckets = _coolhash_mem_size(ch, table->cuckoo->len);
+        mem->locks = sizeof(table->cuckoo_mx);
+        for (ck = table->cuckoo->next; ck; ck = ck->next)
+                mem->extra += _coolhash_mem_size(ch, ck->len); /* Retired */
+
+        pthread_rwlock_unlock(&table->cuckoo_mx);
+
+        mem->total = mem->buckets + mem->locks + mem->extra;
+}
+
+/**
+ * @brief Allocate an empty bucket array, aligned to the bucket size
+ *
+ * @param ch coolhash instance
+ * @param nbuckets Number of buckets (power of two)
+ *
+ * @return Bucket array or NULL on failure
+ */
+static struct coolhash_cuckoo *_coolhash_cuckoo_alloc(struct coolhash *ch,
+                unsigned int nbuckets)
+{
+        struct coolhash_cuckoo *ck;
+        size_t len;
+        void *ptr;
+
+        len = sizeof(*ck) + (size_t) nbuckets * sizeof(*ck->buckets);
+
+        if (ch->profile.hugepages && len >= COOLHASH_HUGEPAGE_SIZE / 2) {
+                ptr = _coolhash_mem_alloc(ch, len); /* Page aligned */
+                if (ptr == NULL)
+                        return NULL;
+        } else {
+                if (posix_memalign(&ptr, sizeof(*ck->buckets), len) != 0)
+                        return NULL;
+                memset(ptr, 0, len);
+        }
+
+        ck = ptr;
+        ck->next = NULL;
+        ck->len = len;
+        ck->mask = nbuckets - 1;
+
+        return ck;
+}
+
+/**
+ * @brief The two buckets a key may live in
+ *
+ * @param ck Bucket array
+ * @param key Hashed key
+ * @param b1 Filled in with the first bucket
+ * @param b2 Filled in with the second bucket (never the same as the first)
+ */
+static void _coolhash_cuckoo_candidates(struct coolhash_cuckoo *ck,
+                coolhash_key_t key, unsigned int *b1, unsigned int *b2)
+{
+        uint64_t hash;
+
+        hash = _coolhash_mix(key);
+        *b1 = (unsigned int) hash & ck->mask;
+        *b2 = (unsigned int) (hash >> 32) & ck->mask;
+        if (*b2 == *b1)
+                *b2 = *b1 ^ 1;
+}
+
+/**
+ * @brief Whether a deadline has passed
+ *
+ * @param abstime Deadline (CLOCK_REALTIME)
+ *
+ * @return Boolean
+ */
+static int _coolhash_cuckoo_passed(const struct timespec *abstime)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        return now.tv_sec > abstime->tv_sec ||
+                (now.tv_sec == abstime->tv_sec &&
+                 now.tv_nsec >= abstime->tv_nsec);
+}
+
+/**
+ * @brief Lock a bucket by making its version odd
+ *
+ * @param b Bucket
+ */
+static void _coolhash_cuckoo_bucket_lock(struct coolhash_cuckoo_bucket *b)
+{
+        _coolhash_cuckoo_bucket_lock_until(b, NULL);
+}
+
+/**
+ * @brief Lock a bucket, giving up at a deadline. The deadline is checked
+ * right after the first failed attempt, so one in the past makes this a
+ * trylock.
+ *
+ * @param b Bucket
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+static int _coolhash_cuckoo_bucket_lock_until(struct coolhash_cuckoo_bucket *b,
+                const struct timespec *abstime)
+{
+        unsigned int spins;
+        uint32_t v;
+
+        for (spins = 0;; spins++) {
+                v = __atomic_load_n(&b->version, __ATOMIC_RELAXED);
+                if (!(v & 1) && __atomic_compare_exchange_n(&b->version, &v,
+                                        v + 1, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+                        break;
+
+                if (abstime && spins % COOLHASH_CUCKOO_SPINS == 0 &&
+                                _coolhash_cuckoo_passed(abstime))
+                        return -ETIMEDOUT;
+
+                if (spins % COOLHASH_CUCKOO_SPINS == COOLHASH_CUCKOO_SPINS - 1)
+                        sched_yield();
+        }
+
+        /* Optimistic readers must not see our writes before the odd
+         * version */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        return 0;
+}
+
+/**
+ * @brief Unlock a bucket, publishing a new even version
+ *
+ * @param b Bucket
+ */
+static void _coolhash_cuckoo_bucket_unlock(struct coolhash_cuckoo_bucket *b)
+{
+        __atomic_add_fetch(&b->version, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Take a shard's bucket array lock, giving up at a deadline
+ *
+ * @param table Table
+ * @param excl Boolean, exclusively?
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+static int _coolhash_cuckoo_shard_lock_until(struct coolhash_table *table,
+                int excl, const struct timespec *abstime)
+{
+        int res;
+
+        if (abstime == NULL) {
+                if (excl)
+                        pthread_rwlock_wrlock(&table->cuckoo_mx);
+                else
+                        pthread_rwlock_rdlock(&table->cuckoo_mx);
+                return 0;
+        }
+
+        if (excl)
+                res = pthread_rwlock_timedwrlock(&table->cuckoo_mx, abstime);
+        else
+                res = pthread_rwlock_timedrdlock(&table->cuckoo_mx, abstime);
+
+        return res ? -ETIMEDOUT : 0;
+}
+
+/**
+ * @brief Lock both candidate buckets, lowest index first, giving up at a
+ * deadline
+ *
+ * @param ck Bucket array
+ * @param b1 First bucket
+ * @param b2 Second bucket
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT (neither bucket is locked then)
+ */
+static int _coolhash_cuckoo_lock_pair_until(struct coolhash_cuckoo *ck,
+                unsigned int b1, unsigned int b2,
+                const struct timespec *abstime)
+{
+        struct coolhash_cuckoo_bucket *lo, *hi;
+
+        lo = &ck->buckets[b1 < b2 ? b1 : b2];
+        hi = &ck->buckets[b1 < b2 ? b2 : b1];
+
+        if (_coolhash_cuckoo_bucket_lock_until(lo, abstime) != 0)
+                return -ETIMEDOUT;
+        if (_coolhash_cuckoo_bucket_lock_until(hi, abstime) != 0) {
+                _coolhash_cuckoo_bucket_unlock(lo);
+                return -ETIMEDOUT;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Unlock both candidate buckets
+ *
+ * @param ck Bucket array
+ * @param b1 First bucket
+ * @param b2 Second bucket
+ */
+static void _coolhash_cuckoo_unlock_pair(struct coolhash_cuckoo *ck,
+                unsigned int b1, unsigned int b2)
+{
+        _coolhash_cuckoo_bucket_unlock(&ck->buckets[b1]);
+        _coolhash_cuckoo_bucket_unlock(&ck->buckets[b2]);
+}
+
+/**
+ * @brief Find the slot holding a key
+ *
+ * @param b Bucket
+ * @param key Hashed key
+ *
+ * @return Slot or -1 if not found
+ */
+static int _coolhash_cuckoo_slot_find(struct coolhash_cuckoo_bucket *b,
+                coolhash_key_t key)
+{
+        int s;
+
+        for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                if (b->data[s] && b->keys[s] == key)
+                        return s;
+        }
+
+        return -1;
+}
+
+/**
+ * @brief Find the slot holding a key without the bucket locked, as
+ * optimistic readers do
+ *
+ * @param b Bucket
+ * @param key Hashed key
+ *
+ * @return Slot or -1 if not found
+ */
+static int _coolhash_cuckoo_slot_peek(struct coolhash_cuckoo_bucket *b,
+                coolhash_key_t key)
+{
+        int s;
+
+        for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                if (__atomic_load_n(&b->keys[s], __ATOMIC_RELAXED) == key &&
+                                __atomic_load_n(&b->data[s], __ATOMIC_RELAXED))
+                        return s;
+        }
+
+        return -1;
+}
+
+/**
+ * @brief Find an empty slot
+ *
+ * @param b Bucket
+ *
+ * @return Slot or -1 if the bucket is full
+ */
+static int _coolhash_cuckoo_slot_free(struct coolhash_cuckoo_bucket *b)
+{
+        int s;
+
+        for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                if (b->data[s] == NULL)
+                        return s;
+        }
+
+        return -1;
+}
+
+/**
+ * @brief Fill an empty slot - the bucket must be locked
+ *
+ * @param b Bucket
+ * @param slot Slot
+ * @param key Hashed key
+ * @param data Data
+ */
+static void _coolhash_cuckoo_slot_put(struct coolhash_cuckoo_bucket *b,
+                int slot, coolhash_key_t key, void *data)
+{
+        /* Readers that see the data also see the key */
+        __atomic_store_n(&b->keys[slot], key, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->data[slot], data, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Find and lock a key's slot without the shard lock. The candidate
+ * buckets are read optimistically, checking their version counters, then the
+ * slot is locked and checked again; nobody changes a locked slot. Waiting for
+ * a held slot sleeps (see _coolhash_cuckoo_slot_wait), and the key is looked
+ * up again afterwards since the item may have moved on or been deleted.
+ *
+ * @param table Table
+ * @param key Hashed key
+ * @param ro Boolean, readonly?
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ * @param bucket Filled in with the bucket
+ * @param slot Filled in with the locked slot
+ *
+ * @return Zero, -1 if not found or -ETIMEDOUT
+ */
+static int _coolhash_cuckoo_find_lock(struct coolhash_table *table,
+                coolhash_key_t key, int ro, const struct timespec *abstime,
+                struct coolhash_cuckoo_bucket **bucket, int *slot)
+{
+        struct coolhash_cuckoo *ck;
+        struct coolhash_cuckoo_bucket *bs[2], *b;
+        unsigned int b1, b2, i, spins;
+        uint32_t v[2];
+        int s, res, waited;
+
+        waited = 0;
+
+        for (spins = 0;; spins++) {
+                if (spins % COOLHASH_CUCKOO_SPINS ==
+                                COOLHASH_CUCKOO_SPINS - 1) {
+                        if (abstime && _coolhash_cuckoo_passed(abstime))
+                                return -ETIMEDOUT;
+                        sched_yield();
+                }
+
+                ck = __atomic_load_n(&table->cuckoo, __ATOMIC_ACQUIRE);
+                _coolhash_cuckoo_candidates(ck, key, &b1, &b2);
+                bs[0] = &ck->buckets[b1];
+                bs[1] = &ck->buckets[b2];
+
+                v[0] = __atomic_load_n(&bs[0]->version, __ATOMIC_ACQUIRE);
+                v[1] = __atomic_load_n(&bs[1]->version, __ATOMIC_ACQUIRE);
+                if ((v[0] | v[1]) & 1)
+                        continue; /* A writer owns one of them */
+
+                b = NULL;
+                s = -1;
+                for (i = 0; i < 2 && b == NULL; i++) {
+                        if ((s = _coolhash_cuckoo_slot_peek(bs[i], key)) >= 0)
+                                b = bs[i];
+                }
+
+                if (b == NULL) {
+                        /* Not there, unless a writer moved it meanwhile */
+                        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                        if (__atomic_load_n(&bs[0]->version,
+                                                __ATOMIC_RELAXED) != v[0] ||
+                                        __atomic_load_n(&bs[1]->version,
+                                                __ATOMIC_RELAXED) != v[1])
+                                continue;
+                        return -1;
+                }
+
+                if (_coolhash_cuckoo_slot_trylock(b, s, ro) != 0) {
+                        waited = 1;
+                        COOLHASH_PROBE2(node_lock_wait, &b->data[s], ro);
+                        if ((res = _coolhash_cuckoo_slot_wait(b, s, ro,
+                                                        abstime)) != 0)
+                                return res;
+                        continue;
+                }
+
+                if (__atomic_load_n(&b->data[s], __ATOMIC_ACQUIRE) == NULL ||
+                                __atomic_load_n(&b->keys[s],
+                                        __ATOMIC_RELAXED) != key) {
+                        _coolhash_cuckoo_slot_unlock(table, b, s);
+                        continue;
+                }
+
+                COOLHASH_PROBE3(node_lock_acquire, &b->data[s], ro, waited);
+                *bucket = b;
+                *slot = s;
+                return 0;
+        }
+}
+
+/**
+ * @brief Try to lock a slot. Slots of a replaced bucket array cannot be
+ * locked any more.
+ *
+ * @param b Bucket
+ * @param slot Slot
+ * @param ro Boolean, readonly?
+ *
+ * @return Non-zero failure (a writer, or for writers anybody, holds it)
+ */
+static int _coolhash_cuckoo_slot_trylock(struct coolhash_cuckoo_bucket *b,
+                int slot, int ro)
+{
+        uint32_t v;
+
+        v = __atomic_load_n(&b->locks[slot], __ATOMIC_RELAXED);
+
+        if (ro) {
+                while (!(v & (COOLHASH_CUCKOO_WRITER |
+                                                COOLHASH_CUCKOO_RETIRED))) {
+                        if (__atomic_compare_exchange_n(&b->locks[slot], &v,
+                                                v + 1, 0, __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
+                                return 0;
+                }
+                return -1;
+        }
+
+        if ((v & ~COOLHASH_CUCKOO_WAITERS) != 0 ||
+                        !__atomic_compare_exchange_n(&b->locks[slot], &v,
+                                v | COOLHASH_CUCKOO_WRITER, 0,
+                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return -1;
+
+        return 0;
+}
+
+/**
+ * @brief Wait until a slot looks like it can be locked, or its bucket array
+ * has been replaced. A short spin covers holders that let go quickly; after
+ * that the thread goes to sleep until the holder releases the slot, as on the
+ * small engine's entries. The deadline is checked right after the first look,
+ * so one in the past makes this return at once.
+ *
+ * @param b Bucket
+ * @param slot Slot
+ * @param ro Boolean, readonly?
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+static int _coolhash_cuckoo_slot_wait(struct coolhash_cuckoo_bucket *b,
+                int slot, int ro, const struct timespec *abstime)
+{
+        unsigned int spins;
+        uint32_t v;
+
+        for (spins = 0;; spins++) {
+                v = __atomic_load_n(&b->locks[slot], __ATOMIC_RELAXED);
+                if ((v & COOLHASH_CUCKOO_RETIRED) ||
+                                (ro ? !(v & COOLHASH_CUCKOO_WRITER) :
+                                 !(v & ~COOLHASH_CUCKOO_WAITERS)))
+                        return 0;
+
+                if (abstime && (spins == 0 || spins >= COOLHASH_CUCKOO_SPINS) &&
+                                _coolhash_cuckoo_passed(abstime))
+                        return -ETIMEDOUT;
+
+                if (spins < COOLHASH_CUCKOO_SPINS)
+                        continue;
+
+                /* Ask whoever releases the slot to wake us up */
+                if (!(v & COOLHASH_CUCKOO_WAITERS) &&
+                                !__atomic_compare_exchange_n(&b->locks[slot],
+                                        &v, v | COOLHASH_CUCKOO_WAITERS, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        continue;
+
+                _coolhash_cuckoo_slot_park(&b->locks[slot],
+                                v | COOLHASH_CUCKOO_WAITERS, abstime);
+        }
+}
+
+/**
+ * @brief Sleep on a slot lock for as long as it still holds a value, or
+ * until a deadline. Returns early on wakeups and signals; callers look at the
+ * lock again either way.
+ *
+ * @param lock Slot lock
+ * @param v Lock value to sleep on
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ */
+static void _coolhash_cuckoo_slot_park(uint32_t *lock, uint32_t v,
+                const struct timespec *abstime)
+{
+#ifdef __linux__
+        syscall(SYS_futex, lock, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG |
+                        FUTEX_CLOCK_REALTIME, v, abstime, NULL,
+                        FUTEX_BITSET_MATCH_ANY);
+#else
+        (void) lock;
+        (void) v;
+        (void) abstime;
+        sched_yield();
+#endif
+}
+
+/**
+ * @brief Wake every thread sleeping on a slot lock
+ *
+ * @param lock Slot lock
+ */
+static void _coolhash_cuckoo_slot_wake(uint32_t *lock)
+{
+#ifdef __linux__
+        syscall(SYS_futex, lock, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+                        NULL, NULL, 0);
+#else
+        (void) lock;
+#endif
+}
+
+/**
+ * @brief Release a write-locked slot, waking any thread sleeping on it - the
+ * shard lock must be held, so the slot cannot be handed over meanwhile
+ *
+ * @param b Bucket
+ * @param slot Slot
+ */
+static void _coolhash_cuckoo_slot_release(struct coolhash_cuckoo_bucket *b,
+                int slot)
+{
+        if (__atomic_exchange_n(&b->locks[slot], 0, __ATOMIC_RELEASE) &
+                        COOLHASH_CUCKOO_WAITERS)
+                _coolhash_cuckoo_slot_wake(&b->locks[slot]);
+}
+
+/**
+ * @brief Unlock a slot locked either way, following it to a new bucket array
+ * if the shard grew while it was held
+ *
+ * @param table Table
+ * @param b Bucket
+ * @param slot Slot
+ */
+static void _coolhash_cuckoo_slot_unlock(struct coolhash_table *table,
+                struct coolhash_cuckoo_bucket *b, int slot)
+{
+        uint32_t v, n;
+
+        for (;;) {
+                _coolhash_cuckoo_slot_follow(table, &b, &slot);
+
+                v = __atomic_load_n(&b->locks[slot], __ATOMIC_RELAXED);
+                if (v & COOLHASH_CUCKOO_MOVED)
+                        continue; /* Handed over just now */
+
+                /* The last reader out, like a writer, clears the waiters
+                 * flag and wakes them */
+                if (v & COOLHASH_CUCKOO_WRITER) {
+                        n = v & COOLHASH_CUCKOO_RETIRED;
+                } else {
+                        n = v - 1;
+                        if ((n & ~COOLHASH_CUCKOO_RETIRED) ==
+                                        COOLHASH_CUCKOO_WAITERS)
+                                n &= COOLHASH_CUCKOO_RETIRED;
+                }
+
+                if (__atomic_compare_exchange_n(&b->locks[slot], &v, n, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                        break;
+        }
+
+        if ((v & COOLHASH_CUCKOO_WAITERS) && !(n & COOLHASH_CUCKOO_WAITERS))
+                _coolhash_cuckoo_slot_wake(&b->locks[slot]);
+}
+
+/**
+ * @brief Find where a held slot's item lives now. Growing a shard does not
+ * wait for holders; it hands their locks over to the item's slot in the new
+ * bucket array and marks the old slot moved. Nobody can move or delete a held
+ * item, so it is still in one of its candidate buckets.
+ *
+ * @param table Table
+ * @param bucket Bucket, updated
+ * @param slot Slot, updated
+ */
+static void _coolhash_cuckoo_slot_follow(struct coolhash_table *table,
+                struct coolhash_cuckoo_bucket **bucket, int *slot)
+{
+        struct coolhash_cuckoo *ck;
+        struct coolhash_cuckoo_bucket *b;
+        coolhash_key_t key;
+        unsigned int b1, b2, spins;
+        int s;
+
+        b = *bucket;
+        s = *slot;
+
+        for (spins = 0; __atomic_load_n(&b->locks[s], __ATOMIC_ACQUIRE) &
+                        COOLHASH_CUCKOO_MOVED; spins++) {
+                ck = __atomic_load_n(&table->cuckoo, __ATOMIC_ACQUIRE);
+                if ((uintptr_t) b >= (uintptr_t) ck->buckets &&
+                                (uintptr_t) b <= (uintptr_t)
+                                &ck->buckets[ck->mask]) {
+                        /* The new array is not out yet */
+                        if (spins % COOLHASH_CUCKOO_SPINS ==
+                                        COOLHASH_CUCKOO_SPINS - 1)
+                                sched_yield();
+                        continue;
+                }
+
+                key = b->keys[s];
+                _coolhash_cuckoo_candidates(ck, key, &b1, &b2);
+                b = &ck->buckets[b1];
+                if ((s = _coolhash_cuckoo_slot_peek(b, key)) < 0) {
+                        b = &ck->buckets[b2];
+                        s = _coolhash_cuckoo_slot_peek(b, key);
+                }
+        }
+
+        *bucket = b;
+        *slot = s;
+}
+
+/**
+ * @brief Insert or replace with the shard locked exclusively, moving items
+ * to their other bucket (breadth-first) until one of the key's buckets has
+ * room. Held slots stay where they are; the path goes around them.
+ *
+ * @param ck Bucket array
+ * @param key Hashed key
+ * @param data Data
+ * @param bucket Filled in with the bucket, if the key's slot is held
+ * @param slot Filled in with the slot, if it is held
+ *
+ * @return 0 if replaced, 1 if inserted, 2 if the key's slot is held or -1 if
+ * no room could be made
+ */
+static int _coolhash_cuckoo_insert_excl(struct coolhash_cuckoo *ck,
+                coolhash_key_t key, void *data,
+                struct coolhash_cuckoo_bucket **bucket, int *slot)
+{
+        struct coolhash_cuckoo_bfs q[COOLHASH_CUCKOO_BFS_MAX];
+        struct coolhash_cuckoo_bucket *from, *to;
+        unsigned int b1, b2, alt, head, tail, k, tries;
+        int s, e, p, free_slot;
+
+        _coolhash_cuckoo_candidates(ck, key, &b1, &b2);
+
+        /* Someone may have inserted it while we waited for the lock */
+        to = &ck->buckets[b1];
+        if ((s = _coolhash_cuckoo_slot_find(to, key)) < 0) {
+                to = &ck->buckets[b2];
+                s = _coolhash_cuckoo_slot_find(to, key);
+        }
+        if (s >= 0) {
+                if (_coolhash_cuckoo_slot_trylock(to, s, 0) != 0) {
+                        *bucket = to;
+                        *slot = s;
+                        return 2;
+                }
+                __atomic_store_n(&to->data[s], data, __ATOMIC_RELEASE);
+                _coolhash_cuckoo_slot_release(to, s);
+                return 0;
+        }
+
+        for (tries = 0; tries < COOLHASH_CUCKOO_BFS_TRIES; tries++) {
+                q[0].bucket = b1;
+                q[0].parent = -1;
+                q[0].slot = -1;
+                q[1].bucket = b2;
+                q[1].parent = -1;
+                q[1].slot = -1;
+                head = 0;
+                tail = 2;
+                e = -1;
+                free_slot = -1;
+
+                while (head < tail) {
+                        free_slot = _coolhash_cuckoo_slot_free(
+                                        &ck->buckets[q[head].bucket]);
+                        if (free_slot >= 0) {
+                                e = (int) head;
+                                break;
+                        }
+
+                        from = &ck->buckets[q[head].bucket];
+                        for (s = 0; s < COOLHASH_CUCKOO_SLOTS &&
+                                        tail < COOLHASH_CUCKOO_BFS_MAX; s++) {
+                                if (__atomic_load_n(&from->locks[s],
+                                                        __ATOMIC_RELAXED))
+                                        continue; /* Held or being read */
+
+                                _coolhash_cuckoo_candidates(ck, from->keys[s],
+                                                &b1, &b2);
+                                alt = b1 == q[head].bucket ? b2 : b1;
+
+                                for (k = 0; k < tail && q[k].bucket != alt;
+                                                k++)
+                                        ;
+                                if (k < tail)
+                                        continue; /* Already queued */
+
+                                q[tail].bucket = alt;
+                                q[tail].parent = (int) head;
+                                q[tail].slot = s;
+                                tail++;
+                        }
+                        head++;
+                }
+
+                if (e < 0)
+                        return -1;
+
+                /* Walk the path back, moving each item into the hole ahead
+                 * of it. Items are copied before their old slot is cleared,
+                 * so readers always find them in at least one place. A slot
+                 * locked since the search ends the walk; the items moved so
+                 * far are where they belong, and the search starts over. */
+                while (q[e].parent >= 0) {
+                        p = q[e].parent;
+                        from = &ck->buckets[q[p].bucket];
+                        to = &ck->buckets[q[e].bucket];
+                        s = q[e].slot;
+
+                        if (_coolhash_cuckoo_slot_trylock(from, s, 0) != 0)
+                                break;
+
+                        _coolhash_cuckoo_bucket_lock(to);
+                        _coolhash_cuckoo_slot_put(to, free_slot,
+                                        from->keys[s], from->data[s]);
+                        _coolhash_cuckoo_bucket_unlock(to);
+
+                        _coolhash_cuckoo_bucket_lock(from);
+                        __atomic_store_n(&from->data[s], NULL,
+                                        __ATOMIC_RELAXED);
+                        _coolhash_cuckoo_bucket_unlock(from);
+                        _coolhash_cuckoo_slot_release(from, s);
+
+                        free_slot = s;
+                        e = p;
+                }
+                if (q[e].parent >= 0)
+                        continue;
+
+                to = &ck->buckets[q[e].bucket];
+                _coolhash_cuckoo_bucket_lock(to);
+                _coolhash_cuckoo_slot_put(to, free_slot, key, data);
+                _coolhash_cuckoo_bucket_unlock(to);
+
+                return 1;
+        }
+
+        return -1;
+}
+
+/**
+ * @brief Double a shard's bucket array - the shard must be locked
+ * exclusively. Items other threads hold are not waited for: their locks are
+ * handed over to the items' new slots, and holders find them there (see
+ * _coolhash_cuckoo_slot_follow). The old array is retired rather than freed,
+ * since lock-free readers and lock pointers may still point into it; its
+ * buckets are left locked and its slots retired, so readers retry on the new
+ * one.
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ *
+ * @return Non-zero error (no memory)
+ */
+static int _coolhash_cuckoo_grow(struct coolhash *ch,
+                struct coolhash_table *table)
+{
+        struct coolhash_cuckoo *ck, *old;
+        struct coolhash_cuckoo_bucket *b, *nb;
+        unsigned int i, b1, b2, nbuckets;
+        uint32_t v;
+        int s, ns;
+
+        old = table->cuckoo;
+        nbuckets = (old->mask + 1) * 2;
+
+retry:
+        ck = _coolhash_cuckoo_alloc(ch, nbuckets);
+        if (ck == NULL)
+                return -1;
+
+        for (i = 0; i <= old->mask; i++) {
+                for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                        if (old->buckets[i].data[s] == NULL)
+                                continue;
+
+                        if (_coolhash_cuckoo_insert_excl(ck,
+                                                old->buckets[i].keys[s],
+                                                old->buckets[i].data[s], &nb,
+                                                &ns) < 0) {
+                                _coolhash_mem_free(ch, ck, ck->len);
+                                nbuckets *= 2;
+                                goto retry;
+                        }
+                }
+        }
+
+        for (i = 0; i <= ck->mask; i++)
+                ck->buckets[i].version = 0;
+
+        /* Nothing but slot locks changes while the shard is locked
+         * exclusively. Retiring a slot and taking its holders along is one
+         * atomic step, so every lock taken on it either comes along or
+         * fails. */
+        for (i = 0; i <= old->mask; i++) {
+                b = &old->buckets[i];
+                for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                        if (b->data[s] == NULL) {
+                                __atomic_fetch_or(&b->locks[s],
+                                                COOLHASH_CUCKOO_RETIRED,
+                                                __ATOMIC_RELAXED);
+                                continue;
+                        }
+
+                        v = __atomic_fetch_or(&b->locks[s],
+                                        COOLHASH_CUCKOO_RETIRED |
+                                        COOLHASH_CUCKOO_MOVED,
+                                        __ATOMIC_ACQ_REL);
+                        if (!(v & ~COOLHASH_CUCKOO_WAITERS))
+                                continue;
+
+                        _coolhash_cuckoo_candidates(ck, b->keys[s], &b1, &b2);
+                        nb = &ck->buckets[b1];
+                        if ((ns = _coolhash_cuckoo_slot_find(nb,
+                                                        b->keys[s])) < 0) {
+                                nb = &ck->buckets[b2];
+                                ns = _coolhash_cuckoo_slot_find(nb,
+                                                b->keys[s]);
+                        }
+                        nb->locks[ns] = v & ~COOLHASH_CUCKOO_WAITERS;
+                }
+        }
+
+        ck->next = old;
+        __atomic_store_n(&table->cuckoo, ck, __ATOMIC_RELEASE);
+
+        for (i = 0; i <= old->mask; i++) {
+                b = &old->buckets[i];
+                _coolhash_cuckoo_bucket_lock(b);
+                for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                        if (__atomic_load_n(&b->locks[s], __ATOMIC_RELAXED) &
+                                        COOLHASH_CUCKOO_WAITERS)
+                                _coolhash_cuckoo_slot_wake(&b->locks[s]);
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Bucket a lock pointer (a pointer to a data slot) belongs to
+ *
+ * @param lock Lock pointer
+ *
+ * @return Bucket
+ */
+static struct coolhash_cuckoo_bucket *_coolhash_cuckoo_lock_bucket(
+                void *lock)
+{
+        return (struct coolhash_cuckoo_bucket *) ((uintptr_t) lock &
+                        ~((uintptr_t) sizeof(struct coolhash_cuckoo_bucket) -
+                          1));
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -3,6 +3,188 @@
 
 #include "coolhash.h"
 
+/* Static tracing probes (USDT, provider "coolhash"), compiled in when
+ * <sys/sdt.h> is around. A probe nobody is attached to is a single nop.
+ * Build with -DCOOLHASH_NO_PROBES to leave them out altogether. */
+#if !defined(COOLHASH_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define COOLHASH_PROBES 1
+#endif
+#endif
+
+#ifdef COOLHASH_PROBES
+#define COOLHASH_PROBE1(name, a) DTRACE_PROBE1(coolhash, name, a)
+#define COOLHASH_PROBE2(name, a, b) DTRACE_PROBE2(coolhash, name, a, b)
+#define COOLHASH_PROBE3(name, a, b, c) DTRACE_PROBE3(coolhash, name, a, b, c)
+#define COOLHASH_PROBE4(name, a, b, c, d) \
+        DTRACE_PROBE4(coolhash, name, a, b, c, d)
+#else
+#define COOLHASH_PROBE1(name, a) do { (void) (a); } while (0)
+#define COOLHASH_PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define COOLHASH_PROBE3(name, a, b, c) \
+        do { (void) (a); (void) (b); (void) (c); } while (0)
+#define COOLHASH_PROBE4(name, a, b, c, d) \
+        do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#endif
+
+/**
+ * @brief Mix a key so nearby keys end up far apart (murmur3 finalizer)
+ *
+ * @param key Hashed key
+ *
+ * @return Mixed hash
+ */
+static inline uint64_t _coolhash_mix(coolhash_key_t key)
+{
+        uint64_t h;
+
+        h = (uint64_t) key;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
+/* Internal table helpers shared between source files */
+void _coolhash_node_lock(struct coolhash_node *node, int ro);
+void _coolhash_node_unlock(struct coolhash_node *node);
+struct coolhash_node *_coolhash_node_alloc(struct coolhash *ch,
+                struct coolhash_table *table);
+void _coolhash_node_release(struct coolhash_table *table,
+                struct coolhash_node *node);
+void _coolhash_table_add(struct coolhash_table *table,
+                struct coolhash_node *node);
+void _coolhash_table_grow_shrink_calc(struct coolhash *ch,
+                struct coolhash_table *table);
+struct coolhash_table *_coolhash_table_find(struct coolhash *ch,
+                coolhash_key_t key);
+void _coolhash_table_lock(struct coolhash_table *table);
+void _coolhash_table_unlock(struct coolhash_table *table);
+int _coolhash_table_set(struct coolhash *ch, struct coolhash_table *table,
+                coolhash_key_t key, void *data);
+int _coolhash_table_set_at(struct coolhash *ch, struct coolhash_table *table,
+                coolhash_key_t key, struct coolhash_node *node, void *data);
+int _coolhash_table_get_copy(struct coolhash_table *table, coolhash_key_t key,
+                void *dst, size_t dst_len);
+int _coolhash_table_del(struct coolhash *ch, struct coolhash_table *table,
+                coolhash_key_t key);
+void _coolhash_table_del_node(struct coolhash *ch, struct coolhash_table *table,
+                struct coolhash_node *node);
+struct coolhash_node *_coolhash_table_node_find(struct coolhash_table *table,
+                coolhash_key_t key);
+int _coolhash_table_maintain(struct coolhash *ch, struct coolhash_table *table);
+
+/* Memory (mem.c) */
+#define COOLHASH_HUGEPAGE_SIZE (2 * 1024 * 1024) /**< Hugepage size */
+
+void *_coolhash_mem_alloc(struct coolhash *ch, size_t len);
+void _coolhash_mem_free(struct coolhash *ch, void *ptr, size_t len);
+size_t _coolhash_mem_size(struct coolhash *ch, size_t len);
+struct coolhash_node **_coolhash_buckets_alloc(struct coolhash *ch,
+                unsigned int size);
+void _coolhash_buckets_free(struct coolhash *ch, struct coolhash_node **nodes,
+                unsigned int size);
+struct coolhash_slab *_coolhash_slab_alloc(struct coolhash *ch,
+                unsigned int count);
+
+/* Bloom filter (bloom.c) */
+int _coolhash_bloom_maybe(struct coolhash_table *table, coolhash_key_t key);
+void _coolhash_bloom_add(struct coolhash_bloom *bloom, coolhash_key_t key);
+int _coolhash_bloom_rebuild(struct coolhash *ch, struct coolhash_table *table);
+void _coolhash_bloom_free(struct coolhash_table *table);
+
+/* Cuckoo engine (cuckoo.c) */
+int _coolhash_cuckoo_init(struct coolhash *ch, struct coolhash_table *table);
+void _coolhash_cuckoo_destroy(struct coolhash *ch,
+                struct coolhash_table *table, coolhash_free_foreach_func cb,
+                void *cb_arg);
+int _coolhash_cuckoo_set(struct coolhash *ch, coolhash_key_t key, void *data);
+int _coolhash_cuckoo_set_until(struct coolhash *ch, coolhash_key_t key,
+                void *data, const struct timespec *abstime);
+int _coolhash_cuckoo_get_until(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, int ro,
+                const struct timespec *abstime);
+int _coolhash_cuckoo_get_copy(struct coolhash *ch, coolhash_key_t key,
+                void *dst, size_t dst_len);
+void _coolhash_cuckoo_prefetch(struct coolhash *ch, coolhash_key_t key);
+int _coolhash_cuckoo_del_key(struct coolhash *ch, coolhash_key_t key);
+int _coolhash_cuckoo_del_until(struct coolhash *ch, void *lock,
+                const struct timespec *abstime);
+void _coolhash_cuckoo_unlock(struct coolhash *ch, void *lock);
+void _coolhash_cuckoo_foreach(struct coolhash *ch, coolhash_foreach_func cb,
+                void *cb_arg, int ro);
+void _coolhash_cuckoo_mem(struct coolhash *ch, struct coolhash_table *table,
+                struct coolhash_mem *mem);
+
+/* Small engine (small.c) */
+
+/**
+ * @brief Small engine entry by index
+ *
+ * @param small Small engine storage
+ * @param idx Entry index
+ *
+ * @return Entry
+ */
+static inline struct coolhash_small_entry *_coolhash_small_entry(
+                struct coolhash_small *small, uint32_t idx)
+{
+        return &small->chunks[idx / COOLHASH_SMALL_CHUNK]
+                [idx % COOLHASH_SMALL_CHUNK];
+}
+
+int _coolhash_small_init(struct coolhash *ch, struct coolhash_table *table);
+void _coolhash_small_destroy(struct coolhash *ch,
+                struct coolhash_table *table, coolhash_free_foreach_func cb,
+                void *cb_arg);
+int _coolhash_small_set_until(struct coolhash *ch, coolhash_key_t key,
+                void *data, const struct timespec *abstime);
+int _coolhash_small_get_until(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, int ro,
+                const struct timespec *abstime);
+int _coolhash_small_get_copy(struct coolhash *ch, coolhash_key_t key,
+                void *dst, size_t dst_len);
+int _coolhash_small_del_key(struct coolhash *ch, coolhash_key_t key);
+int _coolhash_small_del_until(struct coolhash *ch, void *lock,
+                const struct timespec *abstime);
+void _coolhash_small_unlock(void *lock);
+void _coolhash_small_foreach(struct coolhash *ch, coolhash_foreach_func cb,
+                void *cb_arg, int ro);
+int _coolhash_small_rehash(struct coolhash *ch, struct coolhash_table *table,
+                unsigned int nsize);
+void _coolhash_small_mem(struct coolhash *ch, struct coolhash_table *table,
+                struct coolhash_mem *mem);
+
+/* Ordered index (index.c) */
+int _coolhash_index_init(struct coolhash_table *table);
+void _coolhash_index_free(struct coolhash_table *table);
+int _coolhash_index_add(struct coolhash_table *table, coolhash_key_t key);
+void _coolhash_index_remove(struct coolhash_table *table, coolhash_key_t key);
+
+/* Snapshots (snapshot.c) */
+void _coolhash_snapshot_copy(struct coolhash_table *table);
+
+/* Flat combining (combine.c) */
+#define COOLHASH_FC_SET 1 /**< Publish a _coolhash_table_set */
+#define COOLHASH_FC_GET_COPY 2 /**< Publish a _coolhash_table_get_copy */
+
+int _coolhash_combine(struct coolhash *ch, struct coolhash_table *table,
+                int op, coolhash_key_t key, void *ptr, size_t len);
+
+/* Background maintenance (maint.c) */
+int _coolhash_maint_start(struct coolhash *ch);
+void _coolhash_maint_stop(struct coolhash *ch);
+void _coolhash_maint_signal(struct coolhash *ch, struct coolhash_table *table);
+
+/* Change log (changelog.c) */
+void _coolhash_changelog_append(struct coolhash *ch,
+                struct coolhash_table *table, int op, coolhash_key_t key,
+                void *data);
+
 #endif /* __LIBCOOLHASH_INC_H__ */
 
 /* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,265 @@
+#include <stdlib.h>
+
+#include "inc.h"
+
+static struct coolhash_index_node *_coolhash_index_seek(
+                struct coolhash_index *index, coolhash_key_t key,
+                struct coolhash_index_node ***prev);
+static unsigned int _coolhash_index_level(struct coolhash_index *index);
+static void _coolhash_range_foreach(struct coolhash *ch, coolhash_key_t lo,
+                coolhash_key_t hi, coolhash_foreach_func cb, void *cb_arg,
+                int ro);
+
+/**
+ * @brief Loop through every item with a key in [lo, hi]. Needs the ordered
+ * index (coolhash_profile_set_index); the cost is then proportional to the
+ * number of items visited (plus a skip list search per shard) rather than to
+ * the size of the table. Items come in key order within each shard, one
+ * shard after the other.
+ *
+ * @param ch coolhash instance
+ * @param lo Lowest key to visit
+ * @param hi Highest key to visit
+ * @param cb Callback function (required) - The callback function must pass
+ * the 'lock' parameter to coolhash_unlock before returning!
+ * @param cb_arg Callback function argument (optional)
+ *
+ * @return Non-zero error (the index is not enabled)
+ */
+int coolhash_range_foreach(struct coolhash *ch, coolhash_key_t lo,
+                coolhash_key_t hi, coolhash_foreach_func cb, void *cb_arg)
+{
+        if (ch == NULL || cb == NULL || !ch->profile.index)
+                return -1;
+
+        _coolhash_range_foreach(ch, lo, hi, cb, cb_arg, 0);
+        return 0;
+}
+
+/**
+ * @brief Loop through every item with a key in [lo, hi], read-only! See
+ * coolhash_range_foreach.
+ *
+ * @param ch coolhash instance
+ * @param lo Lowest key to visit
+ * @param hi Highest key to visit
+ * @param cb Callback function (required) - The callback function must pass
+ * the 'lock' parameter to coolhash_unlock before returning!
+ * @param cb_arg Callback function argument (optional)
+ *
+ * @return Non-zero error (the index is not enabled)
+ */
+int coolhash_range_foreach_ro(struct coolhash *ch, coolhash_key_t lo,
+                coolhash_key_t hi, coolhash_foreach_func cb, void *cb_arg)
+{
+        if (ch == NULL || cb == NULL || !ch->profile.index)
+                return -1;
+
+        _coolhash_range_foreach(ch, lo, hi, cb, cb_arg, 1);
+        return 0;
+}
+
+/**
+ * @brief Allocate an empty index for a table
+ *
+ * @param table Table
+ *
+ * @return Non-zero error (no memory)
+ */
+int _coolhash_index_init(struct coolhash_table *table)
+{
+        table->index = calloc(1, sizeof(*table->index));
+        if (table->index == NULL)
+                return -1;
+
+        table->index->level = 1;
+        table->index->rand = (uint64_t) (uintptr_t) table | 1;
+
+        return 0;
+}
+
+/**
+ * @brief Free a table's index
+ *
+ * @param table Table
+ */
+void _coolhash_index_free(struct coolhash_table *table)
+{
+        struct coolhash_index_node *x, *xn;
+
+        if (table->index == NULL)
+                return;
+
+        for (x = table->index->head[0]; x; x = xn) {
+                xn = x->next[0];
+                free(x);
+        }
+
+        free(table->index);
+        table->index = NULL;
+}
+
+/**
+ * @brief Add a key to a table's index, unless it is already there - the
+ * table must be locked
+ *
+ * @param table Table
+ * @param key Hashed key
+ *
+ * @return Non-zero error (no memory)
+ */
+int _coolhash_index_add(struct coolhash_table *table, coolhash_key_t key)
+{
+        struct coolhash_index *index;
+        struct coolhash_index_node *x, **prev[COOLHASH_INDEX_LEVELS];
+        unsigned int i, level;
+
+        index = table->index;
+
+        x = _coolhash_index_seek(index, key, prev);
+        if (x && x->key == key)
+                return 0;
+
+        level = _coolhash_index_level(index);
+        x = malloc(sizeof(*x) + level * sizeof(*x->next));
+        if (x == NULL)
+                return -1;
+
+        x->key = key;
+        x->level = level;
+        for (i = index->level; i < level; i++)
+                prev[i] = &index->head[i];
+        if (level > index->level)
+                index->level = level;
+
+        for (i = 0; i < level; i++) {
+                x->next[i] = *prev[i];
+                *prev[i] = x;
+        }
+
+        index->n++;
+        index->bytes += sizeof(*x) + level * sizeof(*x->next);
+
+        return 0;
+}
+
+/**
+ * @brief Remove a key from a table's index - the table must be locked
+ *
+ * @param table Table
+ * @param key Hashed key
+ */
+void _coolhash_index_remove(struct coolhash_table *table, coolhash_key_t key)
+{
+        struct coolhash_index *index;
+        struct coolhash_index_node *x, **prev[COOLHASH_INDEX_LEVELS];
+        unsigned int i;
+
+        index = table->index;
+
+        x = _coolhash_index_seek(index, key, prev);
+        if (x == NULL || x->key != key)
+                return;
+
+        for (i = 0; i < x->level; i++)
+                *prev[i] = x->next[i];
+        while (index->level > 1 && index->head[index->level - 1] == NULL)
+                index->level--;
+
+        index->n--;
+        index->bytes -= sizeof(*x) + x->level * sizeof(*x->next);
+        free(x);
+}
+
+/**
+ * @brief Find the first index entry with a key of at least 'key'
+ *
+ * @param index Index
+ * @param key Hashed key
+ * @param prev Filled in with the link to update at each level to insert
+ * before the returned entry (optional)
+ *
+ * @return Entry or NULL if every key is smaller
+ */
+static struct coolhash_index_node *_coolhash_index_seek(
+                struct coolhash_index *index, coolhash_key_t key,
+                struct coolhash_index_node ***prev)
+{
+        struct coolhash_index_node **link;
+        unsigned int i;
+
+        link = index->head;
+        for (i = index->level; i > 0; i--) {
+                while (link[i - 1] && link[i - 1]->key < key)
+                        link = link[i - 1]->next;
+                if (prev)
+                        prev[i - 1] = &link[i - 1];
+        }
+
+        return link[0];
+}
+
+/**
+ * @brief Pick the level of a new index entry; each level up is a quarter as
+ * likely as the one below
+ *
+ * @param index Index
+ *
+ * @return Level, 1 to COOLHASH_INDEX_LEVELS
+ */
+static unsigned int _coolhash_index_level(struct coolhash_index *index)
+{
+        unsigned int level;
+        uint64_t r;
+
+        /* xorshift64 */
+        r = index->rand;
+        r ^= r << 13;
+        r ^= r >> 7;
+        r ^= r << 17;
+        index->rand = r;
+
+        for (level = 1; level < COOLHASH_INDEX_LEVELS && (r & 3) == 0;
+                        level++)
+                r >>= 2;
+
+        return level;
+}
+
+/**
+ * @brief Shared part of coolhash_range_foreach and coolhash_range_foreach_ro
+ *
+ * @param ch coolhash instance
+ * @param lo Lowest key to visit
+ * @param hi Highest key to visit
+ * @param cb Callback function
+ * @param cb_arg Callback function argument
+ * @param ro Boolean, readonly?
+ */
+static void _coolhash_range_foreach(struct coolhash *ch, coolhash_key_t lo,
+                coolhash_key_t hi, coolhash_foreach_func cb, void *cb_arg,
+                int ro)
+{
+        struct coolhash_table *table;
+        struct coolhash_index_node *x;
+        struct coolhash_node *n;
+        unsigned int i;
+
+        for (i = 0; i < ch->profile.shards; i++) {
+                table = &ch->tables[i];
+
+                _coolhash_table_lock(table);
+                x = _coolhash_index_seek(table->index, lo, NULL);
+                for (; x && x->key <= hi; x = x->next[0]) {
+                        /* Only live keys are indexed */
+                        n = _coolhash_table_node_find(table, x->key);
+                        _coolhash_node_lock(n, ro);
+
+                        cb(ch, n->key, n->data, n, cb_arg);
+                        /* The callback needs to unlock the node. */
+                }
+                _coolhash_table_unlock(table);
+        }
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
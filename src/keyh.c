@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "inc.h"
+
+static struct coolhash_node *_coolhash_keyh_node(struct coolhash_keyh *kh);
+static struct coolhash_node *_coolhash_keyh_find(struct coolhash *ch,
+                struct coolhash_keyh *kh, int ro);
+
+/**
+ * @brief Initialize a key handle. A handle remembers which shard a key
+ * belongs to and, once a lookup has been made through it, which bucket and
+ * node the key has, for as long as the shard is not rehashed or compacted.
+ * A get followed by a set or a del through the same handle then skips the
+ * shard and bucket computation and the chain walk. Handles are not shared
+ * between threads; make one per key per request and throw it away.
+ *
+ * With engines other than COOLHASH_ENGINE_CHAIN the handle only remembers
+ * the key and every call is passed on to the plain API.
+ *
+ * @param ch coolhash instance
+ * @param kh Key handle to initialize
+ * @param key Hashed key
+ */
+void coolhash_keyh_init(struct coolhash *ch, struct coolhash_keyh *kh,
+                coolhash_key_t key)
+{
+        kh->key = key;
+        kh->table = _coolhash_table_find(ch, key);
+        kh->gen = UINT64_MAX; /* Nothing cached yet */
+        kh->bucket = 0;
+        kh->node = NULL;
+}
+
+/**
+ * @brief Add/replace item through a key handle
+ *
+ * @param ch coolhash instance
+ * @param kh Key handle
+ * @param data Pointer to your data
+ *
+ * @return Non-zero error (likely no memory)
+ */
+int coolhash_keyh_set(struct coolhash *ch, struct coolhash_keyh *kh,
+                void *data)
+{
+        int res;
+
+        if (ch == NULL || kh == NULL || data == NULL)
+                return -1;
+
+        if (ch->profile.engine != COOLHASH_ENGINE_CHAIN)
+                return coolhash_set(ch, kh->key, data);
+
+        _coolhash_table_lock(kh->table);
+        res = _coolhash_table_set_at(ch, kh->table, kh->key,
+                        _coolhash_keyh_node(kh), data);
+        _coolhash_table_unlock(kh->table);
+
+        return res;
+}
+
+/**
+ * @brief Retrieve item through a key handle
+ *
+ * @param ch coolhash instance
+ * @param kh Key handle
+ * @param lock Pointer to void pointer; you must pass this to coolhash_unlock
+ * or coolhash_keyh_del when you are done with the returned item
+ *
+ * @return Pointer to data or NULL if item not found
+ */
+void *coolhash_keyh_get(struct coolhash *ch, struct coolhash_keyh *kh,
+                void **lock)
+{
+        struct coolhash_node *node;
+
+        if (ch == NULL || kh == NULL || lock == NULL)
+                return NULL;
+
+        if (ch->profile.engine != COOLHASH_ENGINE_CHAIN)
+                return coolhash_get(ch, kh->key, lock);
+
+        node = _coolhash_keyh_find(ch, kh, 0);
+        if (node == NULL)
+                return NULL;
+
+        *lock = node;
+        return node->data;
+}
+
+/**
+ * @brief Retrieve item through a key handle, read-only
+ *
+ * @param ch coolhash instance
+ * @param kh Key handle
+ * @param lock Pointer to void pointer; you must pass this to coolhash_unlock
+ * when you are done with the returned item
+ *
+ * @return Pointer to data or NULL if item not found
+ */
+void *coolhash_keyh_get_ro(struct coolhash *ch, struct coolhash_keyh *kh,
+                void **lock)
+{
+        struct coolhash_node *node;
+
+        if (ch == NULL || kh == NULL || lock == NULL)
+                return NULL;
+
+        if (ch->profile.engine != COOLHASH_ENGINE_CHAIN)
+                return coolhash_get_ro(ch, kh->key, lock);
+
+        node = _coolhash_keyh_find(ch, kh, 1);
+        if (node == NULL)
+                return NULL;
+
+        *lock = node;
+        return node->data;
+}
+
+/**
+ * @brief Retrieve item through a key handle and copy data into destination
+ * buffer
+ *
+ * @param ch coolhash instance
+ * @param kh Key handle
+ * @param dst Destination buffer
+ * @param dst_len Buffer length
+ *
+ * @return Non-zero failure (item not found)
+ */
+int coolhash_keyh_get_copy(struct coolhash *ch, struct coolhash_keyh *kh,
+                void *dst, size_t dst_len)
+{
+        struct coolhash_node *node;
+
+        if (ch == NULL || kh == NULL || dst == NULL || dst_len <= 0)
+                return -1;
+
+        if (ch->profile.engine != COOLHASH_ENGINE_CHAIN)
+                return coolhash_get_copy(ch, kh->key, dst, dst_len);
+
+        node = _coolhash_keyh_find(ch, kh, 1);
+        if (node == NULL)
+                return -1;
+
+        memcpy(dst, node->data, dst_len);
+        _coolhash_node_unlock(node);
+
+        return 0;
+}
+
+/**
+ * @brief Delete an item you got from coolhash_keyh_get
+ *
+ * @param ch coolhash instance
+ * @param kh Key handle the item was retrieved through
+ * @param lock Pointer you got from coolhash_keyh_get
+ */
+void coolhash_keyh_del(struct coolhash *ch, struct coolhash_keyh *kh,
+                void *lock)
+{
+        if (lock == NULL)
+                return;
+
+        if (ch->profile.engine != COOLHASH_ENGINE_CHAIN) {
+                coolhash_del(ch, lock);
+                return;
+        }
+
+        _coolhash_table_lock(kh->table);
+        _coolhash_table_del_node(ch, kh->table, lock);
+        _coolhash_table_unlock(kh->table);
+}
+
+/**
+ * @brief The key's node (tombstones included), from the handle if the table
+ * has not changed shape since it was cached - the table must be locked
+ *
+ * @param kh Key handle
+ *
+ * @return Node or NULL if the key has none
+ */
+static struct coolhash_node *_coolhash_keyh_node(struct coolhash_keyh *kh)
+{
+        struct coolhash_table *table;
+        struct coolhash_node *node;
+        unsigned int len;
+
+        table = kh->table;
+
+        if (kh->gen != table->gen) {
+                kh->gen = table->gen;
+                kh->bucket = (unsigned int) (kh->key % table->size);
+                kh->node = NULL;
+        }
+
+        /* Nodes are only ever freed by a rehash or compaction, so a cached
+         * node is still the key's node. A missing one may have been added
+         * since, though. */
+        if (kh->node)
+                return kh->node;
+
+        len = 0;
+        node = table->nodes[kh->bucket];
+        for (; node && node->key != kh->key; node = node->next)
+                len++;
+
+        COOLHASH_PROBE3(chain_walk, table, kh->key, len);
+
+        kh->node = node;
+        return node;
+}
+
+/**
+ * @brief Find and lock a live node through a key handle
+ *
+ * @param ch coolhash instance
+ * @param kh Key handle
+ * @param ro Boolean, readonly?
+ *
+ * @return Locked node or NULL if the key has no live node
+ */
+static struct coolhash_node *_coolhash_keyh_find(struct coolhash *ch,
+                struct coolhash_keyh *kh, int ro)
+{
+        struct coolhash_node *node;
+
+        /* Known-absent keys never touch the table lock */
+        if (kh->node == NULL && ch->profile.bloom_bits &&
+                        !_coolhash_bloom_maybe(kh->table, kh->key))
+                return NULL;
+
+        _coolhash_table_lock(kh->table);
+        node = _coolhash_keyh_node(kh);
+        if (node)
+                _coolhash_node_lock(node, ro);
+        _coolhash_table_unlock(kh->table);
+
+        if (node && node->del) {
+                _coolhash_node_unlock(node);
+                return NULL;
+        }
+
+        return node;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
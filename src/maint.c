@@ -0,0 +1,121 @@
+#include <malloc.h>
+
+#include "inc.h"
+
+static void *_coolhash_maint_run(void *arg);
+
+/**
+ * @brief Start the maintenance thread
+ *
+ * @param ch coolhash instance
+ *
+ * @return Non-zero error
+ */
+int _coolhash_maint_start(struct coolhash *ch)
+{
+        ch->maint_pending = 0;
+        ch->maint_stop = 0;
+
+        if (pthread_mutex_init(&ch->maint_mx, NULL) != 0)
+                return -1;
+        if (pthread_cond_init(&ch->maint_cond, NULL) != 0) {
+                pthread_mutex_destroy(&ch->maint_mx);
+                return -1;
+        }
+        if (pthread_create(&ch->maint_thread, NULL, _coolhash_maint_run,
+                                ch) != 0) {
+                pthread_cond_destroy(&ch->maint_cond);
+                pthread_mutex_destroy(&ch->maint_mx);
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Stop the maintenance thread and wait for it to exit
+ *
+ * @param ch coolhash instance
+ */
+void _coolhash_maint_stop(struct coolhash *ch)
+{
+        pthread_mutex_lock(&ch->maint_mx);
+        ch->maint_stop = 1;
+        pthread_cond_signal(&ch->maint_cond);
+        pthread_mutex_unlock(&ch->maint_mx);
+
+        pthread_join(ch->maint_thread, NULL);
+
+        pthread_cond_destroy(&ch->maint_cond);
+        pthread_mutex_destroy(&ch->maint_mx);
+}
+
+/**
+ * @brief Ask the maintenance thread to look at a table. Only the first
+ * request for a table wakes the thread up; the rest are free.
+ *
+ * @param ch coolhash instance
+ * @param table Table that crossed a threshold
+ */
+void _coolhash_maint_signal(struct coolhash *ch, struct coolhash_table *table)
+{
+        if (__atomic_exchange_n(&table->maint, 1, __ATOMIC_ACQ_REL))
+                return;
+
+        pthread_mutex_lock(&ch->maint_mx);
+        ch->maint_pending = 1;
+        pthread_cond_signal(&ch->maint_cond);
+        pthread_mutex_unlock(&ch->maint_mx);
+}
+
+/**
+ * @brief Maintenance thread: rehash every flagged table, then hand freed
+ * memory back to the OS
+ *
+ * @param arg coolhash instance
+ *
+ * @return NULL
+ */
+static void *_coolhash_maint_run(void *arg)
+{
+        struct coolhash *ch;
+        struct coolhash_table *table;
+        unsigned int i;
+        int released;
+
+        ch = arg;
+
+        pthread_mutex_lock(&ch->maint_mx);
+        for (;;) {
+                while (!ch->maint_pending && !ch->maint_stop)
+                        pthread_cond_wait(&ch->maint_cond, &ch->maint_mx);
+                if (ch->maint_stop)
+                        break;
+                ch->maint_pending = 0;
+                pthread_mutex_unlock(&ch->maint_mx);
+
+                released = 0;
+                for (i = 0; i < ch->profile.shards; i++) {
+                        table = &ch->tables[i];
+                        if (!__atomic_exchange_n(&table->maint, 0,
+                                                __ATOMIC_ACQ_REL))
+                                continue;
+
+                        _coolhash_table_lock(table);
+                        released |= _coolhash_table_maintain(ch, table);
+                        _coolhash_table_unlock(table);
+                }
+
+#ifdef __GLIBC__
+                if (released)
+                        malloc_trim(0);
+#endif
+
+                pthread_mutex_lock(&ch->maint_mx);
+        }
+        pthread_mutex_unlock(&ch->maint_mx);
+
+        return NULL;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
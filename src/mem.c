@@ -0,0 +1,372 @@
+#include <malloc.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "inc.h"
+
+static unsigned int _coolhash_compact_size(struct coolhash *ch,
+                struct coolhash_table *table);
+static size_t _coolhash_hugepage_round(size_t len);
+
+/**
+ * @brief Report the memory used by a shard. Allocator overhead is not
+ * included, everything else is. Hugepage-backed bucket arrays are counted at
+ * their mapped, rounded-up size; the unused part of hugepage-backed slabs is
+ * slack.
+ *
+ * @param ch coolhash instance
+ * @param shard Shard number
+ * @param mem Filled in with byte counts
+ *
+ * @return Non-zero error
+ */
+int coolhash_mem(struct coolhash *ch, unsigned int shard,
+                struct coolhash_mem *mem)
+{
+        struct coolhash_table *table;
+        struct coolhash_slab *slab;
+        struct coolhash_node *node;
+        struct coolhash_bloom *bloom;
+        size_t node_size, lock_size;
+
+        if (ch == NULL || shard >= ch->profile.shards || mem == NULL)
+                return -1;
+
+        table = &ch->tables[shard];
+
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                _coolhash_cuckoo_mem(ch, table, mem);
+                return 0;
+        }
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                _coolhash_small_mem(ch, table, mem);
+                return 0;
+        }
+
+        lock_size = sizeof(node->node_mx);
+        node_size = sizeof(*node) - lock_size;
+
+        _coolhash_table_lock(table);
+
+        mem->buckets = _coolhash_mem_size(ch, (size_t) table->size *
+                        sizeof(*table->nodes));
+        mem->nodes = (size_t) table->n * node_size;
+        mem->locks = sizeof(table->table_mx) + (size_t) table->n * lock_size;
+        mem->tombstones = (size_t) table->tombs * sizeof(*node);
+
+        mem->slack = 0;
+        for (slab = table->slabs; slab; slab = slab->next)
+                mem->slack += _coolhash_mem_size(ch, slab->len) -
+                        (size_t) slab->used * sizeof(*node);
+        for (node = table->free_nodes; node; node = node->next)
+                mem->slack += sizeof(*node);
+
+        mem->extra = (size_t) table->fc_nslots * sizeof(*table->fc_slots) +
+                (size_t) (table->log ? ch->profile.changelog : 0) *
+                sizeof(*table->log);
+        for (bloom = table->bloom; bloom; bloom = bloom->next)
+                mem->extra += sizeof(*bloom) + (size_t) bloom->nwords *
+                        sizeof(*bloom->words);
+        if (table->index)
+                mem->extra += sizeof(*table->index) + table->index->bytes;
+
+        _coolhash_table_unlock(table);
+
+        mem->total = mem->buckets + mem->nodes + mem->locks +
+                mem->tombstones + mem->slack + mem->extra;
+
+        return 0;
+}
+
+/**
+ * @brief Compact a shard: shrink its bucket array to fit, drop tombstones
+ * (and their Bloom filter bits) and move every live node into one contiguous
+ * slab, then hand freed memory back to the OS. Only this shard is locked
+ * while it runs, so compacting a big table one shard at a time keeps the rest
+ * of it available. This is a no-op for COOLHASH_ENGINE_CUCKOO; in particular
+ * it does not free the bucket arrays a shard outgrew (see
+ * coolhash_profile_set_engine).
+ *
+ * @param ch coolhash instance
+ * @param shard Shard number
+ *
+ * @return Non-zero error (likely no memory; the shard is left untouched)
+ */
+int coolhash_compact(struct coolhash *ch, unsigned int shard)
+{
+        struct coolhash_table *table;
+        struct coolhash_slab *slab, *slabn, *oldslabs;
+        struct coolhash_node *node, *noden, *nnode, **nodes, **oldnodes;
+        unsigned int i, nsize, oldsize;
+        int res;
+
+        if (ch == NULL || shard >= ch->profile.shards)
+                return -1;
+
+        /* Cuckoo buckets have no tombstones or node storage to compact, and
+         * the arrays a shard outgrew stay until coolhash_free */
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return 0;
+
+        table = &ch->tables[shard];
+
+        _coolhash_table_lock(table);
+
+        nsize = _coolhash_compact_size(ch, table);
+
+        /* Small engine entries are freed as they are deleted and cannot be
+         * moved while 'get' callers may hold them; only the buckets shrink */
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                res = _coolhash_small_rehash(ch, table, nsize);
+                _coolhash_table_unlock(table);
+                return res;
+        }
+        nodes = _coolhash_buckets_alloc(ch, nsize);
+        slab = NULL;
+        if (table->n > 0)
+                slab = _coolhash_slab_alloc(ch, table->n);
+        if (nodes == NULL || (table->n > 0 && slab == NULL)) {
+                if (nodes)
+                        _coolhash_buckets_free(ch, nodes, nsize);
+                if (slab)
+                        _coolhash_mem_free(ch, slab, slab->len);
+                _coolhash_table_unlock(table);
+                return -1;
+        }
+
+        oldnodes = table->nodes;
+        oldsize = table->size;
+        oldslabs = table->slabs;
+
+        table->nodes = nodes;
+        table->size = nsize;
+        table->slabs = slab;
+        table->free_nodes = NULL;
+        _coolhash_table_grow_shrink_calc(ch, table);
+
+        for (i = 0; i < oldsize; i++) {
+                for (node = oldnodes[i]; node; node = noden) {
+                        noden = node->next;
+
+                        /* Wait for the last reference to go away */
+                        _coolhash_node_lock(node, 0);
+                        _coolhash_node_unlock(node);
+
+                        if (!node->del) {
+                                nnode = &slab->nodes[slab->used];
+                                if (pthread_rwlock_init(&nnode->node_mx,
+                                                        NULL) == 0) {
+                                        slab->used++;
+                                        nnode->key = node->key;
+                                        nnode->del = 0;
+                                        nnode->slab = 1;
+                                        nnode->data = node->data;
+                                        _coolhash_table_add(table, nnode);
+                                } else {
+                                        /* Keep the old node where it is */
+                                        _coolhash_table_add(table, node);
+                                        continue;
+                                }
+                        }
+
+                        pthread_rwlock_destroy(&node->node_mx);
+                        if (!node->slab)
+                                free(node);
+                }
+        }
+
+        table->tombs = 0;
+        table->gen++;
+        _coolhash_buckets_free(ch, oldnodes, oldsize);
+
+        if (table->bloom)
+                _coolhash_bloom_rebuild(ch, table);
+
+        /* Nodes that could not be moved still live in their old slab */
+        for (; oldslabs; oldslabs = slabn) {
+                slabn = oldslabs->next;
+                if (slab && slab->used < slab->count) {
+                        oldslabs->next = table->slabs;
+                        table->slabs = oldslabs;
+                        oldslabs->used = oldslabs->count;
+                        continue;
+                }
+                _coolhash_mem_free(ch, oldslabs, oldslabs->len);
+        }
+
+        _coolhash_table_unlock(table);
+
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+
+        return 0;
+}
+
+/**
+ * @brief Smallest bucket array size that holds the table's live nodes
+ * without crossing the grow threshold
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ *
+ * @return Size
+ */
+static unsigned int _coolhash_compact_size(struct coolhash *ch,
+                struct coolhash_table *table)
+{
+        uint64_t size;
+
+        size = ((uint64_t) table->n * 100 + ch->profile.load_factor - 1) /
+                ch->profile.load_factor;
+        while (size * ch->profile.load_factor / 100 < table->n)
+                size++;
+        if (size < 1)
+                size = 1;
+
+        return (unsigned int) size;
+}
+
+/**
+ * @brief Allocate zeroed memory. With hugepages enabled, allocations of half
+ * a hugepage or more are rounded up and mapped from hugepages: MAP_HUGETLB if
+ * the system has some reserved, transparent hugepages otherwise.
+ *
+ * @param ch coolhash instance
+ * @param len Length in bytes
+ *
+ * @return Memory or NULL on failure
+ */
+void *_coolhash_mem_alloc(struct coolhash *ch, size_t len)
+{
+        void *ptr;
+
+        if (!ch->profile.hugepages || len < COOLHASH_HUGEPAGE_SIZE / 2)
+                return calloc(1, len);
+
+        len = _coolhash_hugepage_round(len);
+
+#ifdef MAP_HUGETLB
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED)
+                return ptr;
+#endif
+
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+                return NULL;
+
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+
+        return ptr;
+}
+
+/**
+ * @brief Free memory from _coolhash_mem_alloc
+ *
+ * @param ch coolhash instance
+ * @param ptr Memory
+ * @param len Length in bytes, as passed to _coolhash_mem_alloc
+ */
+void _coolhash_mem_free(struct coolhash *ch, void *ptr, size_t len)
+{
+        if (ptr == NULL)
+                return;
+
+        if (!ch->profile.hugepages || len < COOLHASH_HUGEPAGE_SIZE / 2)
+                free(ptr);
+        else
+                munmap(ptr, _coolhash_hugepage_round(len));
+}
+
+/**
+ * @brief Bytes an allocation from _coolhash_mem_alloc really takes up
+ *
+ * @param ch coolhash instance
+ * @param len Length in bytes, as passed to _coolhash_mem_alloc
+ *
+ * @return Length, rounded up to whole hugepages if it was mapped from them
+ */
+size_t _coolhash_mem_size(struct coolhash *ch, size_t len)
+{
+        if (!ch->profile.hugepages || len < COOLHASH_HUGEPAGE_SIZE / 2)
+                return len;
+
+        return _coolhash_hugepage_round(len);
+}
+
+/**
+ * @brief Allocate a bucket array
+ *
+ * @param ch coolhash instance
+ * @param size Number of buckets
+ *
+ * @return Zeroed bucket array or NULL on failure
+ */
+struct coolhash_node **_coolhash_buckets_alloc(struct coolhash *ch,
+                unsigned int size)
+{
+        return _coolhash_mem_alloc(ch, (size_t) size *
+                        sizeof(struct coolhash_node *));
+}
+
+/**
+ * @brief Free a bucket array
+ *
+ * @param ch coolhash instance
+ * @param nodes Bucket array
+ * @param size Number of buckets
+ */
+void _coolhash_buckets_free(struct coolhash *ch, struct coolhash_node **nodes,
+                unsigned int size)
+{
+        _coolhash_mem_free(ch, nodes, (size_t) size *
+                        sizeof(struct coolhash_node *));
+}
+
+/**
+ * @brief Allocate an empty node slab
+ *
+ * @param ch coolhash instance
+ * @param count Number of nodes
+ *
+ * @return Slab or NULL on failure
+ */
+struct coolhash_slab *_coolhash_slab_alloc(struct coolhash *ch,
+                unsigned int count)
+{
+        struct coolhash_slab *slab;
+        size_t len;
+
+        len = sizeof(*slab) + (size_t) count * sizeof(*slab->nodes);
+
+        slab = _coolhash_mem_alloc(ch, len);
+        if (slab == NULL)
+                return NULL;
+
+        slab->next = NULL;
+        slab->len = len;
+        slab->count = count;
+        slab->used = 0;
+
+        return slab;
+}
+
+/**
+ * @brief Round a length up to a multiple of the hugepage size
+ *
+ * @param len Length in bytes
+ *
+ * @return Rounded length
+ */
+static size_t _coolhash_hugepage_round(size_t len)
+{
+        return (len + COOLHASH_HUGEPAGE_SIZE - 1) &
+                ~((size_t) COOLHASH_HUGEPAGE_SIZE - 1);
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,765 @@
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "inc.h"
+
+#define COOLHASH_SMALL_SPINS 64 /**< Spins before going to sleep */
+#define COOLHASH_SMALL_KEY_MAX UINT32_MAX /**< Largest key the engine takes */
+
+static int _coolhash_small_table_lock_until(struct coolhash_table *table,
+                const struct timespec *abstime);
+static int _coolhash_small_find_lock(struct coolhash_table *table,
+                uint32_t key, int ro, const struct timespec *abstime,
+                struct coolhash_small_entry **entry);
+static int _coolhash_small_trylock(struct coolhash_small_entry *e, int ro);
+static int _coolhash_small_wait(struct coolhash_small_entry *e, int ro,
+                const struct timespec *abstime);
+static void _coolhash_small_park(struct coolhash_small_entry *e, uint32_t v,
+                const struct timespec *abstime);
+static void _coolhash_small_release(struct coolhash_small_entry *e);
+static void _coolhash_small_wake(struct coolhash_small_entry *e);
+static uint32_t _coolhash_small_alloc(struct coolhash *ch,
+                struct coolhash_small *small);
+static void _coolhash_small_remove(struct coolhash *ch,
+                struct coolhash_table *table, struct coolhash_small_entry *e);
+
+/**
+ * @brief Set up a table shard for the small engine
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ *
+ * @return Non-zero error (likely no memory)
+ */
+int _coolhash_small_init(struct coolhash *ch, struct coolhash_table *table)
+{
+        table->size = ch->profile.size / ch->profile.shards;
+        _coolhash_table_grow_shrink_calc(ch, table);
+
+        table->small = calloc(1, sizeof(*table->small));
+        if (table->small == NULL)
+                return -1;
+
+        table->small->buckets = _coolhash_mem_alloc(ch, (size_t) table->size *
+                        sizeof(*table->small->buckets));
+        if (table->small->buckets == NULL) {
+                free(table->small);
+                table->small = NULL;
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Free a small engine table shard, calling a callback for each item
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ * @param cb Callback (optional)
+ * @param cb_arg Callback argument (optional)
+ */
+void _coolhash_small_destroy(struct coolhash *ch,
+                struct coolhash_table *table, coolhash_free_foreach_func cb,
+                void *cb_arg)
+{
+        struct coolhash_small *small;
+        struct coolhash_small_entry *e;
+        uint32_t idx;
+        unsigned int i;
+
+        small = table->small;
+        if (small == NULL)
+                return;
+
+        if (cb) {
+                for (idx = 1; idx < small->used; idx++) {
+                        e = _coolhash_small_entry(small, idx);
+                        if (e->data)
+                                cb(e->data, cb_arg);
+                }
+        }
+
+        for (i = 0; i < small->nchunks; i++)
+                _coolhash_mem_free(ch, small->chunks[i], COOLHASH_SMALL_CHUNK *
+                                sizeof(**small->chunks));
+        free(small->chunks);
+        _coolhash_mem_free(ch, small->buckets, (size_t) table->size *
+                        sizeof(*small->buckets));
+        free(small);
+        table->small = NULL;
+}
+
+/**
+ * @brief Add/replace item, giving up on any lock not acquired by a deadline
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key, at most UINT32_MAX
+ * @param data Pointer to your data
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero, -1 on error (key too big or no memory) or -ETIMEDOUT
+ */
+int _coolhash_small_set_until(struct coolhash *ch, coolhash_key_t key,
+                void *data, const struct timespec *abstime)
+{
+        struct coolhash_table *table;
+        struct coolhash_small *small;
+        struct coolhash_small_entry *e;
+        uint32_t idx, *bucket;
+        int res;
+
+        if (key > COOLHASH_SMALL_KEY_MAX)
+                return -1;
+
+        table = _coolhash_table_find(ch, key);
+
+        if ((res = _coolhash_small_table_lock_until(table, abstime)) != 0)
+                return res;
+        if ((res = _coolhash_small_find_lock(table, (uint32_t) key, 0,
+                                        abstime, &e)) != 0)
+                return res;
+
+        if (e) {
+                e->data = data;
+                _coolhash_small_unlock(e);
+                _coolhash_table_unlock(table);
+                return 0;
+        }
+
+        small = table->small;
+        idx = _coolhash_small_alloc(ch, small);
+        if (idx == 0) {
+                _coolhash_table_unlock(table);
+                return -1;
+        }
+
+        e = _coolhash_small_entry(small, idx);
+        e->key = (uint32_t) key;
+        e->data = data;
+
+        bucket = &small->buckets[e->key % table->size];
+        e->next = *bucket;
+        *bucket = idx;
+        table->n++;
+
+        /* A failed grow leaves the table as it is, just fuller */
+        if (table->n > table->grow_at)
+                _coolhash_small_rehash(ch, table, table->size * 2);
+
+        _coolhash_table_unlock(table);
+
+        return 0;
+}
+
+/**
+ * @brief Retrieve item, giving up on any lock not acquired by a deadline.
+ * The item stays locked until coolhash_unlock or coolhash_del is called with
+ * the returned lock.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Filled in with the data pointer
+ * @param lock Filled in with the lock pointer
+ * @param ro Boolean, readonly?
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero, -1 if not found or -ETIMEDOUT
+ */
+int _coolhash_small_get_until(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, int ro,
+                const struct timespec *abstime)
+{
+        struct coolhash_table *table;
+        struct coolhash_small_entry *e;
+        int res;
+
+        if (key > COOLHASH_SMALL_KEY_MAX)
+                return -1;
+
+        table = _coolhash_table_find(ch, key);
+
+        if ((res = _coolhash_small_table_lock_until(table, abstime)) != 0)
+                return res;
+        if ((res = _coolhash_small_find_lock(table, (uint32_t) key, ro,
+                                        abstime, &e)) != 0)
+                return res;
+        _coolhash_table_unlock(table);
+
+        if (e == NULL)
+                return -1;
+
+        *data = e->data;
+        *lock = e;
+        return 0;
+}
+
+/**
+ * @brief Retrieve item and copy data into destination buffer
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param dst Destination buffer
+ * @param dst_len Buffer length
+ *
+ * @return Non-zero failure (item not found)
+ */
+int _coolhash_small_get_copy(struct coolhash *ch, coolhash_key_t key,
+                void *dst, size_t dst_len)
+{
+        void *data, *lock;
+
+        if (_coolhash_small_get_until(ch, key, &data, &lock, 1, NULL) != 0)
+                return -1;
+
+        memcpy(dst, data, dst_len);
+        _coolhash_small_unlock(lock);
+
+        return 0;
+}
+
+/**
+ * @brief Delete item by key
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ *
+ * @return Non-zero failure (item not found)
+ */
+int _coolhash_small_del_key(struct coolhash *ch, coolhash_key_t key)
+{
+        struct coolhash_table *table;
+        struct coolhash_small_entry *e;
+
+        if (key > COOLHASH_SMALL_KEY_MAX)
+                return -1;
+
+        table = _coolhash_table_find(ch, key);
+
+        _coolhash_table_lock(table);
+        _coolhash_small_find_lock(table, (uint32_t) key, 0, NULL, &e);
+        if (e)
+                _coolhash_small_remove(ch, table, e);
+        _coolhash_table_unlock(table);
+
+        return e ? 0 : -1;
+}
+
+/**
+ * @brief Delete the item a lock from a 'get' points to, giving up on the
+ * shard lock at a deadline. On -ETIMEDOUT the item is still held.
+ *
+ * @param ch coolhash instance
+ * @param lock Lock pointer
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+int _coolhash_small_del_until(struct coolhash *ch, void *lock,
+                const struct timespec *abstime)
+{
+        struct coolhash_table *table;
+        struct coolhash_small_entry *e;
+        int res;
+
+        e = lock;
+        table = _coolhash_table_find(ch, e->key);
+
+        if ((res = _coolhash_small_table_lock_until(table, abstime)) != 0)
+                return res;
+        _coolhash_small_remove(ch, table, e);
+        _coolhash_table_unlock(table);
+
+        return 0;
+}
+
+/**
+ * @brief Unlock the item a lock from a 'get' points to
+ *
+ * @param lock Lock pointer
+ */
+void _coolhash_small_unlock(void *lock)
+{
+        struct coolhash_small_entry *e;
+        uint32_t v;
+
+        e = lock;
+
+        /* A writer is alone, so the writer bit can only be ours */
+        if (__atomic_load_n(&e->lock, __ATOMIC_RELAXED) &
+                        COOLHASH_SMALL_WRITER) {
+                _coolhash_small_release(e);
+                return;
+        }
+
+        v = __atomic_sub_fetch(&e->lock, 1, __ATOMIC_RELEASE);
+
+        /* The last reader out wakes the writers waiting for it. If anybody
+         * took the entry meanwhile, waking them is up to that holder. */
+        if (v == COOLHASH_SMALL_WAITERS && __atomic_compare_exchange_n(
+                                &e->lock, &v, 0, 0, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED))
+                _coolhash_small_wake(e);
+}
+
+/**
+ * @brief Loop through every item, in storage order rather than bucket order,
+ * locking each one before calling the callback (which must unlock or delete
+ * it). The shard lock is not held while the callback runs, so items other
+ * threads add or delete meanwhile may or may not be visited.
+ *
+ * @param ch coolhash instance
+ * @param cb Callback function
+ * @param cb_arg Callback function argument
+ * @param ro Boolean, readonly?
+ */
+void _coolhash_small_foreach(struct coolhash *ch, coolhash_foreach_func cb,
+                void *cb_arg, int ro)
+{
+        struct coolhash_table *table;
+        struct coolhash_small *small;
+        struct coolhash_small_entry *e;
+        uint32_t idx;
+        unsigned int i;
+        int waited;
+
+        waited = 0;
+
+        for (i = 0; i < ch->profile.shards; i++) {
+                table = &ch->tables[i];
+                small = table->small;
+
+                _coolhash_table_lock(table);
+                for (idx = 1; idx < small->used; idx++) {
+                        e = _coolhash_small_entry(small, idx);
+                        if (e->data == NULL)
+                                continue;
+
+                        if (_coolhash_small_trylock(e, ro) != 0) {
+                                waited = 1;
+                                COOLHASH_PROBE2(node_lock_wait, e, ro);
+                                _coolhash_table_unlock(table);
+                                _coolhash_small_wait(e, ro, NULL);
+                                _coolhash_table_lock(table);
+                                idx--; /* Look at it again */
+                                continue;
+                        }
+                        COOLHASH_PROBE3(node_lock_acquire, e, ro, waited);
+                        waited = 0;
+
+                        _coolhash_table_unlock(table);
+                        cb(ch, e->key, e->data, e, cb_arg);
+                        /* The callback needs to unlock or delete the
+                         * entry. */
+                        _coolhash_table_lock(table);
+                }
+                _coolhash_table_unlock(table);
+        }
+}
+
+/**
+ * @brief Rehash a table to a new size. Entries stay where they are; only
+ * their links change. - the table must be locked
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ * @param nsize New size
+ *
+ * @return Non-zero error (no memory; the table is left as it was)
+ */
+int _coolhash_small_rehash(struct coolhash *ch, struct coolhash_table *table,
+                unsigned int nsize)
+{
+        struct coolhash_small *small;
+        struct coolhash_small_entry *e;
+        uint32_t *buckets, idx, next;
+        unsigned int i;
+
+        small = table->small;
+        COOLHASH_PROBE4(rehash_start, table, table->size, nsize, table->n);
+
+        buckets = _coolhash_mem_alloc(ch, (size_t) nsize * sizeof(*buckets));
+        if (buckets == NULL) {
+                COOLHASH_PROBE4(rehash_end, table, table->size, nsize, -1);
+                return -1;
+        }
+
+        for (i = 0; i < table->size; i++) {
+                for (idx = small->buckets[i]; idx; idx = next) {
+                        e = _coolhash_small_entry(small, idx);
+                        next = e->next;
+                        e->next = buckets[e->key % nsize];
+                        buckets[e->key % nsize] = idx;
+                }
+        }
+
+        COOLHASH_PROBE4(rehash_end, table, table->size, nsize, 0);
+
+        _coolhash_mem_free(ch, small->buckets, (size_t) table->size *
+                        sizeof(*small->buckets));
+        small->buckets = buckets;
+        table->size = nsize;
+        _coolhash_table_grow_shrink_calc(ch, table);
+
+        return 0;
+}
+
+/**
+ * @brief Memory used by a small engine shard - the same breakdown as
+ * coolhash_mem
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ * @param mem Filled in with byte counts
+ */
+void _coolhash_small_mem(struct coolhash *ch, struct coolhash_table *table,
+                struct coolhash_mem *mem)
+{
+        struct coolhash_small *small;
+        struct coolhash_small_entry *e;
+        size_t lock_size, entry_size;
+
+        memset(mem, 0, sizeof(*mem));
+
+        lock_size = sizeof(e->lock);
+        entry_size = sizeof(*e) - lock_size;
+
+        _coolhash_table_lock(table);
+
+        small = table->small;
+        mem->buckets = _coolhash_mem_size(ch, (size_t) table->size *
+                        sizeof(*small->buckets));
+        mem->nodes = (size_t) table->n * entry_size;
+        mem->locks = sizeof(table->table_mx) + (size_t) table->n * lock_size;
+        mem->slack = ((size_t) small->nchunks * COOLHASH_SMALL_CHUNK -
+                        table->n) * sizeof(*e);
+        mem->extra = (size_t) small->chunks_size * sizeof(*small->chunks);
+
+        _coolhash_table_unlock(table);
+
+        mem->total = mem->buckets + mem->nodes + mem->locks + mem->slack +
+                mem->extra;
+}
+
+/**
+ * @brief Lock a table, giving up at a deadline
+ *
+ * @param table Table
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+static int _coolhash_small_table_lock_until(struct coolhash_table *table,
+                const struct timespec *abstime)
+{
+        int waited;
+
+        if (abstime == NULL) {
+                _coolhash_table_lock(table);
+                return 0;
+        }
+
+        waited = 0;
+
+#ifdef COOLHASH_PROBES
+        if (pthread_mutex_trylock(&table->table_mx) == 0) {
+                COOLHASH_PROBE2(table_lock_acquire, table, waited);
+                return 0;
+        }
+
+        waited = 1;
+        COOLHASH_PROBE1(table_lock_wait, table);
+#endif
+
+        if (pthread_mutex_timedlock(&table->table_mx, abstime) != 0)
+                return -ETIMEDOUT;
+
+        COOLHASH_PROBE2(table_lock_acquire, table, waited);
+
+        return 0;
+}
+
+/**
+ * @brief Find and lock a key's entry - the table must be locked. Holders of
+ * an entry take the table lock to delete it, so rather than waiting for the
+ * entry with the table locked, the table is let go while waiting and the key
+ * is looked up again afterwards.
+ *
+ * @param table Table
+ * @param key Key
+ * @param ro Boolean, readonly?
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ * @param entry Filled in with the locked entry, or NULL if the key has none
+ *
+ * @return Zero (the table is still locked) or -ETIMEDOUT (it is not)
+ */
+static int _coolhash_small_find_lock(struct coolhash_table *table,
+                uint32_t key, int ro, const struct timespec *abstime,
+                struct coolhash_small_entry **entry)
+{
+        struct coolhash_small *small;
+        struct coolhash_small_entry *e;
+        uint32_t idx;
+        unsigned int len;
+        int res, waited;
+
+        small = table->small;
+        waited = 0;
+
+        for (;;) {
+                e = NULL;
+                len = 0;
+                idx = small->buckets[key % table->size];
+                for (; idx; idx = e->next) {
+                        e = _coolhash_small_entry(small, idx);
+                        if (e->key == key)
+                                break;
+                        len++;
+                }
+
+                COOLHASH_PROBE3(chain_walk, table, key, len);
+
+                if (idx == 0) {
+                        *entry = NULL;
+                        return 0;
+                }
+
+                if (_coolhash_small_trylock(e, ro) == 0) {
+                        COOLHASH_PROBE3(node_lock_acquire, e, ro, waited);
+                        *entry = e;
+                        return 0;
+                }
+
+                waited = 1;
+                COOLHASH_PROBE2(node_lock_wait, e, ro);
+
+                /* Entries are never freed while the table exists, so the
+                 * lock can be watched without the table */
+                _coolhash_table_unlock(table);
+                if ((res = _coolhash_small_wait(e, ro, abstime)) != 0)
+                        return res;
+                if ((res = _coolhash_small_table_lock_until(table,
+                                                abstime)) != 0)
+                        return res;
+        }
+}
+
+/**
+ * @brief Try to lock an entry
+ *
+ * @param e Entry
+ * @param ro Boolean, readonly?
+ *
+ * @return Non-zero failure (a writer, or for writers anybody, holds it)
+ */
+static int _coolhash_small_trylock(struct coolhash_small_entry *e, int ro)
+{
+        uint32_t v;
+
+        v = __atomic_load_n(&e->lock, __ATOMIC_RELAXED);
+
+        if (ro) {
+                while (!(v & COOLHASH_SMALL_WRITER)) {
+                        if (__atomic_compare_exchange_n(&e->lock, &v, v + 1,
+                                                0, __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
+                                return 0;
+                }
+                return -1;
+        }
+
+        if ((v & ~COOLHASH_SMALL_WAITERS) != 0 ||
+                        !__atomic_compare_exchange_n(&e->lock, &v,
+                                v | COOLHASH_SMALL_WRITER, 0,
+                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return -1;
+
+        return 0;
+}
+
+/**
+ * @brief Wait until an entry looks like it can be locked. A short spin
+ * covers holders that let go quickly; after that the thread goes to sleep
+ * until the holder releases the entry, like a waiter on a pthread lock would.
+ * The deadline is checked right after the first look, so one in the past
+ * makes this return at once.
+ *
+ * @param e Entry
+ * @param ro Boolean, readonly?
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+static int _coolhash_small_wait(struct coolhash_small_entry *e, int ro,
+                const struct timespec *abstime)
+{
+        struct timespec now;
+        unsigned int spins;
+        uint32_t v;
+
+        for (spins = 0;; spins++) {
+                v = __atomic_load_n(&e->lock, __ATOMIC_RELAXED);
+                if (ro ? !(v & COOLHASH_SMALL_WRITER) :
+                                !(v & ~COOLHASH_SMALL_WAITERS))
+                        return 0;
+
+                if (abstime && (spins == 0 || spins >= COOLHASH_SMALL_SPINS)) {
+                        clock_gettime(CLOCK_REALTIME, &now);
+                        if (now.tv_sec > abstime->tv_sec ||
+                                        (now.tv_sec == abstime->tv_sec &&
+                                         now.tv_nsec >= abstime->tv_nsec))
+                                return -ETIMEDOUT;
+                }
+
+                if (spins < COOLHASH_SMALL_SPINS)
+                        continue;
+
+                /* Ask whoever releases the entry to wake us up */
+                if (!(v & COOLHASH_SMALL_WAITERS) &&
+                                !__atomic_compare_exchange_n(&e->lock, &v,
+                                        v | COOLHASH_SMALL_WAITERS, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        continue;
+
+                _coolhash_small_park(e, v | COOLHASH_SMALL_WAITERS, abstime);
+        }
+}
+
+/**
+ * @brief Sleep on an entry's lock word for as long as it still holds a value,
+ * or until a deadline. Returns early on wakeups and signals; callers look at
+ * the lock again either way.
+ *
+ * @param e Entry
+ * @param v Lock word value to sleep on
+ * @param abstime Deadline (CLOCK_REALTIME), NULL to wait as long as it takes
+ */
+static void _coolhash_small_park(struct coolhash_small_entry *e, uint32_t v,
+                const struct timespec *abstime)
+{
+#ifdef __linux__
+        syscall(SYS_futex, &e->lock, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG |
+                        FUTEX_CLOCK_REALTIME, v, abstime, NULL,
+                        FUTEX_BITSET_MATCH_ANY);
+#else
+        sched_yield();
+#endif
+}
+
+/**
+ * @brief Release a write-locked entry, waking any thread sleeping on it
+ *
+ * @param e Entry
+ */
+static void _coolhash_small_release(struct coolhash_small_entry *e)
+{
+        if (__atomic_exchange_n(&e->lock, 0, __ATOMIC_RELEASE) &
+                        COOLHASH_SMALL_WAITERS)
+                _coolhash_small_wake(e);
+}
+
+/**
+ * @brief Wake every thread sleeping on an entry's lock word
+ *
+ * @param e Entry
+ */
+static void _coolhash_small_wake(struct coolhash_small_entry *e)
+{
+#ifdef __linux__
+        syscall(SYS_futex, &e->lock, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+                        NULL, NULL, 0);
+#else
+        (void) e;
+#endif
+}
+
+/**
+ * @brief Take an entry off the free list, or a new one from the last chunk
+ * (starting a new chunk if it is full)
+ *
+ * @param ch coolhash instance
+ * @param small Small engine storage
+ *
+ * @return Entry index or 0 on failure (no memory, or every index is taken)
+ */
+static uint32_t _coolhash_small_alloc(struct coolhash *ch,
+                struct coolhash_small *small)
+{
+        struct coolhash_small_entry **chunks;
+        unsigned int size;
+        uint32_t idx;
+
+        if (small->free) {
+                idx = small->free;
+                small->free = _coolhash_small_entry(small, idx)->next;
+                return idx;
+        }
+
+        if (small->used == 0)
+                small->used = 1; /* Entry 0 stands for none */
+        if (small->used == UINT32_MAX)
+                return 0;
+
+        if (small->used / COOLHASH_SMALL_CHUNK == small->nchunks) {
+                if (small->nchunks == small->chunks_size) {
+                        size = small->chunks_size ? small->chunks_size * 2 : 4;
+                        chunks = realloc(small->chunks, size *
+                                        sizeof(*chunks));
+                        if (chunks == NULL)
+                                return 0;
+                        small->chunks = chunks;
+                        small->chunks_size = size;
+                }
+
+                small->chunks[small->nchunks] = _coolhash_mem_alloc(ch,
+                                COOLHASH_SMALL_CHUNK *
+                                sizeof(**small->chunks));
+                if (small->chunks[small->nchunks] == NULL)
+                        return 0;
+                small->nchunks++;
+        }
+
+        return small->used++;
+}
+
+/**
+ * @brief Unlink an entry, put it on the free list and release its lock - the
+ * table must be locked and the entry write-locked
+ *
+ * @param ch coolhash instance
+ * @param table Table
+ * @param e Entry
+ */
+static void _coolhash_small_remove(struct coolhash *ch,
+                struct coolhash_table *table, struct coolhash_small_entry *e)
+{
+        struct coolhash_small *small;
+        uint32_t *link, idx;
+
+        small = table->small;
+
+        link = &small->buckets[e->key % table->size];
+        while (_coolhash_small_entry(small, *link) != e)
+                link = &_coolhash_small_entry(small, *link)->next;
+        idx = *link;
+        *link = e->next;
+
+        e->data = NULL;
+        e->next = small->free;
+        small->free = idx;
+        table->n--;
+        _coolhash_small_release(e);
+
+        if (table->n < table->shrink_at)
+                _coolhash_small_rehash(ch, table, table->size / 2);
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,323 @@
+#include <stdlib.h>
+
+#include "inc.h"
+
+static void _coolhash_snapshot_copy_one(struct coolhash_table *table,
+                struct coolhash_snapshot_shard *shard);
+static int _coolhash_snapshot_cuckoo(struct coolhash_snapshot *snap);
+static int _coolhash_snapshot_small(struct coolhash_snapshot *snap);
+
+/**
+ * @brief Take a consistent point-in-time snapshot of every shard. Every shard
+ * lock is held together for just long enough to mark the shards; a shard's
+ * items are copied later, by whichever comes first: the next write to that
+ * shard, or coolhash_snapshot_foreach getting to it. Writers therefore only
+ * pay for one copy of a shard per snapshot, and readers can take as long as
+ * they like. With COOLHASH_ENGINE_CUCKOO and COOLHASH_ENGINE_SMALL
+ * everything is copied up front.
+ *
+ * The snapshot holds the data pointers that were stored at the time, not
+ * copies of your data; keep whatever they point to valid until the snapshot
+ * is freed. It must be freed before the coolhash instance.
+ *
+ * @param ch coolhash instance
+ *
+ * @return Snapshot or NULL on failure (likely no memory)
+ */
+struct coolhash_snapshot *coolhash_snapshot_new(struct coolhash *ch)
+{
+        struct coolhash_snapshot *snap;
+        struct coolhash_table *table;
+        unsigned int i;
+
+        if (ch == NULL)
+                return NULL;
+
+        snap = malloc(sizeof(*snap));
+        if (snap == NULL)
+                return NULL;
+
+        snap->ch = ch;
+        snap->shards = calloc(ch->profile.shards, sizeof(*snap->shards));
+        if (snap->shards == NULL) {
+                free(snap);
+                return NULL;
+        }
+
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                if (_coolhash_snapshot_cuckoo(snap) != 0) {
+                        coolhash_snapshot_free(snap);
+                        return NULL;
+                }
+                return snap;
+        }
+
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                if (_coolhash_snapshot_small(snap) != 0) {
+                        coolhash_snapshot_free(snap);
+                        return NULL;
+                }
+                return snap;
+        }
+
+        /* Hold every shard at once so no write lands between two of them;
+         * always in shard order so two snapshots can't deadlock */
+        for (i = 0; i < ch->profile.shards; i++)
+                _coolhash_table_lock(&ch->tables[i]);
+
+        for (i = 0; i < ch->profile.shards; i++) {
+                table = &ch->tables[i];
+                snap->shards[i].next = table->snap_pending;
+                table->snap_pending = &snap->shards[i];
+        }
+
+        for (i = ch->profile.shards; i > 0; i--)
+                _coolhash_table_unlock(&ch->tables[i - 1]);
+
+        return snap;
+}
+
+/**
+ * @brief Loop through every item in a snapshot. No coolhash lock is held
+ * while the callback runs, so it is free to call back into coolhash.
+ *
+ * @param snap Snapshot
+ * @param cb Callback function (required)
+ * @param cb_arg Callback function argument (optional)
+ *
+ * @return Non-zero error (some shard could not be copied, likely no memory;
+ * the items of every other shard were still passed to the callback)
+ */
+int coolhash_snapshot_foreach(struct coolhash_snapshot *snap,
+                coolhash_snapshot_func cb, void *cb_arg)
+{
+        struct coolhash_snapshot_shard *shard;
+        struct coolhash_table *table;
+        unsigned int i, j;
+        int res;
+
+        if (snap == NULL || cb == NULL)
+                return -1;
+
+        res = 0;
+        for (i = 0; i < snap->ch->profile.shards; i++) {
+                shard = &snap->shards[i];
+
+                if (!__atomic_load_n(&shard->copied, __ATOMIC_ACQUIRE)) {
+                        table = &snap->ch->tables[i];
+                        _coolhash_table_lock(table);
+                        if (!shard->copied)
+                                _coolhash_snapshot_copy(table);
+                        _coolhash_table_unlock(table);
+                }
+
+                if (shard->copied < 0) {
+                        res = -1;
+                        continue;
+                }
+
+                for (j = 0; j < shard->n; j++)
+                        cb(shard->items[j].key, shard->items[j].data, cb_arg);
+        }
+
+        return res;
+}
+
+/**
+ * @brief Free a snapshot
+ *
+ * @param snap Snapshot
+ */
+void coolhash_snapshot_free(struct coolhash_snapshot *snap)
+{
+        struct coolhash_snapshot_shard **pp;
+        struct coolhash_table *table;
+        unsigned int i;
+
+        if (snap == NULL)
+                return;
+
+        for (i = 0; i < snap->ch->profile.shards; i++) {
+                /* Shards nobody got around to copying are still linked */
+                if (!__atomic_load_n(&snap->shards[i].copied,
+                                        __ATOMIC_ACQUIRE)) {
+                        table = &snap->ch->tables[i];
+                        _coolhash_table_lock(table);
+                        for (pp = &table->snap_pending; *pp;
+                                        pp = &(*pp)->next) {
+                                if (*pp == &snap->shards[i]) {
+                                        *pp = snap->shards[i].next;
+                                        break;
+                                }
+                        }
+                        _coolhash_table_unlock(table);
+                }
+
+                free(snap->shards[i].items);
+        }
+
+        free(snap->shards);
+        free(snap);
+}
+
+/**
+ * @brief Copy a table's items into every snapshot still waiting for them,
+ * before the table is changed - the table must be locked
+ *
+ * @param table Table
+ */
+void _coolhash_snapshot_copy(struct coolhash_table *table)
+{
+        struct coolhash_snapshot_shard *shard, *next;
+
+        for (shard = table->snap_pending; shard; shard = next) {
+                next = shard->next;
+                _coolhash_snapshot_copy_one(table, shard);
+        }
+
+        table->snap_pending = NULL;
+}
+
+/**
+ * @brief Copy a table's live items into one snapshot shard - the table must
+ * be locked
+ *
+ * @param table Table
+ * @param shard Snapshot shard
+ */
+static void _coolhash_snapshot_copy_one(struct coolhash_table *table,
+                struct coolhash_snapshot_shard *shard)
+{
+        struct coolhash_node *node;
+        unsigned int i;
+
+        shard->n = 0;
+        shard->items = malloc((table->n ? table->n : 1) *
+                        sizeof(*shard->items));
+        if (shard->items == NULL) {
+                /* The table is about to change; this shard is lost */
+                __atomic_store_n(&shard->copied, -1, __ATOMIC_RELEASE);
+                return;
+        }
+
+        for (i = 0; i < table->size; i++) {
+                for (node = table->nodes[i]; node; node = node->next) {
+                        if (node->del)
+                                continue;
+
+                        shard->items[shard->n].key = node->key;
+                        shard->items[shard->n].data = node->data;
+                        shard->n++;
+                }
+        }
+
+        __atomic_store_n(&shard->copied, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Copy every cuckoo shard while they are all locked
+ *
+ * @param snap Snapshot
+ *
+ * @return Non-zero error (no memory)
+ */
+static int _coolhash_snapshot_cuckoo(struct coolhash_snapshot *snap)
+{
+        struct coolhash *ch;
+        struct coolhash_snapshot_shard *shard;
+        struct coolhash_cuckoo *ck;
+        unsigned int i, j, n;
+        int s, res;
+
+        ch = snap->ch;
+
+        for (i = 0; i < ch->profile.shards; i++)
+                pthread_rwlock_wrlock(&ch->tables[i].cuckoo_mx);
+
+        res = 0;
+        for (i = 0; i < ch->profile.shards; i++) {
+                shard = &snap->shards[i];
+                ck = ch->tables[i].cuckoo;
+                n = ch->tables[i].n;
+
+                shard->items = malloc((n ? n : 1) * sizeof(*shard->items));
+                if (shard->items == NULL) {
+                        res = -1;
+                        break;
+                }
+
+                for (j = 0; j <= ck->mask; j++) {
+                        for (s = 0; s < COOLHASH_CUCKOO_SLOTS; s++) {
+                                if (ck->buckets[j].data[s] == NULL)
+                                        continue;
+
+                                shard->items[shard->n].key =
+                                        ck->buckets[j].keys[s];
+                                shard->items[shard->n].data =
+                                        ck->buckets[j].data[s];
+                                shard->n++;
+                        }
+                }
+                shard->copied = 1;
+        }
+
+        for (i = ch->profile.shards; i > 0; i--)
+                pthread_rwlock_unlock(&ch->tables[i - 1].cuckoo_mx);
+
+        return res;
+}
+
+/**
+ * @brief Copy every small engine shard while they are all locked; entry data
+ * only changes under the shard lock
+ *
+ * @param snap Snapshot
+ *
+ * @return Non-zero error (no memory)
+ */
+static int _coolhash_snapshot_small(struct coolhash_snapshot *snap)
+{
+        struct coolhash *ch;
+        struct coolhash_snapshot_shard *shard;
+        struct coolhash_small *small;
+        struct coolhash_small_entry *e;
+        unsigned int i, n;
+        uint32_t idx;
+        int res;
+
+        ch = snap->ch;
+
+        for (i = 0; i < ch->profile.shards; i++)
+                _coolhash_table_lock(&ch->tables[i]);
+
+        res = 0;
+        for (i = 0; i < ch->profile.shards; i++) {
+                shard = &snap->shards[i];
+                small = ch->tables[i].small;
+                n = ch->tables[i].n;
+
+                shard->items = malloc((n ? n : 1) * sizeof(*shard->items));
+                if (shard->items == NULL) {
+                        res = -1;
+                        break;
+                }
+
+                for (idx = 1; idx < small->used; idx++) {
+                        e = _coolhash_small_entry(small, idx);
+                        if (e->data == NULL)
+                                continue;
+
+                        shard->items[shard->n].key = e->key;
+                        shard->items[shard->n].data = e->data;
+                        shard->n++;
+                }
+                shard->copied = 1;
+        }
+
+        for (i = ch->profile.shards; i > 0; i--)
+                _coolhash_table_unlock(&ch->tables[i - 1]);
+
+        return res;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,405 @@
+#include <errno.h>
+
+#include "inc.h"
+
+static int _coolhash_set_until(struct coolhash *ch, coolhash_key_t key,
+                void *data, const struct timespec *abstime);
+static int _coolhash_get_until(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, int ro,
+                const struct timespec *abstime);
+static int _coolhash_del_until(struct coolhash *ch, void *lock,
+                const struct timespec *abstime);
+static int _coolhash_table_lock_until(struct coolhash_table *table,
+                const struct timespec *abstime);
+static int _coolhash_node_lock_until(struct coolhash_node *node, int ro,
+                const struct timespec *abstime);
+static int _coolhash_busy(int res);
+
+/* A deadline that has always passed: every lock is tried exactly once */
+static const struct timespec _coolhash_now = { 0, 0 };
+
+/**
+ * @brief Add/replace item without waiting for a lock another thread holds.
+ * A set that makes the shard grow still waits for the items other threads
+ * hold to be released, unless background maintenance is enabled.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Pointer to your data
+ *
+ * @return Zero, -EBUSY if the shard or item is locked, or -1 on other errors
+ * (likely no memory)
+ */
+int coolhash_try_set(struct coolhash *ch, coolhash_key_t key, void *data)
+{
+        return _coolhash_busy(_coolhash_set_until(ch, key, data,
+                                &_coolhash_now));
+}
+
+/**
+ * @brief Add/replace item, waiting for locks until a deadline at most. See
+ * coolhash_try_set about growing shards.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Pointer to your data
+ * @param abstime Absolute deadline, measured against CLOCK_REALTIME (like
+ * pthread_mutex_timedlock)
+ *
+ * @return Zero, -ETIMEDOUT if the shard or item stayed locked, or -1 on other
+ * errors (likely no memory)
+ */
+int coolhash_timed_set(struct coolhash *ch, coolhash_key_t key, void *data,
+                const struct timespec *abstime)
+{
+        if (abstime == NULL)
+                return -1;
+
+        return _coolhash_set_until(ch, key, data, abstime);
+}
+
+/**
+ * @brief Retrieve item without waiting for a lock another thread holds
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Filled in with a pointer to your data
+ * @param lock Pointer to void pointer; on success you must pass this to
+ * coolhash_unlock or coolhash_del when you are done with the returned item
+ *
+ * @return Zero, -1 if the item was not found or -EBUSY if the shard or item
+ * is locked
+ */
+int coolhash_try_get(struct coolhash *ch, coolhash_key_t key, void **data,
+                void **lock)
+{
+        return _coolhash_busy(_coolhash_get_until(ch, key, data, lock, 0,
+                                &_coolhash_now));
+}
+
+/**
+ * @brief Retrieve item, waiting for locks until a deadline at most
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Filled in with a pointer to your data
+ * @param lock Pointer to void pointer; on success you must pass this to
+ * coolhash_unlock or coolhash_del when you are done with the returned item
+ * @param abstime Absolute deadline, measured against CLOCK_REALTIME
+ *
+ * @return Zero, -1 if the item was not found or -ETIMEDOUT if the shard or
+ * item stayed locked
+ */
+int coolhash_timed_get(struct coolhash *ch, coolhash_key_t key, void **data,
+                void **lock, const struct timespec *abstime)
+{
+        if (abstime == NULL)
+                return -1;
+
+        return _coolhash_get_until(ch, key, data, lock, 0, abstime);
+}
+
+/**
+ * @brief Retrieve item read-only without waiting for a lock another thread
+ * holds. With COOLHASH_ENGINE_CHAIN and COOLHASH_ENGINE_SMALL, other
+ * read-only holders of the item do not make this fail.
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Filled in with a pointer to your data
+ * @param lock Pointer to void pointer; on success you must pass this to
+ * coolhash_unlock when you are done with the returned item
+ *
+ * @return Zero, -1 if the item was not found or -EBUSY if the shard or item
+ * is locked
+ */
+int coolhash_try_get_ro(struct coolhash *ch, coolhash_key_t key, void **data,
+                void **lock)
+{
+        return _coolhash_busy(_coolhash_get_until(ch, key, data, lock, 1,
+                                &_coolhash_now));
+}
+
+/**
+ * @brief Retrieve item read-only, waiting for locks until a deadline at most
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Filled in with a pointer to your data
+ * @param lock Pointer to void pointer; on success you must pass this to
+ * coolhash_unlock when you are done with the returned item
+ * @param abstime Absolute deadline, measured against CLOCK_REALTIME
+ *
+ * @return Zero, -1 if the item was not found or -ETIMEDOUT if the shard or
+ * item stayed locked
+ */
+int coolhash_timed_get_ro(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, const struct timespec *abstime)
+{
+        if (abstime == NULL)
+                return -1;
+
+        return _coolhash_get_until(ch, key, data, lock, 1, abstime);
+}
+
+/**
+ * @brief Delete an item you got from a 'get' without waiting for the shard
+ * lock. On -EBUSY you still hold the item; retry later or coolhash_unlock it.
+ *
+ * @param ch coolhash instance
+ * @param lock Pointer you got from the 'get' function.
+ *
+ * @return Zero, -EBUSY if the shard is locked or -1 on other errors
+ */
+int coolhash_try_del(struct coolhash *ch, void *lock)
+{
+        return _coolhash_busy(_coolhash_del_until(ch, lock, &_coolhash_now));
+}
+
+/**
+ * @brief Delete an item you got from a 'get', waiting for the shard lock
+ * until a deadline at most. On -ETIMEDOUT you still hold the item.
+ *
+ * @param ch coolhash instance
+ * @param lock Pointer you got from the 'get' function.
+ * @param abstime Absolute deadline, measured against CLOCK_REALTIME
+ *
+ * @return Zero, -ETIMEDOUT if the shard stayed locked or -1 on other errors
+ */
+int coolhash_timed_del(struct coolhash *ch, void *lock,
+                const struct timespec *abstime)
+{
+        if (abstime == NULL)
+                return -1;
+
+        return _coolhash_del_until(ch, lock, abstime);
+}
+
+/**
+ * @brief Add/replace item, giving up on locks at a deadline
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Pointer to your data
+ * @param abstime Deadline
+ *
+ * @return Zero, -ETIMEDOUT or -1 on other errors
+ */
+static int _coolhash_set_until(struct coolhash *ch, coolhash_key_t key,
+                void *data, const struct timespec *abstime)
+{
+        struct coolhash_table *table;
+        struct coolhash_node *node;
+        int res;
+
+        if (ch == NULL || data == NULL)
+                return -1;
+
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return _coolhash_cuckoo_set_until(ch, key, data, abstime);
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return _coolhash_small_set_until(ch, key, data, abstime);
+
+        /* Combining would have us wait for the combiner, so go straight for
+         * the shard lock; whoever holds it executes requests the same way */
+        table = _coolhash_table_find(ch, key);
+        if ((res = _coolhash_table_lock_until(table, abstime)) != 0)
+                return res;
+
+        /* Nobody can lock a node without the table lock, so once we have
+         * had it, _coolhash_table_set will not wait on it */
+        node = _coolhash_table_node_find(table, key);
+        if (node) {
+                if ((res = _coolhash_node_lock_until(node, 0,
+                                                abstime)) != 0) {
+                        _coolhash_table_unlock(table);
+                        return res;
+                }
+                _coolhash_node_unlock(node);
+        }
+
+        res = _coolhash_table_set(ch, table, key, data);
+        _coolhash_table_unlock(table);
+
+        return res;
+}
+
+/**
+ * @brief Retrieve item, giving up on locks at a deadline
+ *
+ * @param ch coolhash instance
+ * @param key Hashed key
+ * @param data Filled in with a pointer to your data
+ * @param lock Filled in with the lock pointer
+ * @param ro Boolean, readonly?
+ * @param abstime Deadline
+ *
+ * @return Zero, -1 if not found or -ETIMEDOUT
+ */
+static int _coolhash_get_until(struct coolhash *ch, coolhash_key_t key,
+                void **data, void **lock, int ro,
+                const struct timespec *abstime)
+{
+        struct coolhash_table *table;
+        struct coolhash_node *node;
+        int res;
+
+        if (ch == NULL || data == NULL || lock == NULL)
+                return -1;
+
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return _coolhash_cuckoo_get_until(ch, key, data, lock, ro,
+                                abstime);
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return _coolhash_small_get_until(ch, key, data, lock, ro,
+                                abstime);
+
+        table = _coolhash_table_find(ch, key);
+        if (ch->profile.bloom_bits && !_coolhash_bloom_maybe(table, key))
+                return -1;
+
+        if ((res = _coolhash_table_lock_until(table, abstime)) != 0)
+                return res;
+
+        node = _coolhash_table_node_find(table, key);
+        if (node == NULL) {
+                _coolhash_table_unlock(table);
+                return -1;
+        }
+
+        res = _coolhash_node_lock_until(node, ro, abstime);
+        _coolhash_table_unlock(table);
+        if (res != 0)
+                return res;
+
+        if (node->del) {
+                _coolhash_node_unlock(node);
+                return -1;
+        }
+
+        *data = node->data;
+        *lock = node;
+        return 0;
+}
+
+/**
+ * @brief Delete a held item, giving up on the shard lock at a deadline
+ *
+ * @param ch coolhash instance
+ * @param lock Pointer you got from the 'get' function.
+ * @param abstime Deadline
+ *
+ * @return Zero, -ETIMEDOUT or -1 on other errors
+ */
+static int _coolhash_del_until(struct coolhash *ch, void *lock,
+                const struct timespec *abstime)
+{
+        struct coolhash_table *table;
+        struct coolhash_node *node;
+        int res;
+
+        if (ch == NULL || lock == NULL)
+                return -1;
+
+        if (ch->profile.engine == COOLHASH_ENGINE_CUCKOO)
+                return _coolhash_cuckoo_del_until(ch, lock, abstime);
+        if (ch->profile.engine == COOLHASH_ENGINE_SMALL)
+                return _coolhash_small_del_until(ch, lock, abstime);
+
+        node = lock;
+        table = _coolhash_table_find(ch, node->key);
+
+        if ((res = _coolhash_table_lock_until(table, abstime)) != 0)
+                return res;
+        _coolhash_table_del_node(ch, table, node);
+        _coolhash_table_unlock(table);
+
+        return 0;
+}
+
+/**
+ * @brief Lock a table, giving up at a deadline
+ *
+ * @param table Table
+ * @param abstime Deadline
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+static int _coolhash_table_lock_until(struct coolhash_table *table,
+                const struct timespec *abstime)
+{
+        int waited;
+
+        waited = 0;
+
+#ifdef COOLHASH_PROBES
+        if (pthread_mutex_trylock(&table->table_mx) == 0) {
+                COOLHASH_PROBE2(table_lock_acquire, table, waited);
+                return 0;
+        }
+
+        waited = 1;
+        COOLHASH_PROBE1(table_lock_wait, table);
+#endif
+
+        if (pthread_mutex_timedlock(&table->table_mx, abstime) != 0)
+                return -ETIMEDOUT;
+
+        COOLHASH_PROBE2(table_lock_acquire, table, waited);
+
+        return 0;
+}
+
+/**
+ * @brief Lock a node, giving up at a deadline
+ *
+ * @param node Node
+ * @param ro Read-only?
+ * @param abstime Deadline
+ *
+ * @return Zero or -ETIMEDOUT
+ */
+static int _coolhash_node_lock_until(struct coolhash_node *node, int ro,
+                const struct timespec *abstime)
+{
+        int res, waited;
+
+        waited = 0;
+
+#ifdef COOLHASH_PROBES
+        if ((ro ? pthread_rwlock_tryrdlock(&node->node_mx) :
+                                pthread_rwlock_trywrlock(&node->node_mx)) ==
+                        0) {
+                COOLHASH_PROBE3(node_lock_acquire, node, ro, waited);
+                return 0;
+        }
+
+        waited = 1;
+        COOLHASH_PROBE2(node_lock_wait, node, ro);
+#endif
+
+        if (ro)
+                res = pthread_rwlock_timedrdlock(&node->node_mx, abstime);
+        else
+                res = pthread_rwlock_timedwrlock(&node->node_mx, abstime);
+        if (res)
+                return -ETIMEDOUT;
+
+        COOLHASH_PROBE3(node_lock_acquire, node, ro, waited);
+
+        return 0;
+}
+
+/**
+ * @brief Report a missed deadline of the try variants as -EBUSY
+ *
+ * @param res Result
+ *
+ * @return Result
+ */
+static int _coolhash_busy(int res)
+{
+        return res == -ETIMEDOUT ? -EBUSY : res;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
@@ -0,0 +1,294 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inc.h"
+
+#define COOLHASH_WBUF_NIL UINT_MAX /**< End of a shard's op list */
+#define COOLHASH_WBUF_DEFAULT_MAX_OPS 256 /**< Default flush threshold */
+
+static int _coolhash_wbuf_queue(struct coolhash_wbuf *wb, coolhash_key_t key,
+                void *data);
+static unsigned int _coolhash_wbuf_age(struct coolhash_wbuf *wb);
+
+/**
+ * @brief Create a write-combining buffer. Sets and deletes queued in the
+ * buffer are grouped by shard and applied in batches, so every shard lock is
+ * taken once per batch instead of once per operation. A buffer is meant to
+ * be owned by a single thread; it does no locking of its own.
+ *
+ * @param ch coolhash instance
+ * @param max_ops Flush once this many ops are pending (0 for default)
+ * @param max_usec Flush once the oldest pending op is this many microseconds
+ * old (0 to only flush on max_ops or coolhash_wbuf_flush)
+ *
+ * @return New write buffer or NULL on failure
+ */
+struct coolhash_wbuf *coolhash_wbuf_new(struct coolhash *ch,
+                unsigned int max_ops, unsigned int max_usec)
+{
+        struct coolhash_wbuf *wb;
+        unsigned int i;
+
+        if (ch == NULL)
+                return NULL;
+
+        wb = calloc(1, sizeof(*wb));
+        if (wb == NULL)
+                return NULL;
+
+        wb->ch = ch;
+        wb->max_ops = max_ops ? max_ops : COOLHASH_WBUF_DEFAULT_MAX_OPS;
+        wb->max_usec = max_usec;
+
+        wb->ops = calloc(wb->max_ops, sizeof(*wb->ops));
+        wb->heads = calloc(ch->profile.shards, sizeof(*wb->heads));
+        wb->tails = calloc(ch->profile.shards, sizeof(*wb->tails));
+        wb->dirty = calloc(ch->profile.shards, sizeof(*wb->dirty));
+        if (wb->ops == NULL || wb->heads == NULL || wb->tails == NULL ||
+                        wb->dirty == NULL) {
+                coolhash_wbuf_free(wb);
+                return NULL;
+        }
+
+        for (i = 0; i < ch->profile.shards; i++)
+                wb->heads[i] = COOLHASH_WBUF_NIL;
+
+        return wb;
+}
+
+/**
+ * @brief Flush and free a write buffer
+ *
+ * @param wb Write buffer
+ */
+void coolhash_wbuf_free(struct coolhash_wbuf *wb)
+{
+        if (wb == NULL)
+                return;
+
+        if (wb->ops && wb->heads && wb->tails && wb->dirty)
+                coolhash_wbuf_flush(wb);
+
+        free(wb->ops);
+        free(wb->heads);
+        free(wb->tails);
+        free(wb->dirty);
+        free(wb);
+}
+
+/**
+ * @brief Queue an add/replace. The data pointer must stay valid until the
+ * buffer has been flushed, just like with coolhash_set.
+ *
+ * @param wb Write buffer
+ * @param key Hashed key
+ * @param data Pointer to your data
+ *
+ * @return Non-zero error (a flush triggered by this call failed)
+ */
+int coolhash_wbuf_set(struct coolhash_wbuf *wb, coolhash_key_t key,
+                void *data)
+{
+        if (wb == NULL || data == NULL)
+                return -1;
+
+        return _coolhash_wbuf_queue(wb, key, data);
+}
+
+/**
+ * @brief Queue a delete by key. Whatever the key currently points to is
+ * still referenced by the table until the buffer has been flushed.
+ *
+ * @param wb Write buffer
+ * @param key Hashed key
+ *
+ * @return Non-zero error (a flush triggered by this call failed)
+ */
+int coolhash_wbuf_del(struct coolhash_wbuf *wb, coolhash_key_t key)
+{
+        if (wb == NULL)
+                return -1;
+
+        return _coolhash_wbuf_queue(wb, key, NULL);
+}
+
+/**
+ * @brief Retrieve item and copy data into destination buffer, taking this
+ * buffer's pending writes into account (read-your-writes)
+ *
+ * @param wb Write buffer
+ * @param key Hashed key
+ * @param dst Destination buffer
+ * @param dst_len Buffer length
+ *
+ * @return Non-zero failure (item not found or pending delete)
+ */
+int coolhash_wbuf_get_copy(struct coolhash_wbuf *wb, coolhash_key_t key,
+                void *dst, size_t dst_len)
+{
+        struct coolhash_wbuf_op *op;
+        unsigned int i;
+
+        if (wb == NULL || dst == NULL || dst_len <= 0)
+                return -1;
+
+        /* The last pending op for this key wins */
+        op = NULL;
+        i = wb->heads[key % wb->ch->profile.shards];
+        for (; i != COOLHASH_WBUF_NIL; i = wb->ops[i].next) {
+                if (wb->ops[i].key == key)
+                        op = &wb->ops[i];
+        }
+
+        if (op == NULL)
+                return coolhash_get_copy(wb->ch, key, dst, dst_len);
+        if (op->data == NULL)
+                return -1;
+
+        memcpy(dst, op->data, dst_len);
+        return 0;
+}
+
+/**
+ * @brief Apply every pending op, taking each dirty shard's lock once
+ *
+ * @param wb Write buffer
+ *
+ * @return Non-zero error (at least one set failed, likely no memory)
+ */
+int coolhash_wbuf_flush(struct coolhash_wbuf *wb)
+{
+        struct coolhash_table *table;
+        struct coolhash_wbuf_op *op;
+        unsigned int d, i, shard;
+        int res;
+
+        if (wb == NULL)
+                return -1;
+
+        res = 0;
+        for (d = 0; d < wb->ndirty; d++) {
+                shard = wb->dirty[d];
+                table = &wb->ch->tables[shard];
+
+                if (wb->ch->profile.engine == COOLHASH_ENGINE_CUCKOO) {
+                        /* Cuckoo shards lock per bucket, not per shard */
+                        for (i = wb->heads[shard]; i != COOLHASH_WBUF_NIL;
+                                        i = op->next) {
+                                op = &wb->ops[i];
+                                if (op->data == NULL)
+                                        _coolhash_cuckoo_del_key(wb->ch,
+                                                        op->key);
+                                else if (_coolhash_cuckoo_set(wb->ch, op->key,
+                                                        op->data) != 0)
+                                        res = -1;
+                        }
+                        wb->heads[shard] = COOLHASH_WBUF_NIL;
+                        continue;
+                }
+
+                if (wb->ch->profile.engine == COOLHASH_ENGINE_SMALL) {
+                        /* Small engine entries may be held by 'get'
+                         * callers, which the shard lock must not wait on */
+                        for (i = wb->heads[shard]; i != COOLHASH_WBUF_NIL;
+                                        i = op->next) {
+                                op = &wb->ops[i];
+                                if (op->data == NULL)
+                                        _coolhash_small_del_key(wb->ch,
+                                                        op->key);
+                                else if (_coolhash_small_set_until(wb->ch,
+                                                        op->key, op->data,
+                                                        NULL) != 0)
+                                        res = -1;
+                        }
+                        wb->heads[shard] = COOLHASH_WBUF_NIL;
+                        continue;
+                }
+
+                _coolhash_table_lock(table);
+                for (i = wb->heads[shard]; i != COOLHASH_WBUF_NIL;
+                                i = op->next) {
+                        op = &wb->ops[i];
+                        if (op->data == NULL)
+                                _coolhash_table_del(wb->ch, table, op->key);
+                        else if (_coolhash_table_set(wb->ch, table, op->key,
+                                                op->data) != 0)
+                                res = -1;
+                }
+                _coolhash_table_unlock(table);
+
+                wb->heads[shard] = COOLHASH_WBUF_NIL;
+        }
+
+        wb->ndirty = 0;
+        wb->n = 0;
+
+        return res;
+}
+
+/**
+ * @brief Append an op to its shard's list, flushing if a threshold is hit
+ *
+ * @param wb Write buffer
+ * @param key Hashed key
+ * @param data Pointer to your data, NULL to delete
+ *
+ * @return Non-zero error (the triggered flush failed)
+ */
+static int _coolhash_wbuf_queue(struct coolhash_wbuf *wb, coolhash_key_t key,
+                void *data)
+{
+        unsigned int shard, i;
+
+        shard = (unsigned int) (key % wb->ch->profile.shards);
+
+        i = wb->n++;
+        wb->ops[i].key = key;
+        wb->ops[i].data = data;
+        wb->ops[i].next = COOLHASH_WBUF_NIL;
+
+        if (wb->heads[shard] == COOLHASH_WBUF_NIL) {
+                wb->heads[shard] = i;
+                wb->dirty[wb->ndirty++] = shard;
+        } else {
+                wb->ops[wb->tails[shard]].next = i;
+        }
+        wb->tails[shard] = i;
+
+        if (i == 0 && wb->max_usec)
+                clock_gettime(CLOCK_MONOTONIC, &wb->first);
+
+        if (wb->n >= wb->max_ops ||
+                        (wb->max_usec && _coolhash_wbuf_age(wb) >=
+                         wb->max_usec))
+                return coolhash_wbuf_flush(wb);
+
+        return 0;
+}
+
+/**
+ * @brief Age of the oldest pending op
+ *
+ * @param wb Write buffer
+ *
+ * @return Age in microseconds
+ */
+static unsigned int _coolhash_wbuf_age(struct coolhash_wbuf *wb)
+{
+        struct timespec now;
+        int64_t usec;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        usec = (int64_t) (now.tv_sec - wb->first.tv_sec) * 1000000 +
+                (now.tv_nsec - wb->first.tv_nsec) / 1000;
+        if (usec < 0)
+                return 0;
+        if (usec > UINT_MAX)
+                return UINT_MAX;
+
+        return (unsigned int) usec;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */
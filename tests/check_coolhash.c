@@ -1,14 +1,37 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <check.h>
 
 #include "../src/coolhash.h"
 
+#define COOLHASH_T_NAME tmpl_spin
+#define COOLHASH_T_KEY uint32_t
+#define COOLHASH_T_VALUE int
+#define COOLHASH_T_SHARDS 4
+#define COOLHASH_T_LOCK COOLHASH_T_LOCK_SPIN
+#include "../src/coolhash_tmpl.h"
+
+#define COOLHASH_T_NAME tmpl_none
+#define COOLHASH_T_VALUE double
+#define COOLHASH_T_LOCK COOLHASH_T_LOCK_NONE
+#include "../src/coolhash_tmpl.h"
+
+#define COOLHASH_T_NAME tmpl_signed
+#define COOLHASH_T_KEY int
+#define COOLHASH_T_VALUE int
+#define COOLHASH_T_SHARDS 3
+#include "../src/coolhash_tmpl.h"
+
 START_TEST(test_coolhash_new)
 {
         struct coolhash *ch;
         struct coolhash_profile profile;
 
+        coolhash_profile_init(&profile);
         coolhash_profile_set_size(&profile, 16);
         coolhash_profile_set_shards(&profile, 4);
         coolhash_profile_set_load_factor(&profile, 80);
@@ -27,6 +50,8 @@ START_TEST(test_coolhash_new_invalid_size_shards)
         struct coolhash *ch;
         struct coolhash_profile profile;
 
+        coolhash_profile_init(&profile);
+
         /* size and shards with invalid values */
         coolhash_profile_set_size(&profile, 0);
         coolhash_profile_set_shards(&profile, 0);
@@ -176,6 +201,7 @@ START_TEST(test_coolhash_auto_rehash)
         struct coolhash_profile profile;
         int res, var1, var2, var3, var4, cpy;
 
+        coolhash_profile_init(&profile);
         coolhash_profile_set_size(&profile, 16);
         coolhash_profile_set_shards(&profile, 4);
         coolhash_profile_set_load_factor(&profile, 80);
@@ -225,6 +251,1471 @@ START_TEST(test_coolhash_auto_rehash)
 }
 END_TEST
 
+START_TEST(test_coolhash_wbuf)
+{
+        struct coolhash *ch;
+        struct coolhash_wbuf *wb;
+        int res, var1, var2, var3, cpy;
+
+        ch = coolhash_new(NULL);
+        ck_assert_ptr_ne(ch, NULL);
+
+        wb = coolhash_wbuf_new(ch, 4, 0);
+        ck_assert_ptr_ne(wb, NULL);
+
+        var1 = 1;
+        res = coolhash_set(ch, 1, &var1);
+        ck_assert_int_eq(res, 0);
+
+        var2 = 2;
+        res = coolhash_wbuf_set(wb, 2, &var2);
+        ck_assert_int_eq(res, 0);
+        res = coolhash_wbuf_del(wb, 1);
+        ck_assert_int_eq(res, 0);
+
+        /* Nothing applied yet, but this thread sees its own writes */
+        res = coolhash_get_copy(ch, 2, &cpy, sizeof(cpy));
+        ck_assert_int_ne(res, 0);
+        res = coolhash_wbuf_get_copy(wb, 2, &cpy, sizeof(cpy));
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(cpy, 2);
+        res = coolhash_wbuf_get_copy(wb, 1, &cpy, sizeof(cpy));
+        ck_assert_int_ne(res, 0);
+
+        /* Fourth op hits max_ops and flushes */
+        var3 = 3;
+        res = coolhash_wbuf_set(wb, 3, &var3);
+        ck_assert_int_eq(res, 0);
+        res = coolhash_wbuf_set(wb, 2, &var3);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(wb->n, 0);
+
+        res = coolhash_get_copy(ch, 1, &cpy, sizeof(cpy));
+        ck_assert_int_ne(res, 0);
+        res = coolhash_get_copy(ch, 2, &cpy, sizeof(cpy));
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(cpy, 3);
+
+        /* Freeing flushes whatever is left */
+        res = coolhash_wbuf_set(wb, 1, &var1);
+        ck_assert_int_eq(res, 0);
+        coolhash_wbuf_free(wb);
+
+        res = coolhash_get_copy(ch, 1, &cpy, sizeof(cpy));
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(cpy, 1);
+
+        coolhash_free(ch);
+}
+END_TEST
+
+#define TEST_COMBINING_THREADS 4
+#define TEST_COMBINING_KEYS 1000
+
+static int test_coolhash_combining_vals[TEST_COMBINING_KEYS];
+
+static void *test_coolhash_combining_thread(void *arg)
+{
+        struct coolhash *ch;
+        int i, cpy;
+
+        ch = arg;
+        for (i = 0; i < TEST_COMBINING_KEYS; i++) {
+                coolhash_set(ch, i, &test_coolhash_combining_vals[i]);
+                coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+        }
+
+        return NULL;
+}
+
+START_TEST(test_coolhash_combining)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        pthread_t threads[TEST_COMBINING_THREADS];
+        int i, res, cpy;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_shards(&profile, 2);
+        coolhash_profile_set_combining(&profile, TEST_COMBINING_THREADS);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_uint_eq(coolhash_profile_get_combining(&ch->profile),
+                        TEST_COMBINING_THREADS);
+
+        for (i = 0; i < TEST_COMBINING_KEYS; i++)
+                test_coolhash_combining_vals[i] = i;
+
+        for (i = 0; i < TEST_COMBINING_THREADS; i++)
+                pthread_create(&threads[i], NULL,
+                                test_coolhash_combining_thread, ch);
+        for (i = 0; i < TEST_COMBINING_THREADS; i++)
+                pthread_join(threads[i], NULL);
+
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n,
+                        TEST_COMBINING_KEYS);
+        for (i = 0; i < TEST_COMBINING_KEYS; i++) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(cpy, i);
+        }
+
+        coolhash_free(ch);
+}
+END_TEST
+
+static void test_coolhash_maint_wait(struct coolhash_table *table,
+                unsigned int size, unsigned int tombs)
+{
+        int i;
+
+        /* Give the maintenance thread up to a second */
+        for (i = 0; i < 1000; i++) {
+                pthread_mutex_lock(&table->table_mx);
+                if (table->size == size && table->tombs == tombs) {
+                        pthread_mutex_unlock(&table->table_mx);
+                        return;
+                }
+                pthread_mutex_unlock(&table->table_mx);
+                usleep(1000);
+        }
+}
+
+START_TEST(test_coolhash_maint)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        int i, res, cpy, vals[16];
+        int *data;
+        void *lock;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_size(&profile, 4);
+        coolhash_profile_set_shards(&profile, 1);
+        coolhash_profile_set_maint(&profile, 1);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_int_eq(coolhash_profile_get_maint(&ch->profile), 1);
+
+        /* 5 items cross the grow threshold (3) but stay under the point
+         * where coolhash_set would grow the table itself (6) */
+        for (i = 0; i < 5; i++) {
+                vals[i] = i;
+                res = coolhash_set(ch, i, &vals[i]);
+                ck_assert_int_eq(res, 0);
+        }
+
+        test_coolhash_maint_wait(&ch->tables[0], 8, 0);
+        ck_assert_uint_eq(ch->tables[0].size, 8);
+
+        for (i = 0; i < 5; i++) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(cpy, i);
+        }
+
+        /* Deleting leaves tombstones for the thread to clean up */
+        for (i = 0; i < 4; i++) {
+                data = coolhash_get(ch, i, &lock);
+                ck_assert_ptr_ne(data, NULL);
+                coolhash_del(ch, lock);
+        }
+
+        test_coolhash_maint_wait(&ch->tables[0], 8, 0);
+        ck_assert_uint_eq(ch->tables[0].size, 8);
+        ck_assert_uint_eq(ch->tables[0].tombs, 0);
+        ck_assert_uint_eq(ch->tables[0].n, 1);
+
+        res = coolhash_get_copy(ch, 4, &cpy, sizeof(cpy));
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(cpy, 4);
+
+        /* Dropping below the shrink threshold shrinks it back down */
+        data = coolhash_get(ch, 4, &lock);
+        ck_assert_ptr_ne(data, NULL);
+        coolhash_del(ch, lock);
+
+        test_coolhash_maint_wait(&ch->tables[0], 4, 0);
+        ck_assert_uint_eq(ch->tables[0].size, 4);
+        ck_assert_uint_eq(ch->tables[0].tombs, 0);
+
+        coolhash_free(ch);
+}
+END_TEST
+
+static void test_coolhash_changelog_cb(coolhash_key_t key, void *data,
+                void *cb_arg)
+{
+        *((int *) cb_arg) += *((int *) data);
+}
+
+START_TEST(test_coolhash_changelog)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        struct coolhash_change changes[4];
+        int res, var1, var2, var3, sum;
+        uint64_t seq;
+        void *lock;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_shards(&profile, 1);
+        coolhash_profile_set_changelog(&profile, 4);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_uint_eq(coolhash_changelog_seq(ch, 0), 0);
+
+        var1 = 1;
+        var2 = 2;
+        var3 = 3;
+        coolhash_set(ch, 1, &var1);
+        coolhash_set(ch, 2, &var2);
+        coolhash_set(ch, 1, &var3);
+        ck_assert_ptr_ne(coolhash_get(ch, 2, &lock), NULL);
+        coolhash_del(ch, lock);
+        ck_assert_uint_eq(coolhash_changelog_seq(ch, 0), 4);
+
+        res = coolhash_changelog_read(ch, 0, 2, changes, 4);
+        ck_assert_int_eq(res, 2);
+        ck_assert_uint_eq(changes[0].seq, 3);
+        ck_assert_int_eq(changes[0].op, COOLHASH_CHANGE_SET);
+        ck_assert_uint_eq(changes[0].key, 1);
+        ck_assert_ptr_eq(changes[0].data, &var3);
+        ck_assert_uint_eq(changes[1].seq, 4);
+        ck_assert_int_eq(changes[1].op, COOLHASH_CHANGE_DEL);
+        ck_assert_uint_eq(changes[1].key, 2);
+
+        /* Up to date */
+        res = coolhash_changelog_read(ch, 0, 4, changes, 4);
+        ck_assert_int_eq(res, 0);
+
+        /* Push the first change out of the ring */
+        coolhash_set(ch, 3, &var3);
+        res = coolhash_changelog_read(ch, 0, 0, changes, 4);
+        ck_assert_int_eq(res, -ERANGE);
+
+        /* Catch up with a snapshot, then follow the log again */
+        sum = 0;
+        res = coolhash_changelog_snapshot(ch, 0, test_coolhash_changelog_cb,
+                        &sum, &seq);
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(sum, 6);
+        ck_assert_uint_eq(seq, 5);
+
+        coolhash_set(ch, 2, &var2);
+        res = coolhash_changelog_read(ch, 0, seq, changes, 4);
+        ck_assert_int_eq(res, 1);
+        ck_assert_uint_eq(changes[0].seq, 6);
+        ck_assert_uint_eq(changes[0].key, 2);
+
+        coolhash_free(ch);
+}
+END_TEST
+
+START_TEST(test_coolhash_compact)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        struct coolhash_mem mem;
+        int i, res, cpy, vals[64];
+        void *lock;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_size(&profile, 4);
+        coolhash_profile_set_shards(&profile, 1);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+
+        for (i = 0; i < 64; i++) {
+                vals[i] = i;
+                res = coolhash_set(ch, i, &vals[i]);
+                ck_assert_int_eq(res, 0);
+        }
+        ck_assert_uint_eq(ch->tables[0].size, 128);
+
+        /* Delete all but 21 (just above the shrink threshold), leaving
+         * tombstones behind */
+        for (i = 21; i < 64; i++) {
+                ck_assert_ptr_ne(coolhash_get(ch, i, &lock), NULL);
+                coolhash_del(ch, lock);
+        }
+
+        res = coolhash_mem(ch, 0, &mem);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(mem.buckets, ch->tables[0].size * sizeof(void *));
+        ck_assert_uint_eq(mem.tombstones,
+                        ch->tables[0].tombs * sizeof(struct coolhash_node));
+        ck_assert_uint_eq(ch->tables[0].tombs, 43);
+        ck_assert_uint_eq(mem.slack, 0);
+
+        res = coolhash_compact(ch, 0);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(ch->tables[0].size, 27); /* 21 items at 80% */
+        ck_assert_uint_eq(ch->tables[0].tombs, 0);
+        ck_assert_ptr_ne(ch->tables[0].slabs, NULL);
+        ck_assert_uint_eq(ch->tables[0].slabs->used, 21);
+
+        res = coolhash_mem(ch, 0, &mem);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(mem.buckets, 27 * sizeof(void *));
+        ck_assert_uint_eq(mem.tombstones, 0);
+
+        for (i = 0; i < 21; i++) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(cpy, i);
+        }
+
+        /* Slab nodes get recycled through the free list */
+        ck_assert_ptr_ne(coolhash_get(ch, 0, &lock), NULL);
+        coolhash_del(ch, lock);
+        res = coolhash_compact(ch, 0);
+        ck_assert_int_eq(res, 0);
+        res = coolhash_set(ch, 0, &vals[0]);
+        ck_assert_int_eq(res, 0);
+        res = coolhash_get_copy(ch, 0, &cpy, sizeof(cpy));
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(cpy, 0);
+
+        coolhash_free(ch);
+}
+END_TEST
+
+START_TEST(test_coolhash_tmpl)
+{
+        struct tmpl_spin *t;
+        struct tmpl_none *u;
+        struct tmpl_signed *v;
+        int i, res, val;
+        double d;
+
+        t = tmpl_spin_new(16);
+        ck_assert_ptr_ne(t, NULL);
+        ck_assert_uint_eq((uintptr_t) t % 64, 0);
+        ck_assert_uint_eq(t->tables[0].mask, 3);
+
+        /* 4 shards of 4 buckets, so 16 items in one shard double it three
+         * times (4 -> 8 -> 16 -> 32) */
+        for (i = 0; i < 64; i++) {
+                res = tmpl_spin_set(t, i, &i);
+                ck_assert_int_eq(res, 0);
+        }
+        ck_assert_uint_eq(tmpl_spin_count(t), 64);
+        ck_assert_uint_eq(t->tables[0].mask, 31);
+
+        for (i = 0; i < 64; i++) {
+                res = tmpl_spin_get_copy(t, i, &val);
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(val, i);
+        }
+
+        val = 100;
+        res = tmpl_spin_set(t, 5, &val);
+        ck_assert_int_eq(res, 0);
+        res = tmpl_spin_get_copy(t, 5, &val);
+        ck_assert_int_eq(val, 100);
+
+        res = tmpl_spin_del(t, 5);
+        ck_assert_int_eq(res, 0);
+        res = tmpl_spin_del(t, 5);
+        ck_assert_int_ne(res, 0);
+        res = tmpl_spin_get_copy(t, 5, &val);
+        ck_assert_int_ne(res, 0);
+        ck_assert_uint_eq(tmpl_spin_count(t), 63);
+
+        tmpl_spin_free(t);
+
+        /* Defaults: 64-bit keys, 2 shards */
+        u = tmpl_none_new(0);
+        ck_assert_ptr_ne(u, NULL);
+        d = 1.5;
+        res = tmpl_none_set(u, (uint64_t) 1 << 40, &d);
+        ck_assert_int_eq(res, 0);
+        d = 0;
+        res = tmpl_none_get_copy(u, (uint64_t) 1 << 40, &d);
+        ck_assert_int_eq(res, 0);
+        ck_assert(d == 1.5);
+        tmpl_none_free(u);
+
+        /* Negative keys stay inside the shard and bucket arrays */
+        v = tmpl_signed_new(0);
+        ck_assert_ptr_ne(v, NULL);
+        for (i = -32; i < 32; i++) {
+                res = tmpl_signed_set(v, i, &i);
+                ck_assert_int_eq(res, 0);
+        }
+        for (i = -32; i < 32; i++) {
+                res = tmpl_signed_get_copy(v, i, &val);
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(val, i);
+        }
+        res = tmpl_signed_del(v, -7);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(tmpl_signed_count(v), 63);
+        tmpl_signed_free(v);
+}
+END_TEST
+
+START_TEST(test_coolhash_hugepages)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        struct coolhash_mem mem;
+        int i, res;
+        void *lock;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_size(&profile, 4);
+        coolhash_profile_set_shards(&profile, 1);
+        coolhash_profile_set_hugepages(&profile, 1);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_int_eq(coolhash_profile_get_hugepages(&ch->profile), 1);
+
+        /* A small shard starts out with a small, malloc'd slab */
+        res = coolhash_set(ch, 1, (void *) (intptr_t) 1);
+        ck_assert_int_eq(res, 0);
+        ck_assert_ptr_ne(ch->tables[0].slabs, NULL);
+        ck_assert_uint_lt(ch->tables[0].slabs->len, 1024 * 1024);
+
+        /* Enough to push the bucket array past 1MB; the data pointer is
+         * just the key, we only ever copy it back out */
+        for (i = 2; i <= 200000; i++) {
+                res = coolhash_set(ch, i, (void *) (intptr_t) i);
+                ck_assert_int_eq(res, 0);
+        }
+        ck_assert_uint_ge(ch->tables[0].size * sizeof(void *), 1024 * 1024);
+        ck_assert_ptr_ne(ch->tables[0].slabs, NULL);
+        ck_assert_ptr_ne(ch->tables[0].slabs->next, NULL);
+        ck_assert_uint_ge(ch->tables[0].slabs->len, 1024 * 1024);
+
+        /* Mapped sizes are reported, whole hugepages */
+        res = coolhash_mem(ch, 0, &mem);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(mem.buckets % (2 * 1024 * 1024), 0);
+        ck_assert_uint_ge(mem.buckets, ch->tables[0].size * sizeof(void *));
+        ck_assert_uint_ge(mem.slack, 2 * 1024 * 1024 -
+                        ch->tables[0].slabs->len);
+
+        ck_assert_ptr_ne(coolhash_get(ch, 7, &lock), NULL);
+        coolhash_del(ch, lock);
+        ck_assert_ptr_eq(coolhash_get(ch, 7, &lock), NULL);
+
+        for (i = 8; i <= 200000; i += 997) {
+                ck_assert_ptr_eq(coolhash_get(ch, i, &lock),
+                                (void *) (intptr_t) i);
+                coolhash_unlock(ch, lock);
+        }
+
+        /* Compaction moves everything into one hugepage-backed slab */
+        res = coolhash_compact(ch, 0);
+        ck_assert_int_eq(res, 0);
+        ck_assert_ptr_eq(ch->tables[0].slabs->next, NULL);
+        ck_assert_ptr_eq(coolhash_get(ch, 200000, &lock),
+                        (void *) (intptr_t) 200000);
+        coolhash_unlock(ch, lock);
+
+        coolhash_free(ch);
+}
+END_TEST
+
+/* Internal, but exported from the library */
+int _coolhash_bloom_maybe(struct coolhash_table *table, coolhash_key_t key);
+
+START_TEST(test_coolhash_bloom)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        int i, res, cpy, vals[32], misses;
+        void *lock;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_size(&profile, 8);
+        coolhash_profile_set_shards(&profile, 2);
+        coolhash_profile_set_bloom_bits(&profile, 16);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_uint_eq(coolhash_profile_get_bloom_bits(&ch->profile), 16);
+        ck_assert_ptr_ne(ch->tables[0].bloom, NULL);
+
+        for (i = 0; i < 32; i++) {
+                vals[i] = i;
+                res = coolhash_set(ch, i, &vals[i]);
+                ck_assert_int_eq(res, 0);
+        }
+
+        /* No false negatives, before or after the filters were resized */
+        for (i = 0; i < 32; i++) {
+                ck_assert_int_ne(_coolhash_bloom_maybe(
+                                        &ch->tables[i % 2], i), 0);
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(cpy, i);
+        }
+        ck_assert_ptr_ne(ch->tables[0].bloom->next, NULL);
+
+        /* Most absent keys are turned away by the filter alone */
+        misses = 0;
+        for (i = 1000; i < 2000; i++) {
+                if (!_coolhash_bloom_maybe(&ch->tables[i % 2], i))
+                        misses++;
+                ck_assert_ptr_eq(coolhash_get(ch, i, &lock), NULL);
+        }
+        ck_assert_int_gt(misses, 900);
+
+        /* Compaction drops deleted keys from the filter */
+        for (i = 0; i < 32; i += 2) {
+                ck_assert_ptr_ne(coolhash_get(ch, i, &lock), NULL);
+                coolhash_del(ch, lock);
+        }
+        res = coolhash_compact(ch, 0);
+        ck_assert_int_eq(res, 0);
+        misses = 0;
+        for (i = 0; i < 32; i += 2) {
+                if (!_coolhash_bloom_maybe(&ch->tables[0], i))
+                        misses++;
+        }
+        ck_assert_int_gt(misses, 12);
+        for (i = 1; i < 32; i += 2) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+        }
+
+        coolhash_free(ch);
+}
+END_TEST
+
+#define TEST_CUCKOO_THREADS 4
+#define TEST_CUCKOO_KEYS 4000
+
+static int test_coolhash_cuckoo_vals[TEST_CUCKOO_KEYS];
+
+static void *test_coolhash_cuckoo_thread(void *arg)
+{
+        struct coolhash *ch;
+        int i, cpy;
+
+        ch = arg;
+        for (i = 0; i < TEST_CUCKOO_KEYS; i++) {
+                coolhash_set(ch, i, &test_coolhash_cuckoo_vals[i]);
+                if (coolhash_get_copy(ch, i / 2, &cpy, sizeof(cpy)) == 0 &&
+                                cpy != i / 2)
+                        return arg; /* Torn or misplaced read */
+        }
+
+        return NULL;
+}
+
+static struct coolhash *test_coolhash_cuckoo_ch;
+
+struct test_cuckoo_churn {
+        struct coolhash *ch;
+        int writer; /* Owns keys with key % 2 == writer - 1 */
+};
+
+/* Writers free what they delete, so a reader copying from a pointer it has
+ * not locked would read freed memory (caught by -fsanitize=address) */
+static void *test_coolhash_cuckoo_churn_thread(void *arg)
+{
+        struct test_cuckoo_churn *churn;
+        int i, k, cpy, *data;
+        void *lock;
+
+        churn = arg;
+        for (i = 0; i < 20000; i++) {
+                k = i % 64;
+                if (!churn->writer) {
+                        if (coolhash_get_copy(churn->ch, k, &cpy,
+                                                sizeof(cpy)) == 0 && cpy != k)
+                                return arg;
+                        continue;
+                }
+                if (k % 2 != churn->writer - 1)
+                        continue;
+
+                data = coolhash_get(churn->ch, k, &lock);
+                if (data) {
+                        free(data);
+                        coolhash_del(churn->ch, lock);
+                }
+                data = malloc(sizeof(*data));
+                *data = k;
+                coolhash_set(churn->ch, k, data);
+        }
+
+        return NULL;
+}
+
+/* Copies key 'arg' and returns the CPU time that took, in microseconds */
+static void *test_coolhash_cuckoo_wait_thread(void *arg)
+{
+        struct timespec t0, t1;
+        int cpy;
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+        if (coolhash_get_copy(test_coolhash_cuckoo_ch, (intptr_t) arg, &cpy,
+                                sizeof(cpy)) != 0 || cpy != (intptr_t) arg)
+                return (void *) (intptr_t) -1;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+        return (void *) (intptr_t) ((t1.tv_sec - t0.tv_sec) * 1000000 +
+                        (t1.tv_nsec - t0.tv_nsec) / 1000);
+}
+
+static void test_coolhash_cuckoo_free_cb(void *data, void *cb_arg)
+{
+        free(data);
+}
+
+static void test_coolhash_cuckoo_foreach_cb(struct coolhash *ch,
+                coolhash_key_t key, void *data, void *lock, void *cb_arg)
+{
+        *((int *) cb_arg) += *((int *) data);
+        if (key == 3)
+                coolhash_del(ch, lock);
+        else
+                coolhash_unlock(ch, lock);
+}
+
+START_TEST(test_coolhash_cuckoo)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        struct coolhash_mem mem;
+        pthread_t threads[TEST_CUCKOO_THREADS];
+        struct test_cuckoo_churn churn[TEST_CUCKOO_THREADS];
+        struct coolhash_cuckoo *ck, *cks[2];
+        struct coolhash_cuckoo_bucket *bucket;
+        int i, j, res, cpy, sum, vals[64];
+        int *data;
+        void *lock, *ret;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_size(&profile, 16);
+        coolhash_profile_set_shards(&profile, 2);
+        coolhash_profile_set_bloom_bits(&profile, 8);
+        coolhash_profile_set_engine(&profile, COOLHASH_ENGINE_CUCKOO);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_int_eq(coolhash_profile_get_engine(&ch->profile),
+                        COOLHASH_ENGINE_CUCKOO);
+        ck_assert_uint_eq(coolhash_profile_get_bloom_bits(&ch->profile), 0);
+        ck_assert_uint_eq(ch->tables[0].cuckoo->mask, 3);
+        ck_assert_uint_eq(sizeof(struct coolhash_cuckoo_bucket), 64);
+
+        /* Way past 4 buckets of 3 per shard, so items get moved around and
+         * the bucket arrays grow */
+        for (i = 0; i < 64; i++) {
+                vals[i] = i;
+                res = coolhash_set(ch, i, &vals[i]);
+                ck_assert_int_eq(res, 0);
+        }
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n, 64);
+        ck_assert_uint_gt(ch->tables[0].cuckoo->mask, 3);
+        ck_assert_ptr_ne(ch->tables[0].cuckoo->next, NULL);
+
+        for (i = 0; i < 64; i++) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(cpy, i);
+        }
+        res = coolhash_get_copy(ch, 1000, &cpy, sizeof(cpy));
+        ck_assert_int_ne(res, 0);
+
+        /* Replace, then delete through the lock */
+        res = coolhash_set(ch, 5, &vals[6]);
+        ck_assert_int_eq(res, 0);
+        data = coolhash_get(ch, 5, &lock);
+        ck_assert_ptr_eq(data, &vals[6]);
+        coolhash_del(ch, lock);
+        ck_assert_ptr_eq(coolhash_get(ch, 5, &lock), NULL);
+        data = coolhash_get_ro(ch, 6, &lock);
+        ck_assert_ptr_eq(data, &vals[6]);
+        coolhash_unlock(ch, lock);
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n, 63);
+
+        /* A held item only holds up its own key: a reader of another key in
+         * the bucket goes right through, and one of the same key sleeps */
+        test_coolhash_cuckoo_ch = ch;
+        data = coolhash_get(ch, 6, &lock);
+        ck_assert_ptr_eq(data, &vals[6]);
+        bucket = (struct coolhash_cuckoo_bucket *) ((uintptr_t) lock &
+                        ~(uintptr_t) 63);
+        for (i = 0; i < COOLHASH_CUCKOO_SLOTS; i++) {
+                if (bucket->data[i] && &bucket->data[i] != lock)
+                        break;
+        }
+        ck_assert_int_lt(i, COOLHASH_CUCKOO_SLOTS);
+        pthread_create(&threads[0], NULL, test_coolhash_cuckoo_wait_thread,
+                        (void *) (intptr_t) bucket->keys[i]);
+        pthread_join(threads[0], &ret);
+        ck_assert_int_ge((intptr_t) ret, 0);
+        pthread_create(&threads[0], NULL, test_coolhash_cuckoo_wait_thread,
+                        (void *) (intptr_t) 6);
+        usleep(200000);
+        ck_assert_uint_eq(__atomic_load_n(&bucket->locks[(void **) lock -
+                                bucket->data], __ATOMIC_RELAXED),
+                        COOLHASH_CUCKOO_WRITER | COOLHASH_CUCKOO_WAITERS);
+        ck_assert_uint_eq(bucket->version % 2, 0);
+        coolhash_unlock(ch, lock);
+        pthread_join(threads[0], &ret);
+        ck_assert_int_ge((intptr_t) ret, 0);
+        ck_assert_int_lt((intptr_t) ret, 50000);
+
+        /* Items held while their shard grows are handed over to the new
+         * bucket array */
+        data = coolhash_get(ch, 6, &lock);
+        ck_assert_ptr_eq(data, &vals[6]);
+        cks[0] = ch->tables[0].cuckoo;
+        cks[1] = ch->tables[1].cuckoo;
+        for (i = 64; i < 256; i++) {
+                res = coolhash_set(ch, i, &vals[i % 64]);
+                ck_assert_int_eq(res, 0);
+        }
+        ck_assert_ptr_ne(ch->tables[0].cuckoo, cks[0]);
+        ck_assert_ptr_ne(ch->tables[1].cuckoo, cks[1]);
+        for (i = 0, res = 0; i < 2; i++) {
+                ck = ch->tables[i].cuckoo;
+                for (j = 0; j < (int) (ck->mask + 1) *
+                                COOLHASH_CUCKOO_SLOTS; j++) {
+                        bucket = &ck->buckets[j / COOLHASH_CUCKOO_SLOTS];
+                        if (bucket->data[j % COOLHASH_CUCKOO_SLOTS] &&
+                                        bucket->keys[j %
+                                        COOLHASH_CUCKOO_SLOTS] == 6) {
+                                ck_assert_uint_eq(bucket->locks[j %
+                                                COOLHASH_CUCKOO_SLOTS],
+                                                COOLHASH_CUCKOO_WRITER);
+                                res++;
+                        }
+                }
+        }
+        ck_assert_int_eq(res, 1);
+        coolhash_del(ch, lock);
+        ck_assert_int_ne(coolhash_get_copy(ch, 6, &cpy, sizeof(cpy)), 0);
+        for (i = 64; i < 256; i++) {
+                ck_assert_ptr_ne(coolhash_get(ch, i, &lock), NULL);
+                coolhash_del(ch, lock);
+        }
+        res = coolhash_set(ch, 6, &vals[6]);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n, 63);
+
+        /* 0..63 without 5, and key 3 deleted from the callback */
+        sum = 0;
+        coolhash_foreach(ch, test_coolhash_cuckoo_foreach_cb, &sum);
+        ck_assert_int_eq(sum, 63 * 64 / 2 - 5);
+        ck_assert_ptr_eq(coolhash_get(ch, 3, &lock), NULL);
+
+        res = coolhash_mem(ch, 0, &mem);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(mem.buckets, sizeof(struct coolhash_cuckoo) +
+                        (ch->tables[0].cuckoo->mask + 1) *
+                        sizeof(struct coolhash_cuckoo_bucket));
+        ck_assert_int_eq(coolhash_compact(ch, 0), 0);
+
+        coolhash_free(ch);
+
+        /* Lock-free readers racing writers that keep moving items */
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+
+        for (i = 0; i < TEST_CUCKOO_KEYS; i++)
+                test_coolhash_cuckoo_vals[i] = i;
+
+        for (i = 0; i < TEST_CUCKOO_THREADS; i++)
+                pthread_create(&threads[i], NULL,
+                                test_coolhash_cuckoo_thread, ch);
+        for (i = 0; i < TEST_CUCKOO_THREADS; i++) {
+                pthread_join(threads[i], &ret);
+                ck_assert_ptr_eq(ret, NULL);
+        }
+
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n,
+                        TEST_CUCKOO_KEYS);
+        for (i = 0; i < TEST_CUCKOO_KEYS; i++) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(cpy, i);
+        }
+
+        coolhash_free(ch);
+
+        /* Readers racing writers that free deleted items */
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+
+        for (i = 0; i < TEST_CUCKOO_THREADS; i++) {
+                churn[i].ch = ch;
+                churn[i].writer = i < 2 ? i + 1 : 0;
+                pthread_create(&threads[i], NULL,
+                                test_coolhash_cuckoo_churn_thread, &churn[i]);
+        }
+        for (i = 0; i < TEST_CUCKOO_THREADS; i++) {
+                pthread_join(threads[i], &ret);
+                ck_assert_ptr_eq(ret, NULL);
+        }
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n, 64);
+
+        coolhash_free_foreach(ch, test_coolhash_cuckoo_free_cb, NULL);
+}
+END_TEST
+
+static struct coolhash *test_coolhash_trylock_ch;
+
+static void *test_coolhash_trylock_thread(void *arg)
+{
+        struct timespec abstime;
+        void *data, *lock;
+        intptr_t res;
+
+        switch ((intptr_t) arg) {
+        case 0:
+                res = coolhash_try_get(test_coolhash_trylock_ch, 1, &data,
+                                &lock);
+                break;
+        case 1:
+                res = coolhash_try_set(test_coolhash_trylock_ch, 1, &data);
+                break;
+        case 2:
+                clock_gettime(CLOCK_REALTIME, &abstime);
+                abstime.tv_nsec += 10000000;
+                if (abstime.tv_nsec >= 1000000000) {
+                        abstime.tv_sec++;
+                        abstime.tv_nsec -= 1000000000;
+                }
+                res = coolhash_timed_get(test_coolhash_trylock_ch, 1, &data,
+                                &lock, &abstime);
+                break;
+        default:
+                res = coolhash_try_get_ro(test_coolhash_trylock_ch, 1, &data,
+                                &lock);
+                if (res == 0)
+                        coolhash_unlock(test_coolhash_trylock_ch, lock);
+                break;
+        }
+
+        return (void *) res;
+}
+
+static intptr_t test_coolhash_trylock_run(intptr_t op)
+{
+        pthread_t thread;
+        void *ret;
+
+        pthread_create(&thread, NULL, test_coolhash_trylock_thread,
+                        (void *) op);
+        pthread_join(thread, &ret);
+
+        return (intptr_t) ret;
+}
+
+START_TEST(test_coolhash_trylock)
+{
+        struct coolhash_profile profile;
+        struct timespec abstime;
+        int engine, res, var1, *data;
+        void *lock;
+
+        for (engine = COOLHASH_ENGINE_CHAIN; engine <= COOLHASH_ENGINE_CUCKOO;
+                        engine++) {
+                coolhash_profile_init(&profile);
+                coolhash_profile_set_engine(&profile, engine);
+                test_coolhash_trylock_ch = coolhash_new(&profile);
+                ck_assert_ptr_ne(test_coolhash_trylock_ch, NULL);
+
+                var1 = 1;
+                res = coolhash_try_set(test_coolhash_trylock_ch, 1, &var1);
+                ck_assert_int_eq(res, 0);
+                res = coolhash_try_get(test_coolhash_trylock_ch, 2,
+                                (void **) &data, &lock);
+                ck_assert_int_eq(res, -1);
+
+                /* While we hold the item, nobody else waits for it */
+                res = coolhash_try_get(test_coolhash_trylock_ch, 1,
+                                (void **) &data, &lock);
+                ck_assert_int_eq(res, 0);
+                ck_assert_ptr_eq(data, &var1);
+
+                ck_assert_int_eq(test_coolhash_trylock_run(0), -EBUSY);
+                ck_assert_int_eq(test_coolhash_trylock_run(1), -EBUSY);
+                ck_assert_int_eq(test_coolhash_trylock_run(2), -ETIMEDOUT);
+
+                res = coolhash_try_del(test_coolhash_trylock_ch, lock);
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(test_coolhash_trylock_run(0), -1);
+
+                /* Read-only holders share */
+                clock_gettime(CLOCK_REALTIME, &abstime);
+                abstime.tv_sec++;
+                res = coolhash_timed_set(test_coolhash_trylock_ch, 1, &var1,
+                                &abstime);
+                ck_assert_int_eq(res, 0);
+                res = coolhash_timed_get_ro(test_coolhash_trylock_ch, 1,
+                                (void **) &data, &lock, &abstime);
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(test_coolhash_trylock_run(3), 0);
+                coolhash_unlock(test_coolhash_trylock_ch, lock);
+
+                coolhash_free(test_coolhash_trylock_ch);
+        }
+}
+END_TEST
+
+#define TEST_BATCH_KEYS 300
+
+static struct coolhash *test_coolhash_batch_ch;
+static coolhash_key_t test_coolhash_batch_keys[TEST_BATCH_KEYS];
+static int test_coolhash_batch_out[TEST_BATCH_KEYS];
+static int test_coolhash_batch_results[TEST_BATCH_KEYS];
+
+static void *test_coolhash_batch_thread(void *arg)
+{
+        return (void *) (intptr_t) coolhash_get_copy_batch(
+                        test_coolhash_batch_ch, test_coolhash_batch_keys,
+                        TEST_BATCH_KEYS, test_coolhash_batch_out,
+                        sizeof(*test_coolhash_batch_out),
+                        test_coolhash_batch_results);
+}
+
+START_TEST(test_coolhash_batch)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        coolhash_key_t *keys;
+        pthread_t thread;
+        int i, engine, res, vals[TEST_BATCH_KEYS];
+        int *out, *results;
+        void *lock, *ret;
+
+        keys = test_coolhash_batch_keys;
+        out = test_coolhash_batch_out;
+        results = test_coolhash_batch_results;
+
+        for (engine = COOLHASH_ENGINE_CHAIN; engine <= COOLHASH_ENGINE_CUCKOO;
+                        engine++) {
+                coolhash_profile_init(&profile);
+                coolhash_profile_set_shards(&profile, 3);
+                coolhash_profile_set_size(&profile, 3);
+                coolhash_profile_set_load_factor(&profile, 400); /* Chains */
+                coolhash_profile_set_bloom_bits(&profile, engine ? 0 : 8);
+                coolhash_profile_set_engine(&profile, engine);
+
+                ch = coolhash_new(&profile);
+                ck_assert_ptr_ne(ch, NULL);
+
+                /* Even keys are present, and 10 of them deleted again */
+                for (i = 0; i < TEST_BATCH_KEYS; i++) {
+                        vals[i] = i;
+                        keys[i] = (coolhash_key_t) (TEST_BATCH_KEYS - 1 - i);
+                        if (i % 2 == 0) {
+                                res = coolhash_set(ch, i, &vals[i]);
+                                ck_assert_int_eq(res, 0);
+                        }
+                }
+                for (i = 0; i < 20; i += 2) {
+                        ck_assert_ptr_ne(coolhash_get(ch, i, &lock), NULL);
+                        coolhash_del(ch, lock);
+                }
+
+                memset(out, 0xff, TEST_BATCH_KEYS * sizeof(*out));
+                res = coolhash_get_copy_batch(ch, keys, TEST_BATCH_KEYS, out,
+                                sizeof(*out), results);
+                ck_assert_int_eq(res, TEST_BATCH_KEYS / 2 - 10);
+                for (i = 0; i < TEST_BATCH_KEYS; i++) {
+                        if (keys[i] % 2 == 0 && keys[i] >= 20) {
+                                ck_assert_int_eq(results[i], 0);
+                                ck_assert_int_eq(out[i], (int) keys[i]);
+                        } else {
+                                ck_assert_int_eq(results[i], -1);
+                                ck_assert_int_eq(out[i], -1);
+                        }
+                }
+
+                res = coolhash_get_copy_batch(ch, keys, 0, out, sizeof(*out),
+                                NULL);
+                ck_assert_int_eq(res, 0);
+
+                /* A held item is tried, then waited for on its own once
+                 * the rest of its shard's keys are done */
+                ck_assert_ptr_ne(coolhash_get(ch, 22, &lock), NULL);
+                test_coolhash_batch_ch = ch;
+                memset(out, 0xff, TEST_BATCH_KEYS * sizeof(*out));
+                pthread_create(&thread, NULL, test_coolhash_batch_thread,
+                                NULL);
+                usleep(100000);
+                coolhash_unlock(ch, lock);
+                pthread_join(thread, &ret);
+                ck_assert_int_eq((intptr_t) ret, TEST_BATCH_KEYS / 2 - 10);
+                ck_assert_int_eq(results[TEST_BATCH_KEYS - 1 - 22], 0);
+                ck_assert_int_eq(out[TEST_BATCH_KEYS - 1 - 22], 22);
+
+                coolhash_free(ch);
+        }
+}
+END_TEST
+
+static void test_coolhash_snapshot_cb(coolhash_key_t key, void *data,
+                void *cb_arg)
+{
+        int *sums;
+
+        sums = cb_arg;
+        sums[0]++;
+        sums[1] += *((int *) data);
+}
+
+START_TEST(test_coolhash_snapshot)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        struct coolhash_snapshot *snap, *snap2;
+        int i, engine, res, vals[32], sums[2];
+        void *lock;
+
+        for (engine = COOLHASH_ENGINE_CHAIN; engine <= COOLHASH_ENGINE_CUCKOO;
+                        engine++) {
+                coolhash_profile_init(&profile);
+                coolhash_profile_set_shards(&profile, 4);
+                coolhash_profile_set_engine(&profile, engine);
+
+                ch = coolhash_new(&profile);
+                ck_assert_ptr_ne(ch, NULL);
+
+                for (i = 0; i < 16; i++) {
+                        vals[i] = i;
+                        res = coolhash_set(ch, i, &vals[i]);
+                        ck_assert_int_eq(res, 0);
+                }
+
+                snap = coolhash_snapshot_new(ch);
+                ck_assert_ptr_ne(snap, NULL);
+
+                /* Writes after the snapshot, to some of the shards */
+                for (i = 16; i < 32; i++) {
+                        vals[i] = i;
+                        res = coolhash_set(ch, i, &vals[i]);
+                        ck_assert_int_eq(res, 0);
+                }
+                ck_assert_ptr_ne(coolhash_get(ch, 1, &lock), NULL);
+                coolhash_del(ch, lock);
+                res = coolhash_set(ch, 2, &vals[30]);
+                ck_assert_int_eq(res, 0);
+
+                snap2 = coolhash_snapshot_new(ch);
+                ck_assert_ptr_ne(snap2, NULL);
+
+                sums[0] = sums[1] = 0;
+                res = coolhash_snapshot_foreach(snap, test_coolhash_snapshot_cb,
+                                sums);
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(sums[0], 16);
+                ck_assert_int_eq(sums[1], 15 * 16 / 2);
+
+                /* Closed without ever being read */
+                coolhash_snapshot_free(snap2);
+
+                /* A later snapshot sees the later writes */
+                snap2 = coolhash_snapshot_new(ch);
+                ck_assert_ptr_ne(snap2, NULL);
+                ck_assert_ptr_ne(coolhash_get(ch, 0, &lock), NULL);
+                coolhash_del(ch, lock);
+                sums[0] = sums[1] = 0;
+                res = coolhash_snapshot_foreach(snap2,
+                                test_coolhash_snapshot_cb, sums);
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(sums[0], 31);
+                ck_assert_int_eq(sums[1], 31 * 32 / 2 - 1 - 2 + 30);
+
+                coolhash_snapshot_free(snap);
+                coolhash_snapshot_free(snap2);
+                coolhash_free(ch);
+        }
+}
+END_TEST
+
+static void test_coolhash_index_cb(struct coolhash *ch, coolhash_key_t key,
+                void *data, void *lock, void *cb_arg)
+{
+        int *sums;
+
+        sums = cb_arg;
+        sums[0] += key >> 32 == 7 ? 1 : 1000; /* Other tenants count big */
+        sums[1] += *((int *) data);
+        coolhash_unlock(ch, lock);
+}
+
+START_TEST(test_coolhash_index)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        coolhash_key_t tenant;
+        int i, res, vals[100], sums[2];
+        void *lock;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_shards(&profile, 4);
+        coolhash_profile_set_index(&profile, 1);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_int_eq(coolhash_profile_get_index(&ch->profile), 1);
+
+        /* Tenant in the high 32 bits, object in the low */
+        for (i = 0; i < 100; i++) {
+                vals[i] = i;
+                tenant = (coolhash_key_t) (i % 10) << 32;
+                res = coolhash_set(ch, tenant | (coolhash_key_t) i, &vals[i]);
+                ck_assert_int_eq(res, 0);
+        }
+        res = coolhash_set(ch, ((coolhash_key_t) 7 << 32) | 7, &vals[7]);
+        ck_assert_int_eq(res, 0);
+
+        /* Tenant 7 has objects 7, 17, ..., 97 */
+        tenant = (coolhash_key_t) 7 << 32;
+        sums[0] = sums[1] = 0;
+        res = coolhash_range_foreach(ch, tenant, tenant | 0xffffffff,
+                        test_coolhash_index_cb, sums);
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(sums[0], 10);
+        ck_assert_int_eq(sums[1], 520);
+
+        /* Deleted keys drop out; revived ones come back */
+        ck_assert_ptr_ne(coolhash_get(ch, tenant | 17, &lock), NULL);
+        coolhash_del(ch, lock);
+        ck_assert_ptr_ne(coolhash_get(ch, tenant | 27, &lock), NULL);
+        coolhash_del(ch, lock);
+        res = coolhash_set(ch, tenant | 27, &vals[27]);
+        ck_assert_int_eq(res, 0);
+
+        sums[0] = sums[1] = 0;
+        res = coolhash_range_foreach_ro(ch, tenant | 10, tenant | 50,
+                        test_coolhash_index_cb, sums);
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(sums[0], 3);
+        ck_assert_int_eq(sums[1], 27 + 37 + 47);
+        ck_assert_uint_eq(ch->tables[0].index->n + ch->tables[1].index->n +
+                        ch->tables[2].index->n + ch->tables[3].index->n, 99);
+
+        coolhash_free(ch);
+
+        /* Not without the index */
+        ch = coolhash_new(NULL);
+        ck_assert_ptr_ne(ch, NULL);
+        res = coolhash_range_foreach(ch, 0, 10, test_coolhash_index_cb, sums);
+        ck_assert_int_ne(res, 0);
+        coolhash_free(ch);
+}
+END_TEST
+
+START_TEST(test_coolhash_keyh)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        struct coolhash_keyh kh;
+        int i, res, vals[100], copy;
+        void *lock;
+        int *data;
+
+        for (i = 0; i < 100; i++)
+                vals[i] = i;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_size(&profile, 4);
+        coolhash_profile_set_shards(&profile, 1);
+        coolhash_profile_set_load_factor(&profile, 80);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+
+        /* Get, then update and delete through the same handle */
+        coolhash_keyh_init(ch, &kh, 42);
+        ck_assert_ptr_eq(coolhash_keyh_get(ch, &kh, &lock), NULL);
+        res = coolhash_keyh_set(ch, &kh, &vals[1]);
+        ck_assert_int_eq(res, 0);
+
+        data = coolhash_keyh_get(ch, &kh, &lock);
+        ck_assert_ptr_eq(data, &vals[1]);
+        coolhash_unlock(ch, lock);
+        ck_assert_ptr_ne(kh.node, NULL);
+
+        res = coolhash_keyh_set(ch, &kh, &vals[2]);
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(ch->tables[0].n, 1);
+        ck_assert_ptr_eq(coolhash_get(ch, 42, &lock), &vals[2]);
+        coolhash_unlock(ch, lock);
+
+        /* The cached node goes stale once the table is rehashed */
+        for (i = 0; i < 100; i++) {
+                res = coolhash_set(ch, 1000 + i, &vals[i]);
+                ck_assert_int_eq(res, 0);
+        }
+        ck_assert_uint_ne(kh.gen, ch->tables[0].gen);
+
+        res = coolhash_keyh_get_copy(ch, &kh, &copy, sizeof(copy));
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(copy, 2);
+        ck_assert_uint_eq(kh.gen, ch->tables[0].gen);
+
+        data = coolhash_keyh_get_ro(ch, &kh, &lock);
+        ck_assert_ptr_eq(data, &vals[2]);
+        coolhash_unlock(ch, lock);
+
+        data = coolhash_keyh_get(ch, &kh, &lock);
+        ck_assert_ptr_eq(data, &vals[2]);
+        coolhash_keyh_del(ch, &kh, lock);
+        ck_assert_ptr_eq(coolhash_keyh_get(ch, &kh, &lock), NULL);
+        ck_assert_ptr_eq(coolhash_get(ch, 42, &lock), NULL);
+
+        /* Revives the tombstone it still points at */
+        res = coolhash_keyh_set(ch, &kh, &vals[3]);
+        ck_assert_int_eq(res, 0);
+        ck_assert_ptr_eq(coolhash_get(ch, 42, &lock), &vals[3]);
+        coolhash_unlock(ch, lock);
+
+        coolhash_free(ch);
+
+        /* Cuckoo tables take handles too */
+        coolhash_profile_set_engine(&profile, COOLHASH_ENGINE_CUCKOO);
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+
+        coolhash_keyh_init(ch, &kh, 42);
+        res = coolhash_keyh_set(ch, &kh, &vals[4]);
+        ck_assert_int_eq(res, 0);
+        res = coolhash_keyh_get_copy(ch, &kh, &copy, sizeof(copy));
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(copy, 4);
+        data = coolhash_keyh_get(ch, &kh, &lock);
+        ck_assert_ptr_eq(data, &vals[4]);
+        coolhash_keyh_del(ch, &kh, lock);
+        ck_assert_ptr_eq(coolhash_keyh_get_ro(ch, &kh, &lock), NULL);
+
+        coolhash_free(ch);
+}
+END_TEST
+
+#define TEST_SMALL_THREADS 4
+#define TEST_SMALL_KEYS 1000
+
+static int test_coolhash_small_vals[TEST_SMALL_THREADS * TEST_SMALL_KEYS];
+
+static void *test_coolhash_small_thread(void *arg)
+{
+        struct coolhash *ch;
+        int i, base, cpy;
+        void *lock;
+
+        ch = test_coolhash_trylock_ch;
+        base = (int) (intptr_t) arg * TEST_SMALL_KEYS;
+
+        /* Every thread also reads and deletes keys the others write */
+        for (i = base; i < base + TEST_SMALL_KEYS; i++) {
+                if (coolhash_set(ch, i, &test_coolhash_small_vals[i]) != 0)
+                        return arg;
+                if (coolhash_get_copy(ch, i, &cpy, sizeof(cpy)) == 0 &&
+                                cpy != i)
+                        return arg; /* Unless deleted already */
+                if (coolhash_get(ch, (i + TEST_SMALL_KEYS) %
+                                        (TEST_SMALL_THREADS *
+                                         TEST_SMALL_KEYS), &lock))
+                        coolhash_del(ch, lock);
+                if (coolhash_get_ro(ch, i / 2, &lock))
+                        coolhash_unlock(ch, lock);
+        }
+
+        return NULL;
+}
+
+/* Waits for key 1 and returns the CPU time that took, in microseconds */
+static void *test_coolhash_small_wait_thread(void *arg)
+{
+        struct timespec t0, t1;
+        void *lock;
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+        if (coolhash_get(test_coolhash_trylock_ch, 1, &lock) == NULL)
+                return (void *) (intptr_t) -1;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+        coolhash_unlock(test_coolhash_trylock_ch, lock);
+
+        return (void *) (intptr_t) ((t1.tv_sec - t0.tv_sec) * 1000000 +
+                        (t1.tv_nsec - t0.tv_nsec) / 1000);
+}
+
+START_TEST(test_coolhash_small)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        struct coolhash_snapshot *snap;
+        struct coolhash_mem mem;
+        pthread_t threads[TEST_SMALL_THREADS];
+        coolhash_key_t keys[4];
+        int i, res, cpy, sum, sums[2], vals[200], out[4];
+        int *data;
+        void *lock, *ret;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_size(&profile, 16);
+        coolhash_profile_set_shards(&profile, 2);
+        coolhash_profile_set_bloom_bits(&profile, 8);
+        coolhash_profile_set_engine(&profile, COOLHASH_ENGINE_SMALL);
+
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        ck_assert_int_eq(coolhash_profile_get_engine(&ch->profile),
+                        COOLHASH_ENGINE_SMALL);
+        ck_assert_uint_eq(coolhash_profile_get_bloom_bits(&ch->profile), 0);
+        ck_assert_uint_lt(sizeof(struct coolhash_small_entry),
+                        sizeof(struct coolhash_node) / 2);
+
+        /* Keys have to fit in 32 bits */
+        res = coolhash_set(ch, (coolhash_key_t) UINT32_MAX + 1, &vals[0]);
+        ck_assert_int_ne(res, 0);
+        ck_assert_ptr_eq(coolhash_get(ch, (coolhash_key_t) UINT32_MAX + 1,
+                                &lock), NULL);
+        vals[0] = 0;
+        res = coolhash_set(ch, UINT32_MAX, &vals[0]);
+        ck_assert_int_eq(res, 0);
+        data = coolhash_get(ch, UINT32_MAX, &lock);
+        ck_assert_ptr_eq(data, &vals[0]);
+        coolhash_del(ch, lock);
+
+        /* Well past 8 buckets per shard, into a second chunk */
+        for (i = 0; i < 200; i++) {
+                vals[i] = i;
+                res = coolhash_set(ch, i, &vals[i]);
+                ck_assert_int_eq(res, 0);
+        }
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n, 200);
+        ck_assert_uint_gt(ch->tables[0].size, 8);
+
+        for (i = 0; i < 200; i++) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, 0);
+                ck_assert_int_eq(cpy, i);
+        }
+
+        /* Replace, then delete through the lock */
+        res = coolhash_set(ch, 5, &vals[6]);
+        ck_assert_int_eq(res, 0);
+        data = coolhash_get(ch, 5, &lock);
+        ck_assert_ptr_eq(data, &vals[6]);
+        coolhash_del(ch, lock);
+        ck_assert_ptr_eq(coolhash_get(ch, 5, &lock), NULL);
+        data = coolhash_get_ro(ch, 6, &lock);
+        ck_assert_ptr_eq(data, &vals[6]);
+        coolhash_unlock(ch, lock);
+
+        /* Held items make the try variants give up, readers share */
+        test_coolhash_trylock_ch = ch;
+        data = coolhash_get(ch, 1, &lock);
+        ck_assert_ptr_eq(data, &vals[1]);
+        ck_assert_int_eq(test_coolhash_trylock_run(0), -EBUSY);
+        ck_assert_int_eq(test_coolhash_trylock_run(1), -EBUSY);
+        ck_assert_int_eq(test_coolhash_trylock_run(2), -ETIMEDOUT);
+        ck_assert_int_eq(test_coolhash_trylock_run(3), -EBUSY);
+        coolhash_unlock(ch, lock);
+        data = coolhash_get_ro(ch, 1, &lock);
+        ck_assert_int_eq(test_coolhash_trylock_run(3), 0);
+        ck_assert_int_eq(test_coolhash_trylock_run(0), -EBUSY);
+        coolhash_unlock(ch, lock);
+
+        /* Waiting for a held item sleeps rather than spins */
+        data = coolhash_get(ch, 1, &lock);
+        ck_assert_ptr_eq(data, &vals[1]);
+        pthread_create(&threads[0], NULL, test_coolhash_small_wait_thread,
+                        NULL);
+        usleep(200000);
+        ck_assert_uint_eq(__atomic_load_n(&((struct coolhash_small_entry *)
+                                        lock)->lock, __ATOMIC_RELAXED),
+                        COOLHASH_SMALL_WRITER | COOLHASH_SMALL_WAITERS);
+        coolhash_unlock(ch, lock);
+        pthread_join(threads[0], &ret);
+        ck_assert_int_ge((intptr_t) ret, 0);
+        ck_assert_int_lt((intptr_t) ret, 50000);
+
+        /* 0..63 without 5, and key 3 deleted from the callback */
+        for (i = 64; i < 200; i++) {
+                ck_assert_ptr_ne(coolhash_get(ch, i, &lock), NULL);
+                coolhash_del(ch, lock);
+        }
+        sum = 0;
+        coolhash_foreach(ch, test_coolhash_cuckoo_foreach_cb, &sum);
+        ck_assert_int_eq(sum, 63 * 64 / 2 - 5);
+        ck_assert_ptr_eq(coolhash_get(ch, 3, &lock), NULL);
+        ck_assert_uint_eq(ch->tables[0].n + ch->tables[1].n, 62);
+
+        /* Freed entries are reused */
+        res = coolhash_set(ch, 1000, &vals[10]);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(ch->tables[0].small->used, 101);
+
+        sums[0] = sums[1] = 0;
+        snap = coolhash_snapshot_new(ch);
+        ck_assert_ptr_ne(snap, NULL);
+        coolhash_set(ch, 1001, &vals[11]);
+        res = coolhash_snapshot_foreach(snap, test_coolhash_snapshot_cb, sums);
+        ck_assert_int_eq(res, 0);
+        ck_assert_int_eq(sums[0], 63);
+        ck_assert_int_eq(sums[1], 63 * 64 / 2 - 5 - 3 + 10);
+        coolhash_snapshot_free(snap);
+
+        keys[0] = 7;
+        keys[1] = 3;
+        keys[2] = 1001;
+        keys[3] = (coolhash_key_t) 1 << 40;
+        res = coolhash_get_copy_batch(ch, keys, 4, out, sizeof(*out), NULL);
+        ck_assert_int_eq(res, 2);
+        ck_assert_int_eq(out[0], 7);
+        ck_assert_int_eq(out[2], 11);
+
+        res = coolhash_mem(ch, 0, &mem);
+        ck_assert_int_eq(res, 0);
+        ck_assert_uint_eq(mem.buckets, ch->tables[0].size * sizeof(uint32_t));
+        ck_assert_uint_eq(mem.nodes, ch->tables[0].n *
+                        (sizeof(struct coolhash_small_entry) -
+                         sizeof(uint32_t)));
+        ck_assert_int_eq(coolhash_compact(ch, 0), 0);
+        ck_assert_uint_le(ch->tables[0].size, 64);
+        for (i = 0; i < 64; i++) {
+                res = coolhash_get_copy(ch, i, &cpy, sizeof(cpy));
+                ck_assert_int_eq(res, i == 3 || i == 5 ? -1 : 0);
+        }
+
+        coolhash_free(ch);
+
+        /* Writers, readers and deleters on the same shards */
+        ch = coolhash_new(&profile);
+        ck_assert_ptr_ne(ch, NULL);
+        test_coolhash_trylock_ch = ch;
+
+        for (i = 0; i < TEST_SMALL_THREADS * TEST_SMALL_KEYS; i++)
+                test_coolhash_small_vals[i] = i;
+
+        for (i = 0; i < TEST_SMALL_THREADS; i++)
+                pthread_create(&threads[i], NULL, test_coolhash_small_thread,
+                                (void *) (intptr_t) i);
+        for (i = 0; i < TEST_SMALL_THREADS; i++) {
+                pthread_join(threads[i], &ret);
+                ck_assert_ptr_eq(ret, NULL);
+        }
+
+        sum = 0;
+        coolhash_foreach_ro(ch, test_coolhash_foreach_cb, &sum);
+        ck_assert_uint_le(ch->tables[0].n + ch->tables[1].n,
+                        TEST_SMALL_THREADS * TEST_SMALL_KEYS);
+
+        coolhash_free(ch);
+}
+END_TEST
+
 Suite *coolhash_suite(void)
 {
         Suite *s;
@@ -239,6 +1730,21 @@ Suite *coolhash_suite(void)
         tcase_add_test(tc_core, test_coolhash_set_del);
         tcase_add_test(tc_core, test_coolhash_foreach);
         tcase_add_test(tc_core, test_coolhash_auto_rehash);
+        tcase_add_test(tc_core, test_coolhash_wbuf);
+        tcase_add_test(tc_core, test_coolhash_combining);
+        tcase_add_test(tc_core, test_coolhash_maint);
+        tcase_add_test(tc_core, test_coolhash_changelog);
+        tcase_add_test(tc_core, test_coolhash_compact);
+        tcase_add_test(tc_core, test_coolhash_tmpl);
+        tcase_add_test(tc_core, test_coolhash_hugepages);
+        tcase_add_test(tc_core, test_coolhash_bloom);
+        tcase_add_test(tc_core, test_coolhash_cuckoo);
+        tcase_add_test(tc_core, test_coolhash_trylock);
+        tcase_add_test(tc_core, test_coolhash_batch);
+        tcase_add_test(tc_core, test_coolhash_snapshot);
+        tcase_add_test(tc_core, test_coolhash_index);
+        tcase_add_test(tc_core, test_coolhash_keyh);
+        tcase_add_test(tc_core, test_coolhash_small);
         suite_add_tcase(s, tc_core);
 
         return s;
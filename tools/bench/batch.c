@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../src/coolhash.h"
+
+#define BENCH_SHARDS 16 /**< Number of shards */
+#define BENCH_BATCH 256 /**< Keys per coolhash_get_copy_batch call */
+
+/**
+ * @brief Monotonic clock in seconds
+ *
+ * @return Seconds
+ */
+static double bench_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Compare a loop of coolhash_get_copy calls with the same random
+ * lookups done through coolhash_get_copy_batch
+ *
+ * Usage: batch [engine [items [hugepages]]]
+ *   engine     0 chain (default), 1 cuckoo, 2 small
+ *   items      Items in the table and lookups made (default 4000000)
+ *   hugepages  1 to back buckets and nodes with hugepages (default 0)
+ */
+int main(int argc, char **argv)
+{
+        struct coolhash *ch;
+        struct coolhash_profile profile;
+        coolhash_key_t *keys;
+        unsigned int n, i;
+        long *vals, *out, sum, cpy;
+        double t, loop, batch;
+        int engine, hugepages;
+
+        engine = argc > 1 ? atoi(argv[1]) : COOLHASH_ENGINE_CHAIN;
+        n = argc > 2 ? (unsigned int) strtoul(argv[2], NULL, 10) : 4000000;
+        hugepages = argc > 3 ? atoi(argv[3]) : 0;
+
+        coolhash_profile_init(&profile);
+        coolhash_profile_set_shards(&profile, BENCH_SHARDS);
+        coolhash_profile_set_size(&profile, BENCH_SHARDS);
+        coolhash_profile_set_engine(&profile, engine);
+        coolhash_profile_set_hugepages(&profile, hugepages);
+
+        ch = coolhash_new(&profile);
+        vals = malloc(n * sizeof(*vals));
+        keys = malloc(n * sizeof(*keys));
+        out = malloc(n * sizeof(*out));
+        if (ch == NULL || vals == NULL || keys == NULL || out == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+        }
+
+        /* Spread the keys; the small engine needs them below 2^32 */
+        for (i = 0; i < n; i++) {
+                vals[i] = i;
+                coolhash_set(ch, (coolhash_key_t) i * 2654435761U % 0xffffffffU,
+                                &vals[i]);
+        }
+
+        srand(1);
+        for (i = 0; i < n; i++)
+                keys[i] = (coolhash_key_t) (rand() % n) * 2654435761U %
+                        0xffffffffU;
+
+        sum = 0;
+        t = bench_now();
+        for (i = 0; i < n; i++) {
+                if (coolhash_get_copy(ch, keys[i], &cpy, sizeof(cpy)) == 0)
+                        sum += cpy;
+        }
+        loop = bench_now() - t;
+
+        t = bench_now();
+        for (i = 0; i < n; i += BENCH_BATCH)
+                coolhash_get_copy_batch(ch, keys + i,
+                                n - i < BENCH_BATCH ? n - i : BENCH_BATCH,
+                                out + i, sizeof(*out), NULL);
+        batch = bench_now() - t;
+
+        printf("engine %d, hugepages %d, %u items, %u lookups: loop %.3fs, "
+                        "batch of %d %.3fs (%ld)\n", engine, hugepages, n, n,
+                        loop, BENCH_BATCH, batch, sum);
+
+        coolhash_free(ch);
+        free(out);
+        free(keys);
+        free(vals);
+
+        return 0;
+}
+
+/* vim: set et ts=8 sw=8 sts=8: */